@@ -0,0 +1,105 @@
+/*
+ * linux/fs/nvmm/aio.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Asynchronous reads and writes. io_submit() only queues the request,
+ * workers of an unbound workqueue run it in the mm of the submitter
+ * and with its credentials, and complete it with aio_complete(), in
+ * whatever order they finish, so one thread keeps many large writes in
+ * flight.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/aio.h>
+#include <linux/cred.h>
+#include <linux/mmu_context.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <asm/uaccess.h>
+#include "nvmm.h"
+
+struct nvmm_aio {
+	struct work_struct work;
+	struct kiocb *iocb;
+	nvmm_aio_fn fn;
+	struct mm_struct *mm;		/* mm of the submitter, referenced */
+	const struct cred *cred;	/* credentials of the submitter, referenced */
+	loff_t pos;
+	unsigned long nr_segs;
+	struct iovec iov[0];		/* the caller frees its own copy */
+};
+
+static struct workqueue_struct *nvmm_aio_wq;
+
+static void nvmm_aio_work(struct work_struct *work)
+{
+	struct nvmm_aio *req = container_of(work, struct nvmm_aio, work);
+	mm_segment_t oldfs = get_fs();
+	const struct cred *old_cred;
+	ssize_t ret;
+
+	old_cred = override_creds(req->cred);
+	use_mm(req->mm);
+	set_fs(USER_DS);
+	ret = req->fn(req->iocb, req->iov, req->nr_segs, req->pos);
+	set_fs(oldfs);
+	unuse_mm(req->mm);
+	mmput(req->mm);
+	revert_creds(old_cred);
+	put_cred(req->cred);
+
+	aio_complete(req->iocb, ret, 0);
+	kfree(req);
+}
+
+/*
+ * input :
+ * @iocb : kernel io control block of an io_submit()
+ * @iov : user buffers
+ * @nr_segs : number of user buffers
+ * @pos : file position
+ * @fn : the synchronous read or write
+ * returns :
+ * -EIOCBQUEUED, or the result of @fn run at once when the request can
+ * not be queued
+ */
+ssize_t nvmm_aio_queue(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, nvmm_aio_fn fn)
+{
+	struct nvmm_aio *req;
+
+	if (!nvmm_aio_wq || !current->mm)
+		return fn(iocb, iov, nr_segs, pos);
+
+	req = kmalloc(sizeof(*req) + nr_segs * sizeof(struct iovec), GFP_KERNEL);
+	if (!req)
+		return fn(iocb, iov, nr_segs, pos);
+
+	INIT_WORK(&req->work, nvmm_aio_work);
+	req->iocb = iocb;
+	req->fn = fn;
+	req->pos = pos;
+	req->nr_segs = nr_segs;
+	memcpy(req->iov, iov, nr_segs * sizeof(struct iovec));
+	atomic_inc(&current->mm->mm_users);
+	req->mm = current->mm;
+	req->cred = get_current_cred();
+
+	queue_work(nvmm_aio_wq, &req->work);
+	return -EIOCBQUEUED;
+}
+
+int nvmm_aio_init(void)
+{
+	nvmm_aio_wq = alloc_workqueue("nvmm_aio", WQ_UNBOUND, 0);
+	return nvmm_aio_wq ? 0 : -ENOMEM;
+}
+
+void nvmm_aio_exit(void)
+{
+	destroy_workqueue(nvmm_aio_wq);
+}
@@ -120,7 +120,7 @@ unsigned long nvmm_get_zeroed_page(struct super_block *sb)
 {
 	phys_addr_t physaddr= 0;
 	nvmm_new_block(sb, &physaddr, 1, 1);
-    	memset(__va(physaddr), 0x00, PAGE_SIZE);
+    	nvmm_memzero_persist(__va(physaddr), PAGE_SIZE);
 	return (unsigned long)__va(physaddr);
 
 }
@@ -131,7 +131,7 @@ struct page * nvmm_new_page(struct super_block *sb, int zero)
 	if(nvmm_new_block(sb, &phys, zero, 1))
 		return NULL;
 	else
-        	memset(__va(phys), 0x00, PAGE_SIZE);
+        	nvmm_memzero_persist(__va(phys), PAGE_SIZE);
 		return pfn_to_page(phys >> PAGE_SHIFT);
 }
 
@@ -147,7 +147,12 @@ void nvmm_free_block(struct super_block *sb, unsigned long pagefn)
 
 	phys_addr_t temp_phys;
 	temp_phys = pagefn << PAGE_SHIFT;
-	memset(__va(temp_phys), 0, PAGE_SIZE);
+
+	/* a block shared with a clone only loses a reference */
+	if (nvmm_ref_put(sb, __va(temp_phys)))
+		return;
+
+	nvmm_memzero_persist(__va(temp_phys), PAGE_SIZE);
 
 //	spin_lock(&superblock_lock);
 //	mutex_lock(&NVMM_SB(sb)->s_lock);
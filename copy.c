@@ -0,0 +1,224 @@
+/*
+ * linux/fs/nvmm/copy.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Copy engine for large transfers. A job is split into items, the
+ * caller queues it on the list of its node and runs items itself while
+ * kernel threads of every node take the others: a thread serves the
+ * jobs of its own node first and steals from the other nodes when it
+ * has nothing to do. The caller returns when all items are done, so a
+ * write can swap its pointers right after. The threads borrow the mm of
+ * the caller to reach its user buffers.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/mmu_context.h>
+#include <linux/slab.h>
+#include <asm/uaccess.h>
+#include "nvmm.h"
+
+/* copy threads of one node at most */
+#define NVMM_COPY_THREADS	4
+
+struct nvmm_copy_node {
+	spinlock_t lock;
+	struct list_head jobs;		/* jobs with items left */
+	wait_queue_head_t wait;		/* idle threads of the node */
+};
+
+static struct nvmm_copy_node *nvmm_copy_nodes;
+static struct task_struct **nvmm_copy_threads;
+static int nvmm_copy_nr_threads;
+static atomic_t nvmm_copy_queued = ATOMIC_INIT(0);
+
+static void nvmm_copy_unqueue(struct nvmm_copy_job *job);
+
+/*
+ * run the items of @job nobody took yet, the items left once an item
+ * failed are skipped. The job leaves its list with its last item, an
+ * idle thread sleeps rather than grab it again and find nothing.
+ */
+static void nvmm_copy_items(struct nvmm_copy_job *job)
+{
+	unsigned long i;
+	int err;
+
+	while ((i = atomic_long_inc_return(&job->next) - 1) < job->nr) {
+		if (i == job->nr - 1)
+			nvmm_copy_unqueue(job);
+		if (ACCESS_ONCE(job->err))
+			continue;
+		err = job->fn(job, i);
+		if (err)
+			cmpxchg(&job->err, 0, err);
+	}
+}
+
+/*
+ * take @job off its list, all its items are taken. A job run by the
+ * caller alone was never queued.
+ */
+static void nvmm_copy_unqueue(struct nvmm_copy_job *job)
+{
+	struct nvmm_copy_node *cn;
+
+	if (list_empty_careful(&job->list))
+		return;
+	cn = &nvmm_copy_nodes[job->node];
+	spin_lock(&cn->lock);
+	if (!list_empty(&job->list)) {
+		list_del_init(&job->list);
+		atomic_dec(&nvmm_copy_queued);
+	}
+	spin_unlock(&cn->lock);
+}
+
+/*
+ * returns :
+ * the first job queued on @node, held until nvmm_copy_put(), or NULL
+ */
+static struct nvmm_copy_job *nvmm_copy_grab(int node)
+{
+	struct nvmm_copy_node *cn = &nvmm_copy_nodes[node];
+	struct nvmm_copy_job *job = NULL;
+
+	spin_lock(&cn->lock);
+	if (!list_empty(&cn->jobs)) {
+		job = list_first_entry(&cn->jobs, struct nvmm_copy_job, list);
+		atomic_inc(&job->active);
+	}
+	spin_unlock(&cn->lock);
+	return job;
+}
+
+static void nvmm_copy_put(struct nvmm_copy_job *job)
+{
+	if (atomic_dec_and_test(&job->active))
+		complete(&job->done);
+}
+
+static int nvmm_copy_thread(void *arg)
+{
+	int node = (long)arg, n;
+	struct nvmm_copy_job *job;
+	mm_segment_t oldfs;
+
+	while (!kthread_should_stop()) {
+		/* the own node first, then steal */
+		job = NULL;
+		for (n = 0; n < nr_node_ids && !job; n++)
+			if (node_online((node + n) % nr_node_ids))
+				job = nvmm_copy_grab((node + n) % nr_node_ids);
+
+		if (!job) {
+			wait_event_interruptible(nvmm_copy_nodes[node].wait,
+					atomic_read(&nvmm_copy_queued) ||
+					kthread_should_stop());
+			continue;
+		}
+
+		/* the items copy from user buffers of the caller, as aio.c */
+		use_mm(job->mm);
+		oldfs = get_fs();
+		set_fs(USER_DS);
+		nvmm_copy_items(job);
+		set_fs(oldfs);
+		unuse_mm(job->mm);
+		nvmm_copy_unqueue(job);
+		nvmm_copy_put(job);
+	}
+	return 0;
+}
+
+/*
+ * input :
+ * @job : the job, with fn, data and nr set
+ * returns :
+ * 0 if every item succeeded else the error of the first one that failed
+ * a job of one item, or one from a kernel buffer, runs in the caller
+ */
+int nvmm_copy_run(struct nvmm_copy_job *job)
+{
+	struct nvmm_copy_node *cn;
+	int node;
+
+	job->err = 0;
+	atomic_long_set(&job->next, 0);
+	INIT_LIST_HEAD(&job->list);
+
+	if (job->nr < 2 || !nvmm_copy_nr_threads || !current->mm ||
+			segment_eq(get_fs(), KERNEL_DS)) {
+		nvmm_copy_items(job);
+		return job->err;
+	}
+
+	job->mm = current->mm;
+	job->node = numa_node_id();
+	atomic_set(&job->active, 1);
+	init_completion(&job->done);
+
+	cn = &nvmm_copy_nodes[job->node];
+	spin_lock(&cn->lock);
+	list_add_tail(&job->list, &cn->jobs);
+	atomic_inc(&nvmm_copy_queued);
+	spin_unlock(&cn->lock);
+	for_each_online_node(node)
+		wake_up(&nvmm_copy_nodes[node].wait);
+
+	nvmm_copy_items(job);
+	nvmm_copy_unqueue(job);
+	if (!atomic_dec_and_test(&job->active))
+		wait_for_completion(&job->done);
+	return job->err;
+}
+
+/*
+ * start the copy threads, bound to the cpus of their node, at module load.
+ * Without threads the jobs simply run in the caller.
+ */
+int nvmm_copy_init(void)
+{
+	struct task_struct *t;
+	int node, i, n;
+
+	nvmm_copy_nodes = kcalloc(nr_node_ids, sizeof(*nvmm_copy_nodes), GFP_KERNEL);
+	if (!nvmm_copy_nodes)
+		return -ENOMEM;
+	for (node = 0; node < nr_node_ids; node++) {
+		spin_lock_init(&nvmm_copy_nodes[node].lock);
+		INIT_LIST_HEAD(&nvmm_copy_nodes[node].jobs);
+		init_waitqueue_head(&nvmm_copy_nodes[node].wait);
+	}
+
+	nvmm_copy_threads = kcalloc(nr_node_ids * NVMM_COPY_THREADS,
+			sizeof(struct task_struct *), GFP_KERNEL);
+	if (!nvmm_copy_threads)
+		return 0;
+
+	for_each_node_state(node, N_CPU) {
+		n = min_t(int, cpumask_weight(cpumask_of_node(node)), NVMM_COPY_THREADS);
+		for (i = 0; i < n; i++) {
+			t = kthread_create_on_node(nvmm_copy_thread, (void *)(long)node,
+					node, "nvmm_copy/%d:%d", node, i);
+			if (IS_ERR(t))
+				break;
+			set_cpus_allowed_ptr(t, cpumask_of_node(node));
+			nvmm_copy_threads[nvmm_copy_nr_threads++] = t;
+			wake_up_process(t);
+		}
+	}
+	return 0;
+}
+
+void nvmm_copy_exit(void)
+{
+	while (nvmm_copy_nr_threads)
+		kthread_stop(nvmm_copy_threads[--nvmm_copy_nr_threads]);
+	kfree(nvmm_copy_threads);
+	kfree(nvmm_copy_nodes);
+}
@@ -26,6 +26,14 @@ static inline unsigned nvmm_chunk_size(struct inode *inode)
 	return inode->i_sb->s_blocksize;
 }
 
+/* the entry bytes at @p are written back by the next fsync of @dir */
+static inline void nvmm_dir_track(struct inode *dir, void *p, size_t len)
+{
+	nvmm_sync_track(dir, (char *)p - (char *)NVMM_I(dir)->i_virt_addr, len);
+}
+
+#define NVMM_DIR_HEAD	offsetof(struct nvmm_dir_entry, name)
+
 /*
   compare the 'name' with the dentry 'de'
  */
@@ -284,6 +292,7 @@ void nvmm_set_link(struct inode *dir, struct nvmm_dir_entry *de, struct inode *i
     
     de->inode = cpu_to_le64(inode->i_ino);
     nvmm_set_de_type(de, inode);
+    nvmm_dir_track(dir, de, NVMM_DIR_HEAD);
     if(likely(update_times))
         dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
     NVMM_I(dir)->i_flags &= ~NVMM_BTREE_FL;
@@ -307,7 +316,7 @@ int nvmm_add_link(struct dentry *dentry,struct inode *inode)
         struct nvmm_inode_info *ni;
     	struct nvmm_dir_entry *de;
     	char *vaddr,*eaddr;
-        char *dir_end;
+        char *dir_end, *start;
         struct page *page;
     	int err = 0;
         int i;
@@ -376,7 +385,7 @@ need_new_block:
         de->inode = 0;
 
 got_it:
-	
+	start = (char *)de;
 
 	if(de->inode){
 	struct nvmm_dir_entry *de1 = (struct nvmm_dir_entry *)((char *)de + name_len);
@@ -391,6 +400,7 @@ got_it:
     	memcpy(de->name,name,namelen);
     	de->inode = cpu_to_le64(inode->i_ino);
     	nvmm_set_de_type(de,inode);
+    	nvmm_dir_track(dir, start, de->name + namelen - start);
     	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
     	NVMM_I(dir)->i_flags &= ~NVMM_BTREE_FL;
         unlock_page(page);
@@ -427,6 +437,8 @@ int nvmm_delete_entry(struct nvmm_dir_entry *dir,struct nvmm_dir_entry **pdir,
     temp = le16_to_cpu(prev->rec_len);
     temp += rec_len;
     prev->rec_len = cpu_to_le16(temp);
+    nvmm_dir_track(parent, dir, NVMM_DIR_HEAD);
+    nvmm_dir_track(parent, prev, NVMM_DIR_HEAD);
     parent->i_ctime = parent->i_mtime = CURRENT_TIME_SEC;
     NVMM_I(parent)->i_flags &= ~NVMM_BTREE_FL;
 
@@ -485,6 +497,7 @@ int nvmm_make_empty(struct inode *inode,struct inode *parent)
     	de->inode = cpu_to_le32(parent->i_ino);
    	memcpy(de->name,"..\0",4);
    	nvmm_set_de_type(de,inode);
+	nvmm_sync_track(inode, 0, (char *)de->name + 4 - (char *)vaddr);
 fail:
 	/*destroy table mapping*/
 	err = nvmm_destroy_mapping(inode); //maybe wrong ,don't assign the err
@@ -555,7 +568,7 @@ const struct file_operations nvmm_dir_operations = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= nvmm_compat_ioctl,
 #endif
-	.fsync		= noop_fsync,
+	.fsync		= nvmm_fsync,
 };
 
 
@@ -15,6 +15,8 @@
 #include <linux/uio.h>
 #include <linux/mm.h>
 #include <linux/uaccess.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
 #include "nvmm.h"
 #include "acl.h"
 #include "xip.h"
@@ -41,7 +43,7 @@ static size_t __nvmm_iov_copy_from(char *vaddr, const struct iovec *iov, size_t
 		int copy = min(bytes, iov->iov_len - base);
 
 		base = 0;
-		left = __copy_from_user(vaddr, buf, copy);
+		left = nvmm_copy_from_user_persist(vaddr, buf, copy);
 		copied += copy;
 		bytes -= copy;
 		vaddr += copy;
@@ -86,11 +88,12 @@ static size_t __nvmm_iov_copy_to(char *vaddr, const struct iovec *iov, size_t ba
 
 /*
  * input :
- * @to : start virtual address
+ * @to : start virtual address in NVM
  * @i : io iterator
  * @bytes : the size to be copied
  * returns :
  * 0 if success else the left size non copied
+ * the bytes are written back, the caller fences them
  */
 
 
@@ -100,7 +103,7 @@ static size_t nvmm_iov_copy_from(void * to, struct iov_iter *i, size_t bytes)
 	if(likely(i->nr_segs == 1)){
 		int left;
 		char __user *buf = i->iov->iov_base + i->iov_offset;
-		left = __copy_from_user(to, buf, bytes);
+		left = nvmm_copy_from_user_persist(to, buf, bytes);
 		copied = bytes - left;
 	}else{
 		copied = __nvmm_iov_copy_from(to, i->iov, i->iov_offset, bytes);
@@ -129,6 +132,103 @@ static size_t nvmm_iov_copy_to(void *from, struct iov_iter *i, size_t bytes)
 	}
 	return copied;
 }
+
+/*
+ * input :
+ * @i : io iterator
+ * @bytes : the size to be cleared
+ * returns :
+ * the size cleared
+ * fill user buffer with zeros, used when reading a hole
+ */
+static size_t nvmm_iov_zero(struct iov_iter *i, size_t bytes)
+{
+	const struct iovec *iov = i->iov;
+	size_t base = i->iov_offset;
+	size_t cleared = 0, left = 0;
+
+	while(bytes){
+		char __user *buf = iov->iov_base + base;
+		size_t len = min(bytes, iov->iov_len - base);
+
+		base = 0;
+		left = __clear_user(buf, len);
+		cleared += len - left;
+		bytes -= len;
+		iov++;
+
+		if(unlikely(left))
+			break;
+	}
+	return cleared;
+}
+
+/* a contiguous copy between NVM and user space, split for the copy engine */
+struct nvmm_copy_range {
+	void *kaddr;
+	struct iov_iter *iter;
+	size_t bytes;
+	int rw;
+	unsigned long bad;	/* first chunk that failed */
+};
+
+static int nvmm_copy_range_fn(struct nvmm_copy_job *job, unsigned long i)
+{
+	struct nvmm_copy_range *r = job->data;
+	size_t off = i * NVMM_COPY_CHUNK;
+	size_t bytes = min_t(size_t, r->bytes - off, NVMM_COPY_CHUNK);
+	struct iov_iter it = *r->iter;
+	unsigned long bad;
+	size_t done;
+
+	iov_iter_advance(&it, off);
+	if(r->rw == WRITE)
+		done = nvmm_iov_copy_from(r->kaddr + off, &it, bytes);
+	else
+		done = nvmm_iov_copy_to(r->kaddr + off, &it, bytes);
+	if(done == bytes)
+		return 0;
+
+	do{
+		bad = r->bad;
+		if(bad <= i)
+			break;
+	}while(cmpxchg(&r->bad, bad, i) != bad);
+	return -EFAULT;
+}
+
+/*
+ * input :
+ * @kaddr : start virtual address in NVM, @bytes are contiguous from it
+ * @iter : io iterator
+ * @bytes : the size to be copied
+ * @rw : WRITE copies to @kaddr, READ from it
+ * returns :
+ * the size copied, as nvmm_iov_copy_from(), the iterator is not advanced
+ * large transfers are spread over the copy engine, after a fault only
+ * the chunks before the failed one are counted
+ */
+static size_t nvmm_iov_copy(void *kaddr, struct iov_iter *iter, size_t bytes, int rw)
+{
+	struct nvmm_copy_range r;
+	struct nvmm_copy_job job;
+
+	if(bytes < NVMM_COPY_MIN)
+		return rw == WRITE ? nvmm_iov_copy_from(kaddr, iter, bytes) :
+			nvmm_iov_copy_to(kaddr, iter, bytes);
+
+	r.kaddr = kaddr;
+	r.iter = iter;
+	r.bytes = bytes;
+	r.rw = rw;
+	r.bad = ULONG_MAX;
+	job.fn = nvmm_copy_range_fn;
+	job.data = &r;
+	job.nr = DIV_ROUND_UP(bytes, NVMM_COPY_CHUNK);
+	if(!nvmm_copy_run(&job))
+		return bytes;
+	return r.bad * NVMM_COPY_CHUNK;
+}
 /*
  * input :
  * @inode : vfs inode, the file to be open
@@ -191,8 +291,8 @@ static int nvmm_release_file(struct file * file)
 
 static unsigned long nvmm_find_atomic_pointer_level(loff_t offset, size_t length)
 {
-	size_t end_write_position = offset + length - 1;
-	int start_write_num, end_write_num;
+	loff_t end_write_position = offset + length - 1;
+	unsigned long start_write_num, end_write_num;
 	unsigned long page_num_mask = 0;
 
 	//PTE_ENTRY ?
@@ -219,338 +319,1836 @@ static unsigned long nvmm_find_atomic_pointer_level(loff_t offset, size_t length
 		return page_num_mask;
 	}
 
-	//PGD_ENTRY
-	start_write_num = offset >> PGDIR_SHIFT;
-	end_write_num = end_write_position >> PGDIR_SHIFT;
-	if(start_write_num == end_write_num){
-		page_num_mask = 0x7ffffff;
-		return page_num_mask;
+	//PGD_ENTRY, also for writes crossing a 512GB span, they go in place
+	page_num_mask = 0x7ffffff;
+	return page_num_mask;
+}
+
+/*
+ * input :
+ * @dst : fresh zeroed page
+ * @src : the page it replaces, NULL for a hole
+ * @pos : file position of the write inside this page
+ * @bytes : the size written to this page
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * 0 if success else -EFAULT
+ * only the bytes around the write are copied from the old page
+ */
+static int nvmm_shadow_fill_page(void *dst, void *src, loff_t pos, size_t bytes, struct iov_iter *iter)
+{
+	unsigned long in_page = pos & PAGE_SIZE_1;
+	size_t copied;
+
+	if(src){
+		if(in_page)
+			nvmm_memcpy_persist(dst, src, in_page);
+		if(in_page + bytes < PAGE_SIZE)
+			nvmm_memcpy_persist(dst + in_page + bytes, src + in_page + bytes, PAGE_SIZE - in_page - bytes);
 	}
 
-	return page_num_mask;
+	copied = nvmm_iov_copy_from(dst + in_page, iter, bytes);
+	iov_iter_advance(iter, copied);
+	return copied == bytes ? 0 : -EFAULT;
 }
 
-/**
- * allocate pages for temp file
- * @consistency_i : consistency file vfs inode
- * @offset : writing start address
- * @length : writing length
- * @size : origin file size
- * @page_num_mask : update level of origin file, this also reflect pages to allocate for temp file
- * return 0 if success else 1
-*/
+/*
+ * input :
+ * @sb : vfs super block
+ * @old : pte page of the file covering the write, NULL if missing
+ * @pos : start of the part of the write inside this pte page
+ * @length : the size of that part
+ * @iter : io iterator
+ * returns :
+ * the shadow pte page, ERR_PTR(-ENOSPC) or ERR_PTR(-EFAULT) on error
+ * the shadow page shares the untouched data pages with @old, the
+ * touched ones are fresh pages holding the old data plus the write
+ */
+static pte_t *nvmm_shadow_build_pte(struct super_block *sb, pte_t *old, loff_t pos, size_t length, struct iov_iter *iter)
+{
+	unsigned long first = (pos >> PAGE_SHIFT) & (PTRS_PER_PTE - 1);
+	unsigned long i = first;
+	loff_t end = pos + length;
+	size_t bytes;
+	pte_t *new;
+	void *data, *src;
+	int err = -ENOSPC;
+
+	new = nvmm_shadow_get(sb);
+	if(!new)
+		return ERR_PTR(-ENOSPC);
+	if(old)
+		nvmm_memcpy_persist(new, old, PAGE_SIZE);
+
+	for(; pos < end; pos += bytes, i++){
+		bytes = min_t(size_t, end - pos, PAGE_SIZE - (pos & PAGE_SIZE_1));
+		src = (old && !pte_none(old[i])) ?
+			__va((pte_val(old[i]) & 0x0fffffffffffffff) & PAGE_MASK) : NULL;
+		data = nvmm_shadow_get(sb);
+		if(!data)
+			goto fail;
+		set_pte(&new[i], pfn_pte(__pa(data) >> PAGE_SHIFT, PAGE_KERNEL));
+		err = nvmm_shadow_fill_page(data, src, pos, bytes, iter);
+		if(err){
+			i++;
+			goto fail;
+		}
+	}
+	nvmm_flush_buffer(&new[first], (i - first) * sizeof(pte_t), false);
+	return new;
+
+fail:
+	nvmm_shadow_release_pte(sb, new, first, i);
+	return ERR_PTR(err);
+}
 
-static int nvmm_alloc_consistency_file_pages(struct inode *consistency_i , loff_t offset, size_t length, size_t size, unsigned long page_num_mask)
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write, inside one page
+ * @length : the size of the write
+ * @iter : io iterator
+ * returns :
+ * 0 if success else error code
+ * PTE_ENTRY level: one fresh data page replaces one pte entry. The old
+ * page is copied without i_alloc_mutex, the copy is done again if a
+ * fault filled the hole meanwhile.
+ */
+static int nvmm_shadow_write_pte(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
 {
-	int retval = 0;
-	int pages_to_alloc = 0;
-	size_t end_length = offset + length;
+	struct super_block *sb = inode->i_sb;
+	unsigned long vaddr = (unsigned long)NVMM_I(inode)->i_virt_addr + (offset & PAGE_MASK);
+	struct nvmm_reclaim *rc;
+	struct iov_iter it;
+	pte_t *pte, old;
+	void *data, *src;
+	int retval;
 
-	if(end_length >= size){
-		pages_to_alloc = (end_length + PAGE_SIZE_1) >> PAGE_SHIFT;
-	}else{
-		pages_to_alloc = (size + PAGE_SIZE_1) >> PAGE_SHIFT;
+	rc = nvmm_reclaim_alloc(sb, 1);
+	if(!rc)
+		return -ENOMEM;
+	data = nvmm_shadow_get(sb);
+	if(!data){
+		retval = -ENOSPC;
+		goto out;
 	}
-	
-	pages_to_alloc &= page_num_mask;
-	if(0 == pages_to_alloc)
-		pages_to_alloc = (1 == page_num_mask) ? page_num_mask : (page_num_mask + 1);
-	retval = nvmm_alloc_blocks(consistency_i, pages_to_alloc);
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	pte = nvmm_file_pte_alloc(sb, inode, offset);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	if(!pte){
+		retval = -ENOMEM;
+		goto out_put;
+	}
+
+again:
+	old = *pte;
+	src = pte_none(old) ? NULL :
+		__va((pte_val(old) & 0x0fffffffffffffff) & PAGE_MASK);
+	it = *iter;
+	retval = nvmm_shadow_fill_page(data, src, offset, length, &it);
+	if(retval)
+		goto out_put;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	if(pte_val(*pte) != pte_val(old)){
+		mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+		goto again;
+	}
+	nvmm_tc_invalidate(inode);
+	nvmm_persist_entry(pte, pte_val(pfn_pte(__pa(data) >> PAGE_SHIFT, PAGE_KERNEL)));
+	if(!pte_none(old))
+		inode->i_blocks--;
+	inode->i_blocks++;
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	*iter = it;
+
+	if(offset < MAX_FILE_SIZE)
+		flush_tlb_kernel_range(vaddr, vaddr + PAGE_SIZE);
+	unmap_mapping_range(inode->i_mapping, offset & PAGE_MASK, PAGE_SIZE, 1);
+	if(!pte_none(old))
+		nvmm_reclaim_add(rc, __va((pte_val(old) & 0x0fffffffffffffff) & PAGE_MASK));
+	nvmm_reclaim_defer(rc);
+	return 0;
+
+out_put:
+	nvmm_shadow_put(sb, data);
+out:
+	kfree(rc);
 	return retval;
 }
 
-/**
- * fetch value from PTE_ENTRY and turn it into struct page
- * @pte_t : PTE_ENTRY
- * @offset : offset to origin file
-*/
+/*
+ * count the entries of [first, end) present in the pte page @pte
+ */
+static unsigned long nvmm_shadow_count(pte_t *pte, unsigned long first, unsigned long end)
+{
+	unsigned long i, nr = 0;
+
+	for(i = first; pte && i < end; i++)
+		if(!pte_none(pte[i]))
+			nr++;
+	return nr;
+}
 
-static inline struct page *nvmm_get_pte_entry(pte_t * const pte)
+/* pages of one journal write, the size and block count take two records */
+#define NVMM_WRITE_RECS		(NVMM_JOURNAL_RECS - 2)
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @end : end of a write
+ * add the block count of @inode to the open transaction, and the size
+ * when the write extends the file, so that both come with its entries
+ */
+static void nvmm_journal_add_size(struct inode *inode, loff_t end)
 {
-	return pfn_to_page(pte_pfn(*pte));
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+
+	nvmm_memunlock_inode(inode->i_sb, ni);
+	nvmm_journal_add(inode->i_sb, &ni->i_blocks, inode->i_blocks);
+	if(end > i_size_read(inode))
+		nvmm_journal_add(inode->i_sb, &ni->i_size, end);
 }
 
-/**
- * find atomic updating pointer, switch it with the temp file
- * @sb : vfs super_block
- * @normal_i : normal file vfs inode
- * @consistency_i : consistency file vfs inode
- * @offset : start write relative position of origin file
- * @page_num_mask : update level of origin file, this also reflect pages to allocate for temp file
-*/
+/*
+ * the transaction of nvmm_journal_add_size() is committed, publish the
+ * size in memory too
+ */
+static void nvmm_journal_set_size(struct inode *inode, loff_t end)
+{
+	nvmm_memlock_inode(inode->i_sb, nvmm_get_inode(inode->i_sb, inode->i_ino));
+	if(end > i_size_read(inode))
+		i_size_write(inode, end);
+}
 
-static void nvmm_atomic_update_pointer(struct super_block *sb, struct inode *normal_i, struct inode *consistency_i, loff_t offset, unsigned long page_num_mask)
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write
+ * @length : the size of the write, at most NVMM_WRITE_RECS pages
+ * @iter : io iterator
+ * returns :
+ * 0 if success else error code
+ * every touched page gets a fresh page, only the head and tail pages
+ * take old data, and the new pte entries are committed together
+ * through the journal, whatever 2MB or 1GB lines the write crosses.
+ * The pages are filled again if a fault filled a hole meanwhile.
+ */
+static int nvmm_journal_write(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
 {
-	pud_t *pud_normal, *pud_con;
-	pmd_t *pmd_normal, *pmd_con;
-	pte_t *pte_normal, *pte_con;
-	struct page *pg_normal, *pg_con;
+	struct super_block *sb = inode->i_sb;
+	unsigned long vaddr = (unsigned long)NVMM_I(inode)->i_virt_addr;
+	unsigned long first = offset >> PAGE_SHIFT;
+	unsigned long nr = ((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) - first;
+	unsigned long i, end_blocknr;
+	loff_t pos, end = offset + length;
+	size_t bytes;
+	struct nvmm_reclaim *rc;
+	struct iov_iter it;
+	pte_t **ptes, *old;
+	void **data, *src;
+	int retval = 0;
 
-	pud_normal = nvmm_get_pud(sb, normal_i->i_ino);
-	pud_normal += (offset >> PUD_SHIFT);
-	pud_con = nvmm_get_pud(sb, consistency_i->i_ino);
-	pmd_con = pmd_offset(pud_con, 0);
-	pte_con = pte_offset_kernel(pmd_con, 0);
-	pg_con = nvmm_get_pte_entry(pte_con);
+	rc = nvmm_reclaim_alloc(sb, nr);
+	if(!rc)
+		return -ENOMEM;
+	ptes = kmalloc(nr * (sizeof(pte_t *) + sizeof(void *) + sizeof(pte_t)), GFP_NOFS);
+	if(!ptes){
+		kfree(rc);
+		return -ENOMEM;
+	}
+	data = (void **)(ptes + nr);
+	old = (pte_t *)(data + nr);
 
-	if(1 == page_num_mask){
-		if(pud_none(*pud_normal)){
-			nvmm_setup_pud(pud_normal, pmd_con);
-			pud_clear(pud_con);
-		}else{
-			pmd_normal = pmd_offset(pud_normal, offset);
-			if(pmd_none(*pmd_normal)){
-				nvmm_setup_pmd(pmd_normal, pte_con);
-				pmd_clear(pmd_con);
-			}else{
-				pte_normal = pte_offset_kernel(pmd_normal, offset);
-				if(!pte_none(*pte_normal)){
-					pg_normal = nvmm_get_pte_entry(pte_normal);
-					nvmm_setup_pte(pte_con, pg_normal);
-				}else{
-					set_pte(pte_con, __pte(0));
-				}
-				nvmm_setup_pte(pte_normal, pg_con);
-			}
+	/* the table pages first, they are kept even if the write fails */
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	for(i = 0; i < nr; i++){
+		ptes[i] = nvmm_file_pte_alloc(sb, inode, (first + i) << PAGE_SHIFT);
+		if(!ptes[i]){
+			retval = -ENOMEM;
+			break;
 		}
-		
-	}else if(0x1ff == page_num_mask){
-		if(pud_none(*pud_normal)){
-			nvmm_setup_pud(pud_normal, pmd_con);
-			pud_clear(pud_con);
-		}else{
-			pmd_normal = pmd_offset(pud_normal, offset);
-			if(!pmd_none(*pmd_normal)){
-				pte_normal = pte_offset_kernel(pmd_normal, offset);
-				nvmm_setup_pmd(pmd_con, pte_normal);
-			}else{
-				pmd_clear(pmd_con);
-			}
-			nvmm_setup_pmd(pmd_normal, pte_con);
+	}
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	if(retval)
+		goto out;
+
+again:
+	it = *iter;
+	for(i = 0, pos = offset; i < nr; i++, pos += bytes){
+		bytes = min_t(size_t, end - pos, PAGE_SIZE - (pos & PAGE_SIZE_1));
+		data[i] = nvmm_shadow_get(sb);
+		if(!data[i]){
+			retval = -ENOSPC;
+			break;
 		}
-	}else if(0x3ffff == page_num_mask){
-		if(!pud_none(*pud_normal)){
-			pmd_normal = pmd_offset(pud_normal, offset);
-			nvmm_setup_pud(pud_con, pmd_normal);
-		}else{
-			pud_clear(pud_con);
+		old[i] = *ptes[i];
+		src = pte_none(old[i]) ? NULL :
+			__va((pte_val(old[i]) & 0x0fffffffffffffff) & PAGE_MASK);
+		retval = nvmm_shadow_fill_page(data[i], src, pos, bytes, &it);
+		if(retval){
+			i++;
+			break;
 		}
-		nvmm_setup_pud(pud_normal, pmd_con);
-	}else{
-		nvmm_error(sb, __FUNCTION__, "atomic update pointer error");
 	}
+	if(retval){
+		while(i--)
+			nvmm_shadow_put(sb, data[i]);
+		goto out;
+	}
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	for(i = 0; i < nr && pte_val(*ptes[i]) == pte_val(old[i]); i++)
+		;
+	if(i < nr){
+		mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+		for(i = 0; i < nr; i++)
+			nvmm_shadow_put(sb, data[i]);
+		goto again;
+	}
+	nvmm_journal_begin(sb);
+	for(i = 0; i < nr; i++){
+		nvmm_journal_add(sb, ptes[i], pte_val(pfn_pte(__pa(data[i]) >> PAGE_SHIFT, PAGE_KERNEL)));
+		if(pte_none(old[i]))
+			inode->i_blocks++;
+	}
+	nvmm_journal_add_size(inode, end);
+	nvmm_tc_invalidate(inode);
+	nvmm_journal_commit(sb);
+	nvmm_journal_set_size(inode, end);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	*iter = it;
+
+	end_blocknr = min(first + nr, MAX_FILE_SIZE >> PAGE_SHIFT);
+	if(first < end_blocknr)
+		flush_tlb_kernel_range(vaddr + (first << PAGE_SHIFT), vaddr + (end_blocknr << PAGE_SHIFT));
+	unmap_mapping_range(inode->i_mapping, (loff_t)first << PAGE_SHIFT, (loff_t)nr << PAGE_SHIFT, 1);
+	for(i = 0; i < nr; i++)
+		if(!pte_none(old[i]))
+			nvmm_reclaim_add(rc, __va((pte_val(old[i]) & 0x0fffffffffffffff) & PAGE_MASK));
+	nvmm_reclaim_defer(rc);
+	rc = NULL;
+
+out:
+	kfree(rc);
+	kfree(ptes);
+	return retval;
 }
 
+/* a pud swap split in its 2MB chunks for the copy engine */
+struct nvmm_pud_build {
+	struct super_block *sb;
+	pmd_t *old, *new;
+	loff_t offset;
+	size_t length;
+	struct iov_iter *iter;
+	unsigned long first;
+};
 
-/**
- *
- *
-*/
+/*
+ * build the shadow pte page of the @n-th 2MB chunk of the write, the
+ * chunks are built in parallel by the copy engine
+ */
+static int nvmm_pud_build_fn(struct nvmm_copy_job *job, unsigned long n)
+{
+	struct nvmm_pud_build *b = job->data;
+	unsigned long i = b->first + n;
+	loff_t pos = n ? (b->offset & PMD_MASK) + ((loff_t)n << PMD_SHIFT) : b->offset;
+	size_t bytes = min_t(size_t, b->offset + b->length - pos, (pos & PMD_MASK) + PMD_SIZE - pos);
+	struct iov_iter it = *b->iter;
+	pte_t *old_pte, *new_pte;
 
-static int nvmm_consistency_function(struct super_block *sb, struct inode *normal_i, loff_t offset, size_t length, struct iov_iter *iter)
+	old_pte = (b->old && !pmd_none(b->old[i])) ? nvmm_get_pte(&b->old[i]) : NULL;
+	iov_iter_advance(&it, pos - b->offset);
+	new_pte = nvmm_shadow_build_pte(b->sb, old_pte, pos, bytes, &it);
+	if(IS_ERR(new_pte))
+		return PTR_ERR(new_pte);
+	set_pmd(&b->new[i], __pmd(__pa(new_pte) | _PAGE_TABLE));
+	return 0;
+}
+
+/*
+ * the entries [*start, *end) of the pte page of chunk @i that a pud
+ * write of [offset, offset + length) touches, @pos is the start of the
+ * part of the write in chunk @i and moves to the next chunk
+ */
+static void nvmm_shadow_chunk(loff_t offset, size_t length, loff_t *pos,
+			unsigned long *start, unsigned long *end)
 {
-	struct inode *consistency_i;
-	struct nvmm_inode *con_nvmm_inode;
-	struct nvmm_inode_info *normal_i_info, *consistency_i_info;
-	unsigned long normal_vaddr, consistency_vaddr;
-	unsigned long start_cp_addr, start_cp_length, end_normal_cp_addr, end_con_cp_addr, end_cp_length;
-	void *copy_start_normal_vaddr, *copy_end_normal_vaddr, *copy_start_con_vaddr, *copy_end_con_vaddr;
-	void *con_write_start_vaddr;
-	unsigned long page_num_mask = 0;
-	int retval = 0;
-	struct nvmm_sb_info *nsi = NVMM_SB(sb);
-	struct inode *root_i = nvmm_iget(sb, NVMM_ROOT_INO);
-	loff_t size = i_size_read(normal_i);
-	consistency_i = nvmm_new_inode(root_i, 0, NULL);
-	consistency_i->i_mode = cpu_to_le16(nsi->mode | S_IFREG);
-	con_nvmm_inode = nvmm_get_inode(sb, consistency_i->i_ino);
-	if(!con_nvmm_inode->i_pg_addr)
-		nvmm_init_pg_table(sb, consistency_i->i_ino);
-	retval = nvmm_establish_mapping(consistency_i);
-	consistency_i_info = NVMM_I(consistency_i);
-	normal_i_info = NVMM_I(normal_i);
-	normal_vaddr = (unsigned long)normal_i_info->i_virt_addr;
-	consistency_vaddr = (unsigned long)consistency_i_info->i_virt_addr;
-
-	//1. find atomic pointer level and get page_num_mask
-	page_num_mask = nvmm_find_atomic_pointer_level(offset, length);
-	if(0 == page_num_mask){
-		retval = -1;
-		nvmm_error(sb, __FUNCTION__, "find atomic pointer for consistency file failed");
-		goto out;
-	}
+	loff_t chunk_end = (*pos & PMD_MASK) + PMD_SIZE;
+	size_t bytes = min_t(size_t, offset + length - *pos, chunk_end - *pos);
 
-	//2. allocate pages for consistency file
-	retval = nvmm_alloc_consistency_file_pages(consistency_i, offset, length, size, page_num_mask);
-	if(retval){
-		nvmm_error(sb, __FUNCTION__, "allocate pages for consistency file failed");
-		goto out;
-	}
+	*start = (*pos >> PAGE_SHIFT) & (PTRS_PER_PTE - 1);
+	*end = *start + (((*pos + bytes + PAGE_SIZE_1) >> PAGE_SHIFT) - (*pos >> PAGE_SHIFT));
+	*pos += bytes;
+}
 
-	//3. calculate copy data
-	if(1 == page_num_mask){
-		start_cp_addr = offset & PAGE_MASK;
-		con_write_start_vaddr = (void *)(consistency_vaddr + (offset & PAGE_SIZE_1));
-	}else if(0x1ff == page_num_mask){
-		start_cp_addr = offset & PMD_MASK;
-		con_write_start_vaddr = (void *)(consistency_vaddr + (offset & PMD_SIZE_1));
-	}else if(0x3ffff == page_num_mask){
-		start_cp_addr = offset & PUD_MASK;
-		con_write_start_vaddr = (void *)(consistency_vaddr + (offset & PUD_SIZE_1));
-	}else if(0x7ffffff == page_num_mask){
-		start_cp_addr = offset & PGDIR_MASK;
-		nvmm_iov_copy_from((void *)normal_vaddr + offset, iter, length);
-		goto out;
-	}else{
-		nvmm_error(sb, __FUNCTION__, "find atomic pointer for consistency file error2");
-	}
+/*
+ * input :
+ * @pud : pud entry of the write, i_alloc_mutex held
+ * @old : the pmd page the shadow @new was copied from, NULL if none
+ * @new : the shadow pmd page, built
+ * @blocks : the blocks the write adds, counted on @old
+ * returns :
+ * 1 if the tree changed since @new was copied from it, else 0
+ * the write holds the range lock, only a fault that fills a hole changes
+ * the tree of the range meanwhile, under i_alloc_mutex. Its entries go
+ * from none to present, the swap would lose them and their blocks.
+ */
+static int nvmm_shadow_pud_stale(pud_t *pud, pmd_t *old, pmd_t *new,
+			loff_t offset, size_t length, unsigned long blocks)
+{
+	unsigned long first = pmd_index(offset);
+	unsigned long last = pmd_index(offset + length - 1);
+	unsigned long i, j, start, end, added = 0;
+	loff_t pos = offset;
+	pte_t *cur, *shadow;
 
-	//length = end_position - start_position + 1, but offset is the write position so do not need
-	start_cp_length = offset - start_cp_addr;
-	if(offset + length < size){
-		end_normal_cp_addr = offset + length;
-		end_con_cp_addr = end_normal_cp_addr & page_num_mask;
-		end_cp_length = size - end_normal_cp_addr;
-	}
+	if((pud_none(*pud) ? NULL : nvmm_get_pmd(pud)) != old)
+		return 1;
 
-	//4. copy data 
-	copy_start_normal_vaddr = (void *)(normal_vaddr + start_cp_addr);
-	copy_start_con_vaddr = (void *)(consistency_vaddr);
-	copy_end_normal_vaddr = (void *)(normal_vaddr + end_normal_cp_addr);
-	copy_end_con_vaddr = (void *)(consistency_vaddr + end_con_cp_addr);
-	if(start_cp_length > 0){
-		memcpy(copy_start_con_vaddr, copy_start_normal_vaddr, start_cp_length);
-	}
-	if(offset + length < size){
-		memcpy(copy_end_con_vaddr, copy_end_normal_vaddr, end_cp_length);
+	for(i = 0; i < PTRS_PER_PMD; i++){
+		if(i < first || i > last){
+			if(pmd_val(new[i]) != (old ? pmd_val(old[i]) : 0))
+				return 1;
+			continue;
+		}
+		nvmm_shadow_chunk(offset, length, &pos, &start, &end);
+		cur = (old && !pmd_none(old[i])) ? nvmm_get_pte(&old[i]) : NULL;
+		shadow = nvmm_get_pte(&new[i]);
+		for(j = 0; j < PTRS_PER_PTE; j++){
+			if(j >= start && j < end)
+				continue;
+			if(pte_val(shadow[j]) != (cur ? pte_val(cur[j]) : 0))
+				return 1;
+		}
+		added += (end - start) - nvmm_shadow_count(cur, start, end);
 	}
-	nvmm_iov_copy_from(con_write_start_vaddr, iter, length);
-	//5. get atomic updating pointer and update it
-	nvmm_atomic_update_pointer(sb, normal_i, consistency_i, offset, page_num_mask);	
+	return added != blocks;
+}
+
+/* give back the shadow pmd page @new of a pud write and what it built */
+static void nvmm_shadow_release_pmd(struct super_block *sb, pmd_t *new,
+			loff_t offset, size_t length)
+{
+	unsigned long first = pmd_index(offset);
+	unsigned long last = pmd_index(offset + length - 1);
+	unsigned long i, start, end;
+	loff_t pos = offset;
 
-	//6. delete temp file inode
-	nvmm_destroy_mapping(consistency_i);
-	consistency_i->__i_nlink = 0;
-	consistency_i->i_state |= I_FREEING;
-	nvmm_evict_inode(consistency_i);
-	if(0x7ffffff == page_num_mask){
-		pud_t *pud = nvmm_get_pud(sb, normal_i->i_ino);
-		nvmap(normal_vaddr, pud, current->mm);
+	for(i = first; i <= last; i++){
+		nvmm_shadow_chunk(offset, length, &pos, &start, &end);
+		if(pmd_none(new[i]))
+			continue;
+		nvmm_shadow_release_pte(sb, nvmm_get_pte(&new[i]), start, end);
 	}
-		
-out :
-	return retval;
+	nvmm_shadow_put(sb, new);
 }
 
-ssize_t nvmm_direct_IO(int rw, struct kiocb *iocb,
-		   const struct iovec *iov,
-		   loff_t offset, unsigned long nr_segs)
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write, inside one 1GB chunk
+ * @length : the size of the write
+ * @iter : io iterator
+ * returns :
+ * 0 if success else error code
+ * PUD_ENTRY level: a shadow pmd page, pointing to shadow pte pages for
+ * the touched 2MB chunks, replaces one pud entry. The old tree is read
+ * without i_alloc_mutex, the shadow is built again if a fault changed
+ * it before the swap.
+ */
+static int nvmm_shadow_write_pud(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
-	ssize_t retval = 0;
-	int hole = 0;
-	struct iov_iter iter;
-	loff_t size;
-	void *start_vaddr = NVMM_I(inode)->i_virt_addr + offset;
-	size_t length = iov_length(iov, nr_segs);
-//	unsigned long pages_exist = 0, pages_to_alloc = 0,pages_needed = 0;        
+	unsigned long vaddr = (unsigned long)NVMM_I(inode)->i_virt_addr + (offset & PUD_MASK);
+	unsigned long first = pmd_index(offset);
+	unsigned long last = pmd_index(offset + length - 1);
+	unsigned long i, blocks, start, end;
+	loff_t pos;
+	pud_t *pud;
+	pmd_t *old, *new;
+	pte_t *old_pte;
+	struct nvmm_reclaim *rc;
+	struct nvmm_pud_build build;
+	struct nvmm_copy_job job;
+	int retval;
 
-	if(rw == READ)
-		rcu_read_lock();
-	size = i_size_read(inode);
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	pud = nvmm_pud_alloc(sb, inode->i_ino, offset);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	if(!pud)
+		return -ENOMEM;
 
-	if(length < 0){
-		retval = -EINVAL;
-		goto out;
+	/* the touched data pages, a pte page per chunk and the pmd page */
+	rc = nvmm_reclaim_alloc(sb, ((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) -
+			(offset >> PAGE_SHIFT) + (last - first + 1) + 1);
+	if(!rc)
+		return -ENOMEM;
+
+again:
+	old = pud_none(*pud) ? NULL : nvmm_get_pmd(pud);
+	new = nvmm_shadow_get(sb);
+	if(!new){
+		kfree(rc);
+		return -ENOSPC;
 	}
+	if(old)
+		nvmm_memcpy_persist(new, old, PAGE_SIZE);
 
-	if((rw == READ)&&(offset + length > size))
-		length = size - offset;
+	blocks = 0;
+	for(i = first, pos = offset; i <= last; i++){
+		old_pte = (old && !pmd_none(old[i])) ? nvmm_get_pte(&old[i]) : NULL;
+		nvmm_shadow_chunk(offset, length, &pos, &start, &end);
+		blocks += (end - start) - nvmm_shadow_count(old_pte, start, end);
+		pmd_clear(&new[i]);
+	}
 
-	if(!length)
-		goto out;
-    
-	iov_iter_init(&iter, iov, nr_segs, length, 0);
-	if(rw == READ){
-		if(unlikely(hole)){
-			
-		}else{
-			retval = nvmm_iov_copy_to(start_vaddr, &iter, length);
-			if(retval != length){
-				retval = -EFAULT;
-				goto out;
-			}
-		}		
-	}else if(rw == WRITE) {
-/**        pages_needed = ((offset + length + sb->s_blocksize - 1) >> sb->s_blocksize_bits);
-        pages_exist = (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
-        pages_to_alloc = pages_needed - pages_exist;
+	/* the copies are done when the engine returns, before the swap */
+	build.sb = sb;
+	build.old = old;
+	build.new = new;
+	build.offset = offset;
+	build.length = length;
+	build.iter = iter;
+	build.first = first;
+	job.fn = nvmm_pud_build_fn;
+	job.data = &build;
+	job.nr = last - first + 1;
+	retval = nvmm_copy_run(&job);
+	if(retval){
+		/* the chunks built, a failed one cleaned up after itself */
+		nvmm_shadow_release_pmd(sb, new, offset, length);
+		kfree(rc);
+		return retval;
+	}
+	nvmm_flush_buffer(&new[first], (last - first + 1) * sizeof(pmd_t), false);
 
-		if(pages_to_alloc > 0){
-		
-			retval = nvmm_alloc_blocks(inode, pages_to_alloc);
-	
-			if (retval){
-				nvmm_info("alloc blocks failed!\n");
-				goto out;
-			}
-		}
-*/
-		nvmm_alloc_blocks(inode, 0);
-		nvmm_consistency_function(sb, inode, offset, length, &iter);
-		retval = length;
-/*		retval = nvmm_iov_copy_from(start_vaddr, &iter, length);
-		if(retval != length){
-			retval = -EFAULT;
-			goto out;
-		}
-*/
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	if(nvmm_shadow_pud_stale(pud, old, new, offset, length, blocks)){
+		mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+		nvmm_shadow_release_pmd(sb, new, offset, length);
+		goto again;
 	}
+	nvmm_tc_invalidate(inode);
+	inode->i_blocks += blocks;
+	if(offset + length > i_size_read(inode)){
+		/* the new size comes with the swap */
+		nvmm_journal_begin(sb);
+		nvmm_journal_add(sb, pud, pud_val(__pud(__pa(new) | _PAGE_TABLE)));
+		nvmm_journal_add_size(inode, offset + length);
+		nvmm_journal_commit(sb);
+		nvmm_journal_set_size(inode, offset + length);
+	}else
+		nvmm_persist_entry(pud, pud_val(__pud(__pa(new) | _PAGE_TABLE)));
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	iov_iter_advance(iter, length);
 
-out :
-	if(rw == READ)
-		rcu_read_unlock();
-	return retval;
+	/* the kernel page table points to pmd pages directly */
+	if(offset < MAX_FILE_SIZE){
+		nvmap_pmd(vaddr, new, current->mm);
+		flush_tlb_kernel_range(vaddr, vaddr + PUD_SIZE);
+	}
+	unmap_mapping_range(inode->i_mapping, offset & PUD_MASK, PUD_SIZE, 1);
+
+	/* the touched pte pages and data pages of the old tree */
+	for(i = first, pos = offset; old && i <= last; i++){
+		nvmm_shadow_chunk(offset, length, &pos, &start, &end);
+		if(pmd_none(old[i]))
+			continue;
+		nvmm_reclaim_pte(rc, nvmm_get_pte(&old[i]), start, end);
+	}
+	if(old)
+		nvmm_reclaim_add(rc, old);
+	nvmm_reclaim_defer(rc);
+	return 0;
 }
 
 /*
  * input :
- * @flags : 
+ * @inode : vfs inode
+ * @pos : position in the file, it must not be in a hole
+ * @bytes : the size wanted, cut to what is contiguous from @pos
  * returns :
- * 0 if use direct IO ways, else others.
+ * kernel virtual address of @pos
+ * the first MAX_FILE_SIZE bytes are reached through the VA window of the
+ * file, the blocks past it one by one through the direct mapping
  */
-static int nvmm_check_flags(int flags)
+static void *nvmm_file_vaddr(struct inode *inode, loff_t pos, size_t *bytes)
 {
-	if(!(flags&O_DIRECT))
-		return -EINVAL;
+	unsigned long in_page = pos & PAGE_SIZE_1;
 
-	return 0;
+	if(pos < MAX_FILE_SIZE){
+		*bytes = min_t(size_t, *bytes, MAX_FILE_SIZE - pos);
+		return NVMM_I(inode)->i_virt_addr + pos;
+	}
+
+	*bytes = min_t(size_t, *bytes, PAGE_SIZE - in_page);
+	return __va(nvmm_find_data_block(inode, pos >> PAGE_SHIFT)) + in_page;
 }
-const struct file_operations nvmm_file_operations = {
-	.llseek		= generic_file_llseek,
-	.read		= do_sync_read,
-	.write		= do_sync_write,
-	.aio_read	= generic_file_aio_read,
-	.aio_write	= generic_file_aio_write,
-	.mmap		= generic_file_mmap,
-	.open		= nvmm_open_file,
-	.nvrelease	= nvmm_release_file,	
-	.fsync		= noop_fsync,
-	.check_flags	= nvmm_check_flags,
-};
 
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start position of the write, the blocks are allocated
+ * @length : the size to be written
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * 0 if success else -EFAULT
+ */
+static int nvmm_write_inplace(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	size_t done = 0, bytes, copied;
+	void *vaddr;
 
+	while(done < length){
+		bytes = length - done;
+		vaddr = nvmm_file_vaddr(inode, offset + done, &bytes);
+		copied = nvmm_iov_copy(vaddr, iter, bytes, WRITE);
+		iov_iter_advance(iter, copied);
+		done += copied;
+		if(copied != bytes)
+			return -EFAULT;
+	}
+	nvmm_persist_barrier();
+	return 0;
+}
 
-#ifdef CONFIG_NVMM_XIP
-const struct file_operations nvmm_xip_file_operations = {
-/*	.llseek		= generic_file_llseek,
-	.read		= xip_file_read,
-	.write		= xip_file_write,
-	.mmap		= xip_file_mmap,
-	.open		= generic_file_open,
-	.fsync		= noop_fsync,*/
+/*
+ * input :
+ * @inode : vfs inode
+ * @size : the new size, the bytes up to it are persistent
+ * persist the block count and the size of @inode, then publish the size
+ */
+static void nvmm_set_size_persist(struct inode *inode, loff_t size)
+{
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+
+	nvmm_memunlock_inode(inode->i_sb, ni);
+	ni->i_blocks = cpu_to_le64(inode->i_blocks);
+	ni->i_size = cpu_to_le64(size);
+	nvmm_memlock_inode(inode->i_sb, ni);
+	nvmm_flush_buffer(&ni->i_blocks, sizeof(ni->i_blocks), false);
+	nvmm_flush_buffer(&ni->i_size, sizeof(ni->i_size), true);
+	i_size_write(inode, size);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start position of the write, at or past the end of the file
+ * @length : the size to be written
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * 0 if success else error code
+ * no reader sees bytes past i_size, so they are copied straight into
+ * the blocks of the file and made persistent, then the new size is
+ * published with one 8-byte store. A failed copy is zeroed again, the
+ * bytes past the end of a file are expected to be zero.
+ */
+static int nvmm_append_write(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	size_t done = 0, bytes, copied;
+	void *vaddr;
+	int retval;
+
+	retval = nvmm_alloc_range(inode, offset >> PAGE_SHIFT,
+			((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) - (offset >> PAGE_SHIFT));
+	if(retval)
+		return retval;
+
+	while(done < length){
+		bytes = length - done;
+		vaddr = nvmm_file_vaddr(inode, offset + done, &bytes);
+		copied = nvmm_iov_copy(vaddr, iter, bytes, WRITE);
+		iov_iter_advance(iter, copied);
+		done += copied;
+		if(copied != bytes)
+			goto fail;
+	}
+	nvmm_persist_barrier();
+	nvmm_set_size_persist(inode, offset + length);
+	return 0;
+
+fail:
+	/* the copy engine may have filled chunks past the fault too */
+	while(length){
+		bytes = length;
+		vaddr = nvmm_file_vaddr(inode, offset, &bytes);
+		nvmm_memzero_persist(vaddr, bytes);
+		offset += bytes;
+		length -= bytes;
+	}
+	nvmm_persist_barrier();
+	return -EFAULT;
+}
+
+/* cost of one 8-byte store made persistent, in bytes of copy */
+#define NVMM_STORE_COST		64
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write
+ * @length : the size of the write
+ * returns :
+ * the plan for the write, one of enum nvmm_write_plan
+ * the cost of a plan is the bytes it copies plus its persistent
+ * metadata stores, the cheapest atomic plan wins unless the file is
+ * written in place
+ */
+static int nvmm_plan_write(struct inode *inode, loff_t offset, size_t length)
+{
+	unsigned long pages = ((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) - (offset >> PAGE_SHIFT);
+	unsigned long swap_cost, undo_cost;
+	unsigned long page_num_mask;
+	bool extend = offset + length > i_size_read(inode);
+
+	if(nvmm_use_inplace(inode))
+		return NVMM_PLAN_INPLACE;
+
+	if(pages > NVMM_WRITE_RECS){
+		page_num_mask = nvmm_find_atomic_pointer_level(offset, length);
+		return 0x3ffff == page_num_mask ? NVMM_PLAN_PUD_SWAP : NVMM_PLAN_INPLACE;
+	}
+
+	/* fresh pages: whole pages copied, one pte store or a journal commit */
+	swap_cost = pages * PAGE_SIZE +
+		(1 == pages ? 1 : 2 * pages + 2) * NVMM_STORE_COST;
+
+	/* the size of a write past the end goes with the entries */
+	if(extend)
+		return NVMM_PLAN_JOURNAL;
+
+	/* old bytes to the undo page and new bytes in place, three stores */
+	if(1 == pages && nvmm_find_data_block(inode, offset >> PAGE_SHIFT)){
+		undo_cost = 2 * length + 3 * NVMM_STORE_COST;
+		if(undo_cost < swap_cost)
+			return NVMM_PLAN_UNDO;
+	}
+
+	return 1 == pages ? NVMM_PLAN_PTE_SWAP : NVMM_PLAN_JOURNAL;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write, inside one allocated block
+ * @length : the size of the write
+ * @iter : io iterator
+ * returns :
+ * 0 if success else error code
+ * the user bytes are taken to a kernel buffer first, so no page fault
+ * happens while the journal is held
+ */
+static int nvmm_undo_write(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	void *buf, *dst;
+	size_t copied;
+
+	buf = kmalloc(length, GFP_NOFS);
+	if(!buf)
+		return -ENOMEM;
+
+	copied = nvmm_iov_copy_from(buf, iter, length);
+	iov_iter_advance(iter, copied);
+	if(copied != length){
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	dst = __va(nvmm_find_data_block(inode, offset >> PAGE_SHIFT)) + (offset & PAGE_SIZE_1);
+	nvmm_journal_undo(inode, dst, buf, length);
+	kfree(buf);
+	return 0;
+}
+
+/**
+ * write @length bytes at @offset of @normal_i with the plan chosen by
+ * nvmm_plan_write(): all plans but NVMM_PLAN_INPLACE are atomic.
+*/
+
+static int __nvmm_consistency_function(struct super_block *sb, struct inode *normal_i, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	int plan, retval;
+
+	plan = nvmm_plan_write(normal_i, offset, length);
+	atomic64_inc(&NVMM_SB(sb)->s_plan_count[plan]);
+
+	switch(plan){
+	case NVMM_PLAN_UNDO:
+		retval = nvmm_undo_write(normal_i, offset, length, iter);
+		break;
+	case NVMM_PLAN_PTE_SWAP:
+		retval = nvmm_shadow_write_pte(normal_i, offset, length, iter);
+		break;
+	case NVMM_PLAN_JOURNAL:
+		retval = nvmm_journal_write(normal_i, offset, length, iter);
+		break;
+	case NVMM_PLAN_PUD_SWAP:
+		retval = nvmm_shadow_write_pud(normal_i, offset, length, iter);
+		break;
+	default:
+		retval = nvmm_alloc_range(normal_i, offset >> PAGE_SHIFT,
+				((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) - (offset >> PAGE_SHIFT));
+		if(!retval)
+			retval = nvmm_write_inplace(normal_i, offset, length, iter);
+		if(!retval && offset + length > i_size_read(normal_i))
+			nvmm_set_size_persist(normal_i, offset + length);
+		break;
+	}
+
+	if(!retval)
+		nvmm_get_inode(sb, normal_i->i_ino)->i_blocks = cpu_to_le64(normal_i->i_blocks);
+	return retval;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @normal_i : vfs inode
+ * @offset : start of the write, inside the file
+ * @length : the size of the write
+ * @iter : io iterator
+ * returns :
+ * the bytes written else error code
+ * a pud swap covers one 1GB chunk, so a write of more than
+ * NVMM_WRITE_RECS pages across chunks is done chunk by chunk, each
+ * chunk atomic on its own. The bytes of the chunks done before one
+ * that fails are returned.
+ */
+static ssize_t nvmm_consistency_function(struct super_block *sb, struct inode *normal_i, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	unsigned long pages = ((offset + length + PAGE_SIZE_1) >> PAGE_SHIFT) - (offset >> PAGE_SHIFT);
+	bool split = !nvmm_use_inplace(normal_i) && pages > NVMM_WRITE_RECS;
+	size_t done = 0, bytes;
+	loff_t pos;
+	int retval;
+
+	while(done < length){
+		pos = offset + done;
+		bytes = length - done;
+		if(split)
+			bytes = min_t(size_t, bytes, (pos & PUD_MASK) + PUD_SIZE - pos);
+		retval = __nvmm_consistency_function(sb, normal_i, pos, bytes, iter);
+		if(retval)
+			return done ? done : retval;
+		done += bytes;
+	}
+	return done;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @src : kernel virtual address of file bytes, contiguous for @bytes
+ * @bytes : the size to be read
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * the bytes copied
+ * an undo write stores its bytes in place, the copy is done again if one
+ * ran meanwhile, page by page after the first retry so that a busy
+ * writer does not hold a long run back. Mappings of the file are not
+ * covered, they may see a part of an undo write.
+ */
+static size_t nvmm_read_stable(struct inode *inode, void *src, size_t bytes, struct iov_iter *iter)
+{
+	seqlock_t *lock = &NVMM_I(inode)->i_undo_lock;
+	size_t copied = 0, chunk = bytes, done;
+	unsigned seq;
+
+	while(copied < bytes){
+		chunk = min(chunk, bytes - copied);
+		for(;;){
+			seq = read_seqbegin(lock);
+			done = nvmm_iov_copy(src + copied, iter, chunk, READ);
+			if(!read_seqretry(lock, seq))
+				break;
+			chunk = min_t(size_t, chunk, PAGE_SIZE - ((unsigned long)(src + copied) & PAGE_SIZE_1));
+		}
+		iov_iter_advance(iter, done);
+		copied += done;
+		if(done != chunk)
+			break;
+	}
+	return copied;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start position of the read
+ * @length : the size to be read, it is inside the file
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * the bytes copied
+ * holes of a sparse file are read as zeros, no block is allocated for them
+ */
+static size_t __nvmm_read_range(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	unsigned long blocknr, next;
+	unsigned long end_blocknr = (offset + length + PAGE_SIZE_1) >> PAGE_SHIFT;
+	size_t copied = 0, bytes, done;
+	loff_t pos = offset;
+
+	while(copied < length){
+		blocknr = pos >> PAGE_SHIFT;
+		next = nvmm_next_data_block(inode, blocknr, end_blocknr);
+		if(next == blocknr){
+			/* a run of data blocks */
+			next = blocknr + 1;
+			while(next < end_blocknr && nvmm_find_data_block(inode, next))
+				next++;
+			bytes = min_t(size_t, length - copied, ((loff_t)next << PAGE_SHIFT) - pos);
+			done = nvmm_read_stable(inode, nvmm_file_vaddr(inode, pos, &bytes), bytes, iter);
+		}else{
+			/* a hole */
+			bytes = min_t(size_t, length - copied, ((loff_t)next << PAGE_SHIFT) - pos);
+			done = nvmm_iov_zero(iter, bytes);
+			iov_iter_advance(iter, done);
+		}
+		copied += done;
+		pos += done;
+		if(done != bytes)
+			break;
+	}
+	return copied;
+}
+
+/*
+ * input :
+ * @inode : vfs inode, its small write log has records
+ * @offset : start position of the read
+ * @length : the size to be read, it is inside the file
+ * @iter : io iterator, advanced by the bytes copied
+ * returns :
+ * the bytes copied, -ENOMEM if no buffer
+ * a page with bytes in the log is put together in a kernel buffer, the
+ * records over the block, and copied from there. The log is not held
+ * across the copy to user space, it may fault on a mapping of the file.
+ * A page without records is read from its block, it needs no buffer.
+ */
+static ssize_t nvmm_read_logged(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	struct rw_semaphore *sem = &NVMM_I(inode)->i_log_sem;
+	size_t copied = 0, bytes, done;
+	loff_t pos = offset;
+	void *buf = NULL;
+	u64 phys;
+	unsigned seq;
+
+	while(copied < length){
+		bytes = min_t(size_t, length - copied, PAGE_SIZE - (pos & PAGE_SIZE_1));
+		down_read(sem);
+		if(!nvmm_log_overlaps(inode, pos, bytes)){
+			up_read(sem);
+			done = __nvmm_read_range(inode, pos, bytes, iter);
+		}else{
+			if(!buf)
+				buf = kmalloc(PAGE_SIZE, GFP_NOFS);
+			if(!buf){
+				up_read(sem);
+				return -ENOMEM;
+			}
+			phys = nvmm_find_data_block(inode, pos >> PAGE_SHIFT);
+			if(phys){
+				do{
+					seq = read_seqbegin(&NVMM_I(inode)->i_undo_lock);
+					memcpy(buf, __va(phys) + (pos & PAGE_SIZE_1), bytes);
+				}while(read_seqretry(&NVMM_I(inode)->i_undo_lock, seq));
+			}else
+				memset(buf, 0, bytes);
+			nvmm_log_apply(inode, buf, pos, bytes);
+			up_read(sem);
+			done = nvmm_iov_copy_to(buf, iter, bytes);
+			iov_iter_advance(iter, done);
+		}
+		copied += done;
+		pos += done;
+		if(done != bytes)
+			break;
+	}
+	kfree(buf);
+	return copied;
+}
+
+static ssize_t nvmm_read_range(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	if(ACCESS_ONCE(NVMM_I(inode)->i_log))
+		return nvmm_read_logged(inode, offset, length, iter);
+	return __nvmm_read_range(inode, offset, length, iter);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : start of the write, inside the file
+ * @length : the size of the write, at most NVMM_LOG_MAX_WRITE
+ * @iter : io iterator
+ * returns :
+ * 0 if success, -EAGAIN if the log does not take the write, else
+ * error code
+ * the user bytes are taken to a kernel buffer first, as for an undo write
+ */
+static int nvmm_log_write(struct inode *inode, loff_t offset, size_t length, struct iov_iter *iter)
+{
+	void *buf;
+	size_t copied;
+	int retval;
+
+	buf = kmalloc(length, GFP_NOFS);
+	if(!buf)
+		return -ENOMEM;
+
+	copied = nvmm_iov_copy_from(buf, iter, length);
+	iov_iter_advance(iter, copied);
+	if(copied != length){
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	retval = nvmm_log_append(inode, offset, buf, length);
+	kfree(buf);
+	if(!retval)
+		atomic64_inc(&NVMM_SB(inode->i_sb)->s_plan_count[NVMM_PLAN_LOG]);
+	return retval;
+}
+
+ssize_t nvmm_direct_IO(int rw, struct kiocb *iocb,
+		   const struct iovec *iov,
+		   loff_t offset, unsigned long nr_segs)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	ssize_t retval = 0;
+	struct iov_iter iter;
+	loff_t size;
+	size_t length = iov_length(iov, nr_segs);
+	int idx = 0;
+//	unsigned long pages_exist = 0, pages_to_alloc = 0,pages_needed = 0;        
+
+	/* the blocks a reader walks stay until it leaves, it may fault */
+	if(rw == READ)
+		idx = srcu_read_lock(&NVMM_SB(sb)->s_srcu);
+	size = i_size_read(inode);
+
+	if(length < 0){
+		retval = -EINVAL;
+		goto out;
+	}
+
+	if((rw == READ)&&(offset + length > size))
+		length = size - offset;
+
+	if(!length)
+		goto out;
+    
+	iov_iter_init(&iter, iov, nr_segs, length, 0);
+	if(rw == READ){
+		retval = nvmm_read_range(inode, offset, length, &iter);
+		if(retval < 0)
+			goto out;
+		if(retval != length){
+			retval = -EFAULT;
+			goto out;
+		}
+	}else if(rw == WRITE) {
+/**        pages_needed = ((offset + length + sb->s_blocksize - 1) >> sb->s_blocksize_bits);
+        pages_exist = (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+        pages_to_alloc = pages_needed - pages_exist;
+
+		if(pages_to_alloc > 0){
+		
+			retval = nvmm_alloc_blocks(inode, pages_to_alloc);
+	
+			if (retval){
+				nvmm_info("alloc blocks failed!\n");
+				goto out;
+			}
+		}
+*/
+		if(offset + length <= size && nvmm_use_log(inode, length)){
+			retval = nvmm_log_write(inode, offset, length, &iter);
+			if(!retval){
+				retval = length;
+				goto out;
+			}
+			if(retval != -EAGAIN)
+				goto out;
+			/* mapped or cloned meanwhile, the bytes go to the blocks */
+			iov_iter_init(&iter, iov, nr_segs, length, 0);
+		}
+		/* no record may hide the bytes of this write afterwards */
+		retval = nvmm_log_fold(inode);
+		if(retval)
+			goto out;
+
+		/* the first writer sets the page table up */
+		mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+		nvmm_alloc_blocks(inode, 0);
+		/* the write changes pages of this file alone */
+		retval = nvmm_unshare_range(inode, offset >> PAGE_SHIFT,
+				(offset + length + PAGE_SIZE - 1) >> PAGE_SHIFT, 1);
+		mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+		if(retval)
+			goto out;
+		if(offset >= size){
+			atomic64_inc(&NVMM_SB(sb)->s_plan_count[NVMM_PLAN_APPEND]);
+			retval = nvmm_append_write(inode, offset, length, &iter);
+			if(!retval)
+				retval = length;
+		}else
+			retval = nvmm_consistency_function(sb, inode, offset, length, &iter);
+/*		retval = nvmm_iov_copy_from(start_vaddr, &iter, length);
+		if(retval != length){
+			retval = -EFAULT;
+			goto out;
+		}
+*/
+	}
+
+out :
+	if(rw == READ)
+		srcu_read_unlock(&NVMM_SB(sb)->s_srcu, idx);
+	return retval;
+}
+
+/*
+ * input :
+ * @flags : 
+ * returns :
+ * 0 if use direct IO ways, else others.
+ */
+static int nvmm_check_flags(int flags)
+{
+	if(!(flags&O_DIRECT))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* stores through @vma reach the blocks of the file */
+static inline int nvmm_vma_writable(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE);
+}
+
+/*
+ * input :
+ * @vma : the faulting vma
+ * @inode : vfs inode
+ * @pgoff : file page that faulted, it is already mapped
+ * @size : file size in pages
+ * map the data blocks of the 2MB aligned chunk around @pgoff too, it is
+ * what one pte page of the user table covers, so a sequential reader
+ * of the mapping faults once per 2MB instead of once per page
+ */
+static void nvmm_file_fault_around(struct vm_area_struct *vma, struct inode *inode,
+			pgoff_t pgoff, pgoff_t size)
+{
+	pgoff_t start = pgoff & ~(pgoff_t)(PTRS_PER_PTE - 1);
+	pgoff_t end = start + PTRS_PER_PTE;
+	unsigned long vaddr;
+	u64 phys;
+
+	start = max_t(pgoff_t, start, vma->vm_pgoff);
+	end = min_t(pgoff_t, end, vma->vm_pgoff + vma_pages(vma));
+	end = min(end, size);
+
+	for(start = nvmm_next_data_block(inode, start, end); start < end;
+			start = nvmm_next_data_block(inode, start + 1, end)){
+		if(start == pgoff)
+			continue;
+		phys = nvmm_find_data_block(inode, start);
+		vaddr = vma->vm_start + ((start - vma->vm_pgoff) << PAGE_SHIFT);
+		if(vm_insert_mixed(vma, vaddr, phys >> PAGE_SHIFT) == -ENOMEM)
+			break;
+	}
+}
+
+/*
+ * input :
+ * @vma : the faulting vma
+ * @vmf : fault description
+ * returns :
+ * VM_FAULT_NOPAGE if success else VM_FAULT_SIGBUS or VM_FAULT_OOM
+ * install the NVM page frame of the block straight into the user page
+ * table, a hole gets a zeroed block first. Stores through the mapping
+ * go in place, they are not atomic like write().
+ * The lookup and the insert run under i_alloc_mutex. The paths that
+ * swap, move or free blocks change the entries under it and unmap the
+ * range after, or free under it once they unmapped, so a block mapped
+ * here is never one they already took out of the file.
+ */
+static int nvmm_file_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	unsigned long vaddr = (unsigned long)vmf->virtual_address;
+	int flagged = nvmm_reflinked(inode);
+	int ret = VM_FAULT_NOPAGE;
+	pgoff_t size;
+	u64 phys;
+	int err;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	/* a truncate waits for the mutex, the size is read under it */
+	size = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if(vmf->pgoff >= size){
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	/* a store must not reach a block shared with a clone */
+	if(flagged && (vma->vm_flags & VM_WRITE)){
+		err = nvmm_unshare_range(inode, vmf->pgoff, vmf->pgoff + 1, 1);
+		if(err)
+			goto fail;
+	}
+
+	phys = nvmm_find_data_block(inode, vmf->pgoff);
+	if(!phys){
+		err = __nvmm_alloc_range(inode, vmf->pgoff, 1);
+		if(err)
+			goto fail;
+		phys = nvmm_find_data_block(inode, vmf->pgoff);
+	}
+
+	/*
+	 * stores through the mapping are written back by fsync, the page is
+	 * tracked before it is mapped, so a sync that starts once the first
+	 * store is possible writes it back
+	 */
+	if(nvmm_vma_writable(vma))
+		nvmm_sync_track(inode, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
+
+	err = vm_insert_mixed(vma, vaddr, phys >> PAGE_SHIFT);
+	if(err == -ENOMEM){
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+	/* -EBUSY means another thread mapped it already */
+	if(err && err != -EBUSY){
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+	if(!flagged && nvmm_reflinked(inode)){
+		/* cloned meanwhile, the block may be shared, fault again */
+		unmap_mapping_range(inode->i_mapping, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 1);
+		goto out;
+	}
+	/*
+	 * the blocks around may be shared, each store faults on its own. In
+	 * a shared writable mapping each page faults too, so fsync writes
+	 * back the pages stored to and not the whole chunk.
+	 */
+	if((!flagged || !(vma->vm_flags & VM_WRITE)) && !nvmm_vma_writable(vma))
+		nvmm_file_fault_around(vma, inode, vmf->pgoff, size);
+out:
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	return ret;
+fail:
+	ret = err == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	goto out;
+}
+
+static const struct vm_operations_struct nvmm_file_vm_ops = {
+	.fault		= nvmm_file_fault,
+};
+
+/*
+ * mmap maps the NVM blocks of the file directly, no page cache pages
+ */
+static int nvmm_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+
+	/* stores through the mapping never see the small write log */
+	err = nvmm_log_disable(file_inode(file));
+	if(err)
+		return err;
+
+	file_accessed(file);
+	vma->vm_ops = &nvmm_file_vm_ops;
+	vma->vm_flags |= VM_MIXEDMAP;
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pos : file position of a write
+ * @count : the size of the write
+ * output :
+ * @start, @last : blocks the write must own
+ * a pud swap rewrites the pmd page of the whole 1GB chunk, so a write
+ * that may take one owns the chunk. A clone may share the pte page of a
+ * 2MB chunk, the write copies it whole, so it owns the chunk too.
+ */
+static void nvmm_write_range(struct inode *inode, loff_t pos, size_t count,
+			unsigned long *start, unsigned long *last)
+{
+	*start = pos >> PAGE_SHIFT;
+	*last = (pos + count - 1) >> PAGE_SHIFT;
+	if(*last - *start + 1 > NVMM_WRITE_RECS){
+		*start = (pos & PUD_MASK) >> PAGE_SHIFT;
+		*last = (((pos + count - 1) & PUD_MASK) + PUD_SIZE - 1) >> PAGE_SHIFT;
+	}else if(nvmm_reflinked(inode)){
+		*start &= ~(unsigned long)(PTRS_PER_PTE - 1);
+		*last |= PTRS_PER_PTE - 1;
+	}
+}
+
+/*
+ * input :
+ * @iocb : kernel io control block
+ * @iov : user buffers
+ * @nr_segs : number of user buffers
+ * @pos : file position of the write
+ * returns :
+ * the bytes written else error code
+ * i_mutex only covers the checks, then a write inside the file holds
+ * the range lock of its blocks alone, so writers of disjoint ranges go
+ * on in parallel. A write that extends the file keeps i_mutex, the size
+ * it publishes must not race another extending write or a truncate.
+ */
+static ssize_t __nvmm_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct nvmm_range_lock *rl = &NVMM_I(inode)->i_range_lock;
+	struct nvmm_range range;
+	unsigned long start, last;
+	size_t count = 0, ocount;
+	bool extend;
+	ssize_t ret;
+	int err;
+
+	ret = generic_segment_checks(iov, &nr_segs, &count, VERIFY_READ);
+	if(ret)
+		return ret;
+	ocount = count;
+
+	mutex_lock(&inode->i_mutex);
+	ret = generic_write_checks(file, &pos, &count, 0);
+	if(ret || !count)
+		goto out_unlock;
+	ret = file_remove_suid(file);
+	if(!ret)
+		ret = file_update_time(file);
+	if(ret)
+		goto out_unlock;
+	if(count != ocount)
+		nr_segs = iov_shorten((struct iovec *)iov, nr_segs, count);
+
+	nvmm_write_range(inode, pos, count, &start, &last);
+	extend = pos + count > i_size_read(inode);
+	if(!extend)
+		mutex_unlock(&inode->i_mutex);
+	nvmm_range_lock(rl, &range, start, last);
+	if(nvmm_reflinked(inode) && (start | (last + 1)) & (PTRS_PER_PTE - 1)){
+		/* cloned meanwhile, the write owns whole 2MB chunks now */
+		nvmm_range_unlock(rl, &range);
+		nvmm_write_range(inode, pos, count, &start, &last);
+		nvmm_range_lock(rl, &range, start, last);
+	}
+	if(!extend && pos + count > i_size_read(inode)){
+		/* truncated meanwhile, the write extends the file now */
+		nvmm_range_unlock(rl, &range);
+		mutex_lock(&inode->i_mutex);
+		extend = true;
+		nvmm_range_lock(rl, &range, start, last);
+	}
+
+	ret = nvmm_direct_IO(WRITE, iocb, iov, pos, nr_segs);
+	nvmm_range_unlock(rl, &range);
+
+	if(ret > 0){
+		if(pos + ret > i_size_read(inode)){
+			i_size_write(inode, pos + ret);
+			mark_inode_dirty(inode);
+		}
+		iocb->ki_pos = pos + ret;
+	}
+	if(!extend)
+		goto out;
+
+out_unlock:
+	mutex_unlock(&inode->i_mutex);
+out:
+	if(ret > 0){
+		err = generic_write_sync(file, pos, ret);
+		if(err < 0)
+			ret = err;
+	}
+	return ret;
+}
+
+/* the page belongs to the file, it can not move to another mapping */
+static int nvmm_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	return 1;
+}
+
+/*
+ * each buffer holds a reference to its NVM page, .get and .release take
+ * and drop it, the reclaim of a replaced block waits for it
+ */
+static const struct pipe_buf_operations nvmm_pipe_buf_ops = {
+	.can_merge	= 0,
+	.map		= generic_pipe_buf_map,
+	.unmap		= generic_pipe_buf_unmap,
+	.confirm	= generic_pipe_buf_confirm,
+	.release	= generic_pipe_buf_release,
+	.steal		= nvmm_pipe_buf_steal,
+	.get		= generic_pipe_buf_get,
+};
+
+static void nvmm_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * input :
+ * @in : the file
+ * @ppos : file position, advanced by the bytes spliced
+ * @pipe : the pipe
+ * @len : the size wanted
+ * @flags : splice flags
+ * returns :
+ * the bytes spliced else error code
+ * the pipe buffers point to the NVM pages of the file, nothing is
+ * copied, a hole is the zero page. The blocks are looked up under
+ * s_srcu and each page gets a reference, a block replaced or removed
+ * meanwhile goes back only after the pipe drops it, see
+ * nvmm_reclaim_rcu(). The pipe does not hold s_srcu.
+ */
+static ssize_t nvmm_file_splice_read(struct file *in, loff_t *ppos,
+			struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct inode *inode = file_inode(in);
+	struct srcu_struct *srcu = &NVMM_SB(inode->i_sb)->s_srcu;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &nvmm_pipe_buf_ops,
+		.spd_release = nvmm_spd_release,
+	};
+	struct page *page;
+	loff_t pos = *ppos, size;
+	unsigned int bytes;
+	u64 phys;
+	ssize_t ret;
+	int idx;
+
+	/* the pipe gets the blocks, they must hold the logged bytes */
+	ret = nvmm_log_fold(inode);
+	if(ret)
+		return ret;
+
+	if(splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+
+	idx = srcu_read_lock(srcu);
+	size = i_size_read(inode);
+	len = pos < size ? min_t(loff_t, len, size - pos) : 0;
+	while(len && spd.nr_pages < spd.nr_pages_max){
+		bytes = min_t(size_t, len, PAGE_SIZE - (pos & PAGE_SIZE_1));
+		phys = nvmm_find_data_block(inode, pos >> PAGE_SHIFT);
+		page = phys ? pfn_to_page(phys >> PAGE_SHIFT) : ZERO_PAGE(0);
+		get_page(page);
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = pos & PAGE_SIZE_1;
+		spd.partial[spd.nr_pages].len = bytes;
+		spd.nr_pages++;
+		pos += bytes;
+		len -= bytes;
+	}
+	srcu_read_unlock(srcu, idx);
+
+	ret = 0;
+	if(spd.nr_pages)
+		ret = splice_to_pipe(pipe, &spd);
+	if(ret > 0){
+		*ppos += ret;
+		file_accessed(in);
+	}
+	splice_shrink_spd(&spd);
+	return ret;
+}
+
+/*
+ * input :
+ * @iocb : kernel io control block of an io_submit()
+ * @iov : user buffers, shortened to what the write may take
+ * @nr_segs : number of user buffers, updated
+ * @pos : file position of the write
+ * returns :
+ * the bytes the write may take, 0 or error code
+ * the file size limit, SIGXFSZ and the suid bits the caller may keep
+ * belong to the task that writes, an aio worker has none of them, so
+ * these checks run before the request is queued. The worker does them
+ * again, they do not change anything then.
+ */
+static ssize_t nvmm_aio_write_checks(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long *nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	size_t count = 0, ocount;
+	ssize_t ret;
+
+	ret = generic_segment_checks(iov, nr_segs, &count, VERIFY_READ);
+	if(ret)
+		return ret;
+	ocount = count;
+
+	mutex_lock(&inode->i_mutex);
+	ret = generic_write_checks(file, &pos, &count, 0);
+	if(!ret && count){
+		ret = file_remove_suid(file);
+		if(!ret)
+			ret = file_update_time(file);
+	}
+	mutex_unlock(&inode->i_mutex);
+	if(ret)
+		return ret;
+
+	if(count != ocount)
+		*nr_segs = iov_shorten((struct iovec *)iov, *nr_segs, count);
+	return count;
+}
+
+/*
+ * a request of io_submit() goes to the aio workers, the others run here
+ */
+static ssize_t nvmm_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos)
+{
+	ssize_t ret;
+
+	if(!is_sync_kiocb(iocb)){
+		ret = nvmm_aio_write_checks(iocb, iov, &nr_segs, pos);
+		if(ret <= 0)
+			return ret;
+		return nvmm_aio_queue(iocb, iov, nr_segs, pos, __nvmm_file_aio_write);
+	}
+	return __nvmm_file_aio_write(iocb, iov, nr_segs, pos);
+}
+
+static ssize_t nvmm_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos)
+{
+	if(!is_sync_kiocb(iocb))
+		return nvmm_aio_queue(iocb, iov, nr_segs, pos, generic_file_aio_read);
+	return generic_file_aio_read(iocb, iov, nr_segs, pos);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @start, @end : bytes [start, end) inside one block
+ * returns :
+ * 0 if success else error code
+ * zero the bytes in place, a block shared with a clone is copied first
+ */
+static int nvmm_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+	unsigned long blocknr = start >> PAGE_SHIFT;
+	u64 phys;
+	int err;
+
+	if(start >= end)
+		return 0;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	err = nvmm_unshare_range(inode, blocknr, blocknr + 1, 1);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	if(err)
+		return err;
+
+	/* nothing to clear in a hole */
+	phys = nvmm_find_data_block(inode, blocknr);
+	if(phys)
+		nvmm_memzero_persist((char *)__va(phys) + (start & PAGE_SIZE_1), end - start);
+	return 0;
+}
+
+/*
+ * free the blocks [first, end) of the file. The entries are cleared
+ * under i_alloc_mutex, so no fault maps a block again, and the blocks
+ * go back after the readers of the moment, see nvmm_rm_pg_range()
+ */
+static void nvmm_drop_blocks(struct inode *inode, unsigned long first, unsigned long end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nvmm_inode *ni = nvmm_get_inode(sb, inode->i_ino);
+
+	if(first >= end)
+		return;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	nvmm_tc_invalidate(inode);
+	unmap_mapping_range(inode->i_mapping, (loff_t)first << PAGE_SHIFT,
+			(loff_t)(end - first) << PAGE_SHIFT, 1);
+	inode->i_blocks -= nvmm_rm_pg_range(sb, inode, first, end);
+	ni->i_blocks = cpu_to_le64(inode->i_blocks);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : first byte of the range
+ * @len : the size of the range
+ * returns :
+ * the new size else error code
+ * the blocks behind the range move down by its size, only the entries
+ * of the page table move, see nvmm_shift_blocks()
+ */
+static loff_t nvmm_collapse_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t size = i_size_read(inode);
+	unsigned long first = offset >> PAGE_SHIFT, nr = len >> PAGE_SHIFT;
+	unsigned long eof = (size + PAGE_SIZE_1) >> PAGE_SHIFT;
+	int err;
+
+	if((offset | len) & PAGE_SIZE_1)
+		return -EINVAL;
+	/* the range must leave something to move */
+	if(offset + len >= size)
+		return -EINVAL;
+
+	/* the blocks past the end would land inside the file */
+	nvmm_drop_blocks(inode, eof, NVMM_MAX_FILE_SIZE >> PAGE_SHIFT);
+	nvmm_drop_blocks(inode, first, first + nr);
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	/* under the mutex, no fault maps a block of the range meanwhile */
+	unmap_mapping_range(inode->i_mapping, offset, 0, 1);
+	err = nvmm_shift_blocks(inode->i_sb, inode, first + nr, first, eof - first - nr);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+
+	return err ? err : size - len;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset : where the hole goes
+ * @len : the size of the hole
+ * returns :
+ * the new size else error code
+ * the blocks from @offset on move up by @len, a hole is left behind
+ */
+static loff_t nvmm_insert_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t size = i_size_read(inode);
+	unsigned long first = offset >> PAGE_SHIFT, nr = len >> PAGE_SHIFT;
+	unsigned long eof = (size + PAGE_SIZE_1) >> PAGE_SHIFT;
+	int err;
+
+	if((offset | len) & PAGE_SIZE_1)
+		return -EINVAL;
+	if(offset >= size)
+		return -EINVAL;
+	if(size + len > inode->i_sb->s_maxbytes)
+		return -EFBIG;
+
+	/* the blocks past the end would be overwritten by the move */
+	nvmm_drop_blocks(inode, eof, NVMM_MAX_FILE_SIZE >> PAGE_SHIFT);
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	/* under the mutex, no fault maps a block of the range meanwhile */
+	unmap_mapping_range(inode->i_mapping, offset, 0, 1);
+	err = nvmm_shift_blocks(inode->i_sb, inode, first, first + nr, eof - first);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+
+	return err ? err : size + len;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset, @len : the range
+ * returns :
+ * 0 if success else error code
+ * the whole blocks of the range are freed, the bytes of the blocks at
+ * its ends are zeroed
+ */
+static int nvmm_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t end = offset + len;
+	unsigned long first = (offset + PAGE_SIZE_1) >> PAGE_SHIFT;
+	unsigned long last = end >> PAGE_SHIFT;
+	int err;
+
+	if(first > last)
+		return nvmm_zero_partial(inode, offset, end);
+
+	err = nvmm_zero_partial(inode, offset, (loff_t)first << PAGE_SHIFT);
+	if(!err)
+		err = nvmm_zero_partial(inode, (loff_t)last << PAGE_SHIFT, end);
+	if(err)
+		return err;
+	nvmm_persist_barrier();
+
+	nvmm_drop_blocks(inode, first, last);
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @offset, @len : the range
+ * @keep_size : the size does not grow
+ * returns :
+ * the new size else error code
+ * fill the holes of the range with zeroed blocks
+ */
+static loff_t nvmm_prealloc_range(struct inode *inode, loff_t offset, loff_t len, int keep_size)
+{
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+	loff_t size = i_size_read(inode), end = offset + len;
+	unsigned long first = offset >> PAGE_SHIFT;
+	int err;
+
+	err = nvmm_alloc_range(inode, first, ((end + PAGE_SIZE_1) >> PAGE_SHIFT) - first);
+	if(err)
+		return err;
+	if(end <= size)
+		return size;
+	if(!keep_size)
+		return end;
+
+	/* truncate looks for the blocks past the end */
+	NVMM_I(inode)->i_flags |= NVMM_EOFBLOCKS_FL;
+	nvmm_memunlock_inode(inode->i_sb, ni);
+	ni->i_flags |= cpu_to_le32(NVMM_EOFBLOCKS_FL);
+	nvmm_memlock_inode(inode->i_sb, ni);
+	nvmm_flush_buffer(&ni->i_flags, sizeof(ni->i_flags), true);
+	return size;
+}
+
+/*
+ * input :
+ * @file : the file, open for writing
+ * @mode : FALLOC_FL_* flags
+ * @offset, @len : the range
+ * returns :
+ * 0 if success else error code
+ * preallocate, punch a hole, collapse a range or insert one. The shifts
+ * move table entries and not data, their cost follows the number of pte,
+ * pmd or pud entries of the file behind the range.
+ */
+long nvmm_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct nvmm_range range;
+	loff_t size;
+	int ret;
+
+	if(!S_ISREG(inode->i_mode))
+		return -ENODEV;
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+			FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))
+		return -EOPNOTSUPP;
+	/* a shift takes no other flag, a hole keeps the size */
+	if((mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) &&
+			mode != FALLOC_FL_COLLAPSE_RANGE && mode != FALLOC_FL_INSERT_RANGE)
+		return -EINVAL;
+	if((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if(offset < 0 || len <= 0)
+		return -EINVAL;
+	if(offset + len > inode->i_sb->s_maxbytes || offset + len < 0)
+		return -EFBIG;
+	if(IS_IMMUTABLE(inode) || (IS_APPEND(inode) && (mode & ~FALLOC_FL_KEEP_SIZE)))
+		return -EPERM;
+
+	mutex_lock(&inode->i_mutex);
+	/* writers inside the file run without i_mutex, wait for them all */
+	nvmm_range_lock(&NVMM_I(inode)->i_range_lock, &range, 0, ULONG_MAX);
+	ret = nvmm_log_fold(inode);
+	if(ret)
+		goto out;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	ret = nvmm_alloc_blocks(inode, 0);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	if(ret)
+		goto out;
+
+	if(mode & FALLOC_FL_PUNCH_HOLE)
+		size = nvmm_punch_hole(inode, offset, len) ? : i_size_read(inode);
+	else if(mode & FALLOC_FL_COLLAPSE_RANGE)
+		size = nvmm_collapse_range(inode, offset, len);
+	else if(mode & FALLOC_FL_INSERT_RANGE)
+		size = nvmm_insert_range(inode, offset, len);
+	else
+		size = nvmm_prealloc_range(inode, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+	if(size < 0){
+		ret = size;
+		goto out;
+	}
+
+	if(size != i_size_read(inode))
+		i_size_write(inode, size);
+	check_eof_blocks(inode, size);
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+	nvmm_update_inode(inode);
+out:
+	nvmm_range_unlock(&NVMM_I(inode)->i_range_lock, &range);
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+const struct file_operations nvmm_file_operations = {
+	.llseek		= generic_file_llseek,
+	.read		= do_sync_read,
+	.write		= do_sync_write,
+	.aio_read	= nvmm_file_aio_read,
+	.aio_write	= nvmm_file_aio_write,
+	.mmap		= nvmm_file_mmap,
+	.splice_read	= nvmm_file_splice_read,
+	.open		= nvmm_open_file,
+	.nvrelease	= nvmm_release_file,	
+	.fsync		= nvmm_fsync,
+	.fallocate	= nvmm_fallocate,
+	.unlocked_ioctl	= nvmm_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= nvmm_compat_ioctl,
+#endif
+	.check_flags	= nvmm_check_flags,
+};
+
+
+
+#ifdef CONFIG_NVMM_XIP
+const struct file_operations nvmm_xip_file_operations = {
+	.llseek		= generic_file_llseek,
+	.read		= do_sync_read,
+	.write		= do_sync_write,
+	.aio_read	= nvmm_file_aio_read,
+	.aio_write	= nvmm_file_aio_write,
+	.mmap		= nvmm_file_mmap,
+	.splice_read	= nvmm_file_splice_read,
+	.open		= nvmm_open_file,
+	.nvrelease	= nvmm_release_file,
+	.fsync		= nvmm_fsync,
+	.fallocate	= nvmm_fallocate,
+	.unlocked_ioctl	= nvmm_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= nvmm_compat_ioctl,
+#endif
+	.check_flags	= nvmm_check_flags,
 };
 #endif
 
@@ -17,6 +17,7 @@
 #include <linux/sched.h>
 #include <linux/mpage.h>
 #include <linux/backing-dev.h>
+#include <linux/slab.h>
 #include "nvmm.h"
 #include "xattr.h"
 #include "xip.h"
@@ -72,48 +73,84 @@ struct backing_dev_info nvmm_backing_dev_info __read_mostly = {
  * output:
  *
  * return :
- * the physaddr of the block
+ * the physaddr of the block, 0 if the block is not allocated
  *
  * find the offset to the block represented by the given inode's file
  * relative block number.
+ * The pmd page and the pte page resolved by the last lookup are kept in
+ * the inode's translation cache, so a sequential scan only does one NVM
+ * load per block instead of walking the three levels every time.
+ * The walk runs unlocked, its pages are installed only if no
+ * nvmm_tc_invalidate() came since it started, else they may be stale.
  */
 u64 nvmm_find_data_block(struct inode *inode, unsigned long file_blocknr)
 {
 	struct super_block *sb = inode->i_sb;
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
 	struct nvmm_inode *ni = NULL;
 
 	u64 *first_lev = NULL;		/* ptr to first level */
 	u64 *second_lev = NULL;	/* ptr to second level */
 	u64 *third_lev = NULL;		/* ptr to the third level*/
-	u64 first_phys = 0;
 	u64 second_phys = 0;
 	u64 third_phys = 0;
 	u64 bp = 0;		/* phys of this number*/
 	int entry_offset = 511;
 	int entry_num = 9;	
 	int first_num = 0, second_num = 0, third_num = 0;
+	unsigned long pmd_key, pte_key, gen;
+	unsigned seq;
 
 	first_num = ((file_blocknr >> entry_num ) >> entry_num) & entry_offset;
 	second_num = (file_blocknr >> entry_num) & entry_offset;
 	third_num = file_blocknr & entry_offset;
-
-	ni = nvmm_get_inode(sb, inode->i_ino);
-
-	first_phys = le64_to_cpu(ni->i_pg_addr);
-	first_lev = __va(first_phys);
-//	printk("the first_lev is :%lu\n", *first_lev);
-	if (first_lev) {
+	pmd_key = file_blocknr >> (2 * entry_num);
+	pte_key = file_blocknr >> entry_num;
+
+	do {
+		seq = read_seqbegin(&ni_info->i_tc_lock);
+		second_lev = (ni_info->i_tc_pmd_key == pmd_key) ?
+				ni_info->i_tc_pmd : NULL;
+		third_lev = (ni_info->i_tc_pte_key == pte_key) ?
+				ni_info->i_tc_pte : NULL;
+		gen = ni_info->i_tc_gen;
+	} while (read_seqretry(&ni_info->i_tc_lock, seq));
+
+	if (third_lev)
+		goto found;
+
+	if (!second_lev) {
+		ni = nvmm_get_inode(sb, inode->i_ino);
+		if (!ni->i_pg_addr)
+			return 0;
+		first_lev = (u64 *)nvmm_get_pud_page(sb, inode->i_ino,
+				file_blocknr << PAGE_SHIFT);
+		if (!first_lev)
+			return 0;
 		second_phys = le64_to_cpu(first_lev[first_num]) & PAGE_MASK;
+		if (!second_phys)
+			return 0;
 		second_lev = __va(second_phys);
-		if (second_lev){
-			third_phys = le64_to_cpu(second_lev[second_num]) & PAGE_MASK;
-			third_lev = __va(third_phys);
-			if(third_lev)
-				bp = (le64_to_cpu(third_lev[third_num]) & 
-						0x0fffffffffffffff) & PAGE_MASK;
-		}
 	}
 
+	third_phys = le64_to_cpu(second_lev[second_num]) & PAGE_MASK;
+	if (!third_phys)
+		return 0;
+	third_lev = __va(third_phys);
+
+	write_seqlock(&ni_info->i_tc_lock);
+	if (ni_info->i_tc_gen == gen) {
+		ni_info->i_tc_pmd_key = pmd_key;
+		ni_info->i_tc_pmd = second_lev;
+		ni_info->i_tc_pte_key = pte_key;
+		ni_info->i_tc_pte = third_lev;
+	}
+	write_sequnlock(&ni_info->i_tc_lock);
+
+found:
+	bp = (le64_to_cpu(third_lev[third_num]) & 
+			0x0fffffffffffffff) & PAGE_MASK;
+
 	return bp;
 }
 
@@ -124,6 +161,8 @@ u64 nvmm_find_data_block(struct inode *inode, unsigned long file_blocknr)
  * @start 
  * @end
  * free data block from range start<=>end
+ * only the blocks past @start are freed, the rest of the mapping stays,
+ * the whole page table goes away when @start is 0
  */
 static void __nvmm_truncate_blocks(struct inode *inode, loff_t start, loff_t end)
 {
@@ -131,6 +170,7 @@ static void __nvmm_truncate_blocks(struct inode *inode, loff_t start, loff_t end
 	struct super_block *sb = inode->i_sb;
 	struct nvmm_inode *ni;
 	unsigned long first_blocknr,last_blocknr;
+	unsigned long max_blocknr = (NVMM_MAX_FILE_SIZE >> PAGE_SHIFT) - 1;
 	struct nvmm_inode_info *ni_info;
 	pud_t *pud;
 	unsigned long ino;
@@ -149,16 +189,35 @@ static void __nvmm_truncate_blocks(struct inode *inode, loff_t start, loff_t end
 	first_blocknr = (start + sb->s_blocksize-1) >> sb->s_blocksize_bits;
 	
 	if(ni->i_flags & cpu_to_le32(NVMM_EOFBLOCKS_FL))
-		last_blocknr = (1UL << (2*sb->s_blocksize_bits - 6))-1;
+		last_blocknr = max_blocknr;
 	else
-		last_blocknr = end >> sb->s_blocksize_bits;
+		last_blocknr = min(max_blocknr, (unsigned long)(end >> sb->s_blocksize_bits));
 
 	if(first_blocknr > last_blocknr)
 		return;
 
-	unnvmap(vaddr, pud, mm);
-	nvmm_rm_pg_table(sb, inode->i_ino);
-	inode->i_blocks = 0;
+	mutex_lock(&ni_info->i_alloc_mutex);
+	nvmm_tc_invalidate(inode);
+	/* a fault that mapped a block before the size dropped is undone */
+	unmap_mapping_range(inode->i_mapping, (loff_t)first_blocknr << PAGE_SHIFT, 0, 1);
+	/* the size that drops the blocks is in NVM before they are freed */
+	nvmm_memunlock_inode(sb, ni);
+	ni->i_size = cpu_to_le64(i_size_read(inode));
+	nvmm_flush_buffer(&ni->i_size, sizeof(ni->i_size), true);
+	if(0 == first_blocknr){
+		unnvmap(vaddr, pud, mm);
+		nvmm_rm_pg_table(sb, inode->i_ino);
+		inode->i_blocks = 0;
+		/* nothing left to share with a clone */
+		ni_info->i_flags &= ~NVMM_REFLINK_FL;
+		ni->i_flags &= cpu_to_le32(~NVMM_REFLINK_FL);
+	}else{
+		inode->i_blocks -= nvmm_rm_pg_range(sb, inode, first_blocknr, last_blocknr + 1);
+	}
+	ni->i_blocks = cpu_to_le64(inode->i_blocks);
+	nvmm_flush_buffer(&ni->i_blocks, sizeof(ni->i_blocks), true);
+	nvmm_memlock_inode(sb, ni);
+	mutex_unlock(&ni_info->i_alloc_mutex);
 	
 }//end function __nvmm_truncate_blocks
 
@@ -183,6 +242,43 @@ static void nvmm_truncate_blocks(struct inode *inode, loff_t start, loff_t end)
 }//end function nvmm_truncate_blocks
 
 
+/*
+ * input :
+ * @sb : vfs super block
+ * @phys : first block of a chain from nvmm_new_block()
+ * @num : number of blocks left in the chain
+ * give the blocks of a chain that were not inserted back to the free list
+ */
+static void nvmm_free_chain(struct super_block *sb, phys_addr_t phys, unsigned long num)
+{
+	phys_addr_t base = NVMM_SB(sb)->phy_addr, next;
+
+	while(num--){
+		/* the link is lost once the block is freed */
+		next = base + *(unsigned long *)__va(phys);
+		nvmm_free_block(sb, phys >> PAGE_SHIFT);
+		phys = next;
+	}
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @start : first block number a failed nvmm_insert_pages() was given
+ * @nr : number of blocks it was given
+ * returns :
+ * how many of them it inserted, it fills the entries in order
+ */
+static unsigned long nvmm_inserted(struct inode *inode, unsigned long start, unsigned long nr)
+{
+	unsigned long done;
+
+	for(done = 0; done < nr; done++)
+		if(!nvmm_find_data_block(inode, start + done))
+			break;
+	return done;
+}
+
 /*
  * input :
  * @inode : vfs inode
@@ -191,23 +287,24 @@ static void nvmm_truncate_blocks(struct inode *inode, loff_t start, loff_t end)
  * returns :
  * alloc and insert blocks to inode.
  * success return 0,else return others.
+ * if the page table can not take them all, the blocks inserted stay
+ * with the file and the rest go back to the free list
  */
 int nvmm_alloc_blocks(struct inode *inode, int num)
 {
 	struct super_block *sb = inode->i_sb;
-	int errval = 0,i = 0;
-	//unsigned long blocknr;
+	int errval = 0;
 	int ino = inode->i_ino;
 	pud_t *pud;
 	unsigned long vaddr, *p;
+	unsigned long *pfns, batch, nr, offset, done, i;
 	struct mm_struct *mm;
 	struct nvmm_inode_info *ni_info;
 	struct nvmm_inode *ni = nvmm_get_inode(sb, ino);
-    struct nvmm_sb_info *nsi = NVMM_SB(sb);
-    struct page *pg;
-    phys_addr_t phys, base, next, cur;
-    mm = current->mm;
-    base = nsi->phy_addr;
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	phys_addr_t phys, base, cur;
+	mm = current->mm;
+	base = nsi->phy_addr;
 	ni_info = NVMM_I(inode);
 	vaddr = (unsigned long)ni_info->i_virt_addr;
 	if(!ni->i_pg_addr){
@@ -218,34 +315,155 @@ int nvmm_alloc_blocks(struct inode *inode, int num)
 	if(0 == num){
 		return errval;
 	}
-//	printk("before alloc\n");
+
+	/*
+	 * walk the allocated chain and hand the page frames to the page
+	 * table in batches, so every pmd/pte page is looked up only once
+	 */
+	batch = min_t(unsigned long, num, NVMM_INSERT_BATCH);
+	pfns = kmalloc(batch * sizeof(unsigned long), GFP_NOFS);
+	if(!pfns)
+		return -ENOMEM;
+
 	errval = nvmm_new_block(sb, &phys, 1, num);
-//	printk("after alloc\n");
-    if(!errval){
-        cur = phys;
-
-        for(i = 0;i < num; i++)
-        {
-//            printk(KERN_INFO "MY_DEBUG:pfn=%lx\n", cur);
-            p = (unsigned long *)__va(cur);
-            next = base + *p;
-//			memset((void *)p, 0, PAGE_SIZE);
-            pg = pfn_to_page(cur >> PAGE_SHIFT);
-            inode->i_blocks++;
-            ni->i_blocks =  cpu_to_le32(inode->i_blocks);
-            errval = nvmm_insert_page(sb, inode, pg);
-
-            if(unlikely(errval != 0))
-                return errval;
-            cur = next;
-        }
-        return errval;
-    }else{
-        nvmm_error(sb, __FUNCTION__, "no block space left!\n");
-        return -ENOSPC;
-    }
+	if(errval){
+		nvmm_error(sb, __FUNCTION__, "no block space left!\n");
+		kfree(pfns);
+		return -ENOSPC;
+	}
+
+	cur = phys;
+	offset = inode->i_blocks << PAGE_SHIFT;
+	while(num > 0){
+		for(nr = 0; nr < batch && nr < num; nr++){
+			p = (unsigned long *)__va(cur);
+			pfns[nr] = cur >> PAGE_SHIFT;
+			cur = base + *p;
+		}
+
+		errval = nvmm_insert_pages(sb, inode, offset, pfns, nr);
+		if(unlikely(errval != 0)){
+			done = nvmm_inserted(inode, offset >> PAGE_SHIFT, nr);
+			inode->i_blocks += done;
+			/* the rest of this batch, then the rest of the chain */
+			for(i = done; i < nr; i++)
+				nvmm_free_block(sb, pfns[i]);
+			nvmm_free_chain(sb, cur, num - nr);
+			break;
+		}
+
+		inode->i_blocks += nr;
+		offset += nr << PAGE_SHIFT;
+		num -= nr;
+	}
+	nvmm_persist_barrier();
+	ni->i_blocks = cpu_to_le64(inode->i_blocks);
+
+	kfree(pfns);
+	return errval;
 }//end function nvmm_alloc_blocks
 
+/*
+ * input :
+ * @inode : vfs inode of a regular file
+ * @start : first block number of the range
+ * @num : number of blocks of the range
+ * returns :
+ * 0 if success else error code
+ * allocate zeroed blocks for the holes in [start, start + num), blocks
+ * already present are left alone, so a file may be sparse. The caller
+ * holds i_alloc_mutex.
+ */
+int __nvmm_alloc_range(struct inode *inode, unsigned long start, unsigned long num)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nvmm_inode *ni = nvmm_get_inode(sb, inode->i_ino);
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	unsigned long blocknr, end = start + num;
+	unsigned long holes = 0, nr, *pfns, done, i;
+	phys_addr_t phys, base, cur;
+	void *p;
+	int errval;
+
+	errval = nvmm_alloc_blocks(inode, 0);
+	if(errval)
+		goto out;
+	/* the holes are filled in pte pages of this file alone */
+	errval = nvmm_unshare_range(inode, start, end, 0);
+	if(errval)
+		goto out;
+
+	for(blocknr = start; blocknr < end; blocknr++)
+		if(!nvmm_find_data_block(inode, blocknr))
+			holes++;
+	if(0 == holes)
+		goto out;
+
+	pfns = kmalloc(min_t(unsigned long, holes, NVMM_INSERT_BATCH) * sizeof(unsigned long), GFP_NOFS);
+	if(!pfns){
+		errval = -ENOMEM;
+		goto out;
+	}
+
+	errval = nvmm_new_block(sb, &phys, 1, holes);
+	if(errval){
+		nvmm_error(sb, __FUNCTION__, "no block space left!\n");
+		kfree(pfns);
+		errval = -ENOSPC;
+		goto out;
+	}
+
+	base = nsi->phy_addr;
+	cur = phys;
+	blocknr = start;
+	while(holes > 0 && blocknr < end){
+		/* skip the blocks already present */
+		while(nvmm_find_data_block(inode, blocknr))
+			blocknr++;
+
+		/* a run of holes, at most one batch long */
+		for(nr = 0; nr < NVMM_INSERT_BATCH && nr < holes &&
+				blocknr + nr < end &&
+				!nvmm_find_data_block(inode, blocknr + nr); nr++){
+			p = __va(cur);
+			pfns[nr] = cur >> PAGE_SHIFT;
+			cur = base + *(unsigned long *)p;
+			nvmm_memzero_persist(p, PAGE_SIZE);
+		}
+		nvmm_persist_barrier();
+
+		errval = nvmm_insert_pages(sb, inode, blocknr << PAGE_SHIFT, pfns, nr);
+		if(unlikely(errval != 0)){
+			done = nvmm_inserted(inode, blocknr, nr);
+			inode->i_blocks += done;
+			for(i = done; i < nr; i++)
+				nvmm_free_block(sb, pfns[i]);
+			nvmm_free_chain(sb, cur, holes - nr);
+			break;
+		}
+
+		inode->i_blocks += nr;
+		blocknr += nr;
+		holes -= nr;
+	}
+	nvmm_persist_barrier();
+	ni->i_blocks = cpu_to_le64(inode->i_blocks);
+
+	kfree(pfns);
+out:
+	return errval;
+}
+
+int nvmm_alloc_range(struct inode *inode, unsigned long start, unsigned long num)
+{
+	int errval;
+
+	mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+	errval = __nvmm_alloc_range(inode, start, num);
+	mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+	return errval;
+}
+
 
 /*
  * input :
@@ -296,6 +514,7 @@ static int nvmm_read_inode(struct inode *inode, struct nvmm_inode *ni)
 	ni_info->i_dtime = 0;
 	ni_info->i_state = 0;
 	ni_info->i_flags = le32_to_cpu(ni->i_flags);
+	nvmm_log_load(inode, ni);
 	//inode->i_ino = nvmm_get_inodenr(inode->i_sb, (unsigned long)ni);
 	inode->i_mapping->a_ops = &nvmm_aops;
 	inode->i_mapping->backing_dev_info = &nvmm_backing_dev_info;
@@ -349,6 +568,8 @@ static int nvmm_read_inode(struct inode *inode, struct nvmm_inode *ni)
 int nvmm_update_inode(struct inode *inode)
 {
 	struct nvmm_inode *ni;
+	unsigned int sync = NVMM_SYNC_INODE;
+	__le32 flags;
 	int retval = 0;
 
 	ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
@@ -361,6 +582,10 @@ int nvmm_update_inode(struct inode *inode)
 	spin_lock(&NVMM_I(inode)->i_meta_spinlock);
 
 
+	/* the fields are not written back here, fsync does it */
+	if (ni->i_size != cpu_to_le64(inode->i_size) ||
+	    ni->i_blocks != cpu_to_le64(inode->i_blocks))
+		sync |= NVMM_SYNC_DATASYNC;
 	nvmm_memunlock_inode(inode->i_sb, ni);
 	ni->i_mode = cpu_to_le32(inode->i_mode);
 	ni->i_uid = cpu_to_le32(inode->i_uid);
@@ -372,10 +597,22 @@ int nvmm_update_inode(struct inode *inode)
 	ni->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
 	ni->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
 	ni->i_generation = cpu_to_le32(inode->i_generation);
+	/*
+	 * the flags SETFLAGS changes, masked for the type of the inode as
+	 * nvmm_mask_flags() does, the flags of the file system stay as
+	 * they are in NVM
+	 */
+	flags = cpu_to_le32(NVMM_I(inode)->i_flags & NVMM_FL_USER_MODIFIABLE);
+	if (S_ISREG(inode->i_mode))
+		flags &= cpu_to_le32(NVMM_REG_FLMASK);
+	else if (!S_ISDIR(inode->i_mode))
+		flags &= cpu_to_le32(NVMM_OTHER_FLMASK);
+	ni->i_flags = (ni->i_flags & cpu_to_le32(~NVMM_FL_USER_MODIFIABLE)) | flags;
 
 		
 	nvmm_memlock_inode(inode->i_sb, ni);
 	spin_unlock(&NVMM_I(inode)->i_meta_spinlock);
+	nvmm_sync_mark_inode(inode, sync);
 //	spin_unlock(&update_inode_lock);
 	//mutex_unlock(&NVMM_I(inode)->i_meta_mutex);
 	return retval;
@@ -409,6 +646,7 @@ void nvmm_free_inode(struct inode *inode)
 
 	ni->i_dtime = cpu_to_le32(get_seconds());
 	ni->i_pg_addr = 0;
+	ni->i_pgd_addr = 0;
 
 	nvmm_memlock_inode(sb, ni);
 
@@ -527,6 +765,7 @@ void nvmm_evict_inode(struct inode * inode)
 	}else{
 		dquot_drop(inode);
 	}
+	nvmm_log_evict(inode, want_delete);
 	truncate_inode_pages(&inode->i_data, 0);
 	if (want_delete) {
 		sb_start_intwrite(inode->i_sb);
@@ -585,6 +824,8 @@ struct inode *nvmm_new_inode(struct inode *dir, umode_t mode, const struct qstr
 		ni = nvmm_get_inode(sb, ino),
 		ns->s_free_inode_start = ni->i_pg_addr;
 		ni->i_pg_addr = 0;
+		ni->i_pgd_addr = 0;
+		ni->i_log_addr = 0;
 		nvmm_dbg("allocating inode %lu\n", ino);
 		nvmm_memunlock_super(sb, ns);
 		le64_add_cpu(&ns->s_free_inode_count, -1);
@@ -765,6 +1006,7 @@ static int nvmm_block_truncate_page(struct inode *inode, loff_t newsize)
 	struct super_block *sb = inode->i_sb;
 	unsigned long offset = newsize & (sb->s_blocksize - 1);
 	unsigned long length;
+	u64 phys;
 	char *bp;
 	int ret = 0;
 
@@ -773,13 +1015,24 @@ static int nvmm_block_truncate_page(struct inode *inode, loff_t newsize)
 
 	length = sb->s_blocksize - offset;
 
-	bp = NVMM_I(inode)->i_virt_addr;
-	if(!bp){
-		ret = -EACCES;
-		goto out;
+	/* a block shared with a clone is copied before it is cleared */
+	if(nvmm_reflinked(inode)){
+		mutex_lock(&NVMM_I(inode)->i_alloc_mutex);
+		ret = nvmm_unshare_range(inode, newsize >> sb->s_blocksize_bits,
+				(newsize >> sb->s_blocksize_bits) + 1, 1);
+		mutex_unlock(&NVMM_I(inode)->i_alloc_mutex);
+		if(ret)
+			goto out;
 	}
 
-	memset(bp + offset, 0, length);
+	/* nothing to clear in a hole */
+	phys = nvmm_find_data_block(inode, newsize >> sb->s_blocksize_bits);
+	if(!phys)
+		goto out;
+
+	bp = __va(phys);
+	nvmm_memzero_persist(bp + offset, length);
+	nvmm_persist_barrier();
 
 out:
 	return ret;
@@ -797,6 +1050,7 @@ out:
  */
 static int nvmm_setsize(struct inode *inode, loff_t newsize)
 {
+	struct nvmm_range range;
 	int ret = 0;
 	loff_t oldsize = inode->i_size;
 
@@ -806,20 +1060,31 @@ static int nvmm_setsize(struct inode *inode, loff_t newsize)
 	if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
 		return -EPERM;
 
+	/* writers inside the file run without i_mutex, wait for them all */
+	nvmm_range_lock(&NVMM_I(inode)->i_range_lock, &range, 0, ULONG_MAX);
+	/* no record may land past the new size or in the dropped blocks */
+	ret = nvmm_log_fold(inode);
+	if (ret){
+		nvmm_range_unlock(&NVMM_I(inode)->i_range_lock, &range);
+		return ret;
+	}
 	if(newsize != oldsize){
 		if (mapping_is_xip(inode->i_mapping))
 			ret = xip_truncate_page(inode->i_mapping, newsize);
 		else
 			ret = nvmm_block_truncate_page(inode, newsize);
-		if (ret)
+		if (ret){
+			nvmm_range_unlock(&NVMM_I(inode)->i_range_lock, &range);
 			return ret;
+		}
 
 		i_size_write(inode, newsize);
 	}
 
-	synchronize_rcu();
+	/* the blocks go back after the readers that saw the old size */
 	truncate_pagecache(inode, oldsize, newsize);
 	__nvmm_truncate_blocks(inode, newsize, oldsize);
+	nvmm_range_unlock(&NVMM_I(inode)->i_range_lock, &range);
 
 	/*check for the flag EOFBOCLKS is still valid after the set size*/
 	check_eof_blocks(inode, newsize);
@@ -48,6 +48,13 @@ long nvmm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			goto setflags_out;
 		}
 
+		/* a file can not be both atomic and in place, nor log in place */
+		if ((flags & NVMM_WRITE_FLMASK) == NVMM_WRITE_FLMASK ||
+		    (flags & (NVMM_INPLACE_FL | NVMM_LOG_FL)) == (NVMM_INPLACE_FL | NVMM_LOG_FL)) {
+			ret = -EINVAL;
+			goto setflags_out;
+		}
+
 		flags = nvmm_mask_flags(inode->i_mode, flags);
 
 		mutex_lock(&inode->i_mutex);
@@ -79,8 +86,13 @@ long nvmm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 		nvmm_set_inode_flags(inode);
 		inode->i_ctime = CURRENT_TIME_SEC;
+		/* the records go into the blocks, the log page is freed */
+		if ((oldflags & ~flags) & NVMM_LOG_FL)
+			ret = nvmm_log_release(inode);
 		mutex_unlock(&inode->i_mutex);
 
+		/* the write policy outlives the inode in memory */
+		nvmm_update_inode(inode);
 		mark_inode_dirty(inode);
 setflags_out:
 		mnt_drop_write_file(filp);
@@ -111,6 +123,52 @@ setversion_out:
 		mnt_drop_write_file(filp);
 		return ret;
 	}
+	case NVMM_IOC_GETSTATS: {
+		struct nvmm_write_stats stats;
+		struct nvmm_sb_info *nsi = NVMM_SB(inode->i_sb);
+		int i;
+
+		for (i = 0; i < NVMM_PLAN_MAX; i++)
+			stats.ws_plan[i] = atomic64_read(&nsi->s_plan_count[i]);
+		stats.ws_sync_reqs = atomic64_read(&nsi->s_sync_reqs);
+		stats.ws_sync_passes = atomic64_read(&nsi->s_sync_passes);
+		if (copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+	case NVMM_IOC_CLONE:
+		return nvmm_ioctl_clone(filp, (int)arg, 0, 0, 0);
+	case NVMM_IOC_CLONE_RANGE: {
+		struct nvmm_clone_range range;
+
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		return nvmm_ioctl_clone(filp, range.src_fd, range.src_offset,
+				range.src_length, range.dest_offset);
+	}
+	case NVMM_IOC_COPY_RANGE:
+		return nvmm_ioctl_copy_range(filp,
+				(struct nvmm_copy_file_range __user *) arg);
+	case NVMM_IOC_EXCHANGE_RANGE:
+		return nvmm_ioctl_exchange_range(filp,
+				(struct nvmm_exchange_range __user *) arg);
+	case NVMM_IOC_TX_WRITEV:
+		return nvmm_ioctl_tx_writev(filp, (struct nvmm_tx_writev __user *) arg);
+	case NVMM_IOC_FALLOCATE: {
+		struct nvmm_falloc_range fr;
+
+		if (copy_from_user(&fr, (void __user *) arg, sizeof(fr)))
+			return -EFAULT;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = nvmm_fallocate(filp, fr.mode, fr.offset, fr.length);
+		mnt_drop_write_file(filp);
+		return ret;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -133,6 +191,16 @@ long nvmm_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case NVMM_IOC32_SETVERSION:
 		cmd = NVMM_IOC_SETVERSION;
 		break;
+	case NVMM_IOC_CLONE:
+		/* an fd, not a pointer */
+		return nvmm_ioctl(file, cmd, arg);
+	case NVMM_IOC_GETSTATS:
+	case NVMM_IOC_CLONE_RANGE:
+	case NVMM_IOC_COPY_RANGE:
+	case NVMM_IOC_FALLOCATE:
+	case NVMM_IOC_TX_WRITEV:
+	case NVMM_IOC_EXCHANGE_RANGE:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
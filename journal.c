@@ -0,0 +1,334 @@
+/*
+ * linux/fs/nvmm/journal.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Redo journal of the file page tables. A transaction collects the new
+ * values of several 8-byte table entries, persists them with one commit
+ * record, then stores them in place. A commit found at mount time is
+ * replayed, so either all entries of a transaction are updated or none.
+ * The undo slots serve small in-place writes: the old bytes are saved
+ * in the slot page of the cpu first and copied back at mount if the
+ * write did not finish.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/crc32.h>
+#include "nvmm.h"
+
+static inline struct nvmm_journal_rec *nvmm_journal_rec(struct super_block *sb,
+		struct nvmm_journal *j, unsigned long i)
+{
+	struct nvmm_journal_rec *page;
+
+	page = nvmm_get_block(sb, le64_to_cpu(j->j_pages[i / NVMM_JOURNAL_RECS_PER_PAGE]));
+	return page + i % NVMM_JOURNAL_RECS_PER_PAGE;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @j : journal header
+ * @count : number of records
+ * returns :
+ * checksum of the first @count records
+ */
+static u32 nvmm_journal_sum(struct super_block *sb, struct nvmm_journal *j, unsigned long count)
+{
+	unsigned long i, n;
+	u32 crc = ~0;
+
+	for (i = 0; i < count; i += n) {
+		n = min(count - i, NVMM_JOURNAL_RECS_PER_PAGE);
+		crc = crc32(crc, nvmm_journal_rec(sb, j, i),
+				n * sizeof(struct nvmm_journal_rec));
+	}
+	return crc;
+}
+
+/*
+ * store the records in place, it is done again after a crash, so the
+ * records must be idempotent
+ */
+static void nvmm_journal_apply(struct super_block *sb, struct nvmm_journal *j, unsigned long count)
+{
+	struct nvmm_journal_rec *rec;
+	u64 *entry;
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		rec = nvmm_journal_rec(sb, j, i);
+		entry = nvmm_get_block(sb, le64_to_cpu(rec->r_addr));
+		*entry = le64_to_cpu(rec->r_val);
+		nvmm_flush_buffer(entry, sizeof(*entry), false);
+	}
+	nvmm_persist_barrier();
+}
+
+static void nvmm_journal_set_state(struct nvmm_journal *j, u64 state)
+{
+	j->j_state = cpu_to_le64(state);
+	nvmm_flush_buffer(&j->j_state, sizeof(j->j_state), true);
+}
+
+/*
+ * copy the saved bytes of an unfinished in-place write back, the undo
+ * page of the journal header is only used by images of older versions
+ */
+static void nvmm_journal_rollback(struct super_block *sb, struct nvmm_journal *j)
+{
+	void *undo = nvmm_get_block(sb, le64_to_cpu(j->j_undo_page));
+	void *dst = nvmm_get_block(sb, le64_to_cpu(j->j_undo_addr));
+	unsigned long len = le32_to_cpu(j->j_undo_len);
+
+	if (undo && dst && len <= PAGE_SIZE &&
+			crc32(~0, undo, len) == le32_to_cpu(j->j_undo_sum)) {
+		nvmm_info("rolling back %lu bytes of an in-place write\n", len);
+		nvmm_memcpy_persist(dst, undo, len);
+		nvmm_persist_barrier();
+	}
+	nvmm_journal_set_state(j, NVMM_JOURNAL_IDLE);
+}
+
+static void nvmm_undo_set_state(struct nvmm_undo_slot *slot, u64 state)
+{
+	slot->u_state = cpu_to_le64(state);
+	nvmm_flush_buffer(&slot->u_state, sizeof(slot->u_state), true);
+}
+
+/*
+ * copy the saved bytes of an unfinished in-place write of @slot back
+ */
+static void nvmm_undo_rollback(struct super_block *sb, struct nvmm_undo_slot *slot)
+{
+	void *undo = nvmm_get_block(sb, le64_to_cpu(slot->u_page));
+	void *dst = nvmm_get_block(sb, le64_to_cpu(slot->u_addr));
+	unsigned long len = le32_to_cpu(slot->u_len);
+
+	if (undo && dst && len <= PAGE_SIZE &&
+			crc32(~0, undo, len) == le32_to_cpu(slot->u_sum)) {
+		nvmm_info("rolling back %lu bytes of an in-place write\n", len);
+		nvmm_memcpy_persist(dst, undo, len);
+		nvmm_persist_barrier();
+	}
+	nvmm_undo_set_state(slot, NVMM_JOURNAL_IDLE);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @j : journal header
+ * returns :
+ * 0 if success else error code
+ * roll back the in-place writes left by a crash in any slot, then give
+ * each cpu in use a slot with its undo page
+ */
+static int nvmm_undo_init(struct super_block *sb, struct nvmm_journal *j)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_undo_slot *slot;
+	void *page;
+	unsigned int i;
+
+	for (i = 0; i < NVMM_UNDO_SLOTS; i++)
+		mutex_init(&nsi->s_undo_mutex[i]);
+
+	if (!j->j_undo_slots) {
+		page = (void *)nvmm_get_zeroed_page(sb);
+		if (!page)
+			return -ENOSPC;
+		j->j_undo_slots = cpu_to_le64(nvmm_get_block_off(sb, page));
+		nvmm_flush_buffer(&j->j_undo_slots, sizeof(j->j_undo_slots), true);
+	}
+	nsi->s_undo_slots = nvmm_get_block(sb, le64_to_cpu(j->j_undo_slots));
+	nsi->s_undo_nr = min_t(unsigned int, nr_cpu_ids, NVMM_UNDO_SLOTS);
+
+	for (i = 0; i < NVMM_UNDO_SLOTS; i++) {
+		slot = nsi->s_undo_slots + i;
+		if (le64_to_cpu(slot->u_state) == NVMM_JOURNAL_UNDO)
+			nvmm_undo_rollback(sb, slot);
+		if (i >= nsi->s_undo_nr || slot->u_page)
+			continue;
+		page = (void *)nvmm_get_zeroed_page(sb);
+		if (!page)
+			return -ENOSPC;
+		slot->u_page = cpu_to_le64(nvmm_get_block_off(sb, page));
+		nvmm_flush_buffer(&slot->u_page, sizeof(slot->u_page), true);
+	}
+	return 0;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * returns :
+ * 0 if success else error code
+ * set up the journal the first time the file system is mounted, replay
+ * a committed transaction left by a crash otherwise
+ */
+int nvmm_journal_init(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_super_block *ns = nvmm_get_super(sb);
+	struct nvmm_journal *j;
+	unsigned long count;
+	void *page;
+	int i, retval;
+
+	mutex_init(&nsi->s_journal_mutex);
+	mutex_init(&nsi->s_tx_mutex);
+
+	if (!ns->s_journal_start) {
+		j = (struct nvmm_journal *)nvmm_get_zeroed_page(sb);
+		if (!j)
+			return -ENOSPC;
+		for (i = 0; i < NVMM_JOURNAL_PAGES; i++) {
+			page = (void *)nvmm_get_zeroed_page(sb);
+			if (!page)
+				return -ENOSPC;
+			j->j_pages[i] = cpu_to_le64(nvmm_get_block_off(sb, page));
+		}
+		nvmm_flush_buffer(j, sizeof(*j), true);
+
+		nvmm_memunlock_super(sb, ns);
+		ns->s_journal_start = cpu_to_le64(nvmm_get_block_off(sb, j));
+		nvmm_memlock_super(sb, ns);
+		nvmm_flush_buffer(&ns->s_journal_start, sizeof(ns->s_journal_start), true);
+		nsi->s_journal = j;
+		return nvmm_undo_init(sb, j);
+	}
+
+	j = nvmm_get_block(sb, le64_to_cpu(ns->s_journal_start));
+	nsi->s_journal = j;
+	retval = nvmm_undo_init(sb, j);
+	if (retval)
+		return retval;
+
+	if (le64_to_cpu(j->j_state) == NVMM_JOURNAL_UNDO) {
+		nvmm_journal_rollback(sb, j);
+		return 0;
+	}
+	if (le64_to_cpu(j->j_state) != NVMM_JOURNAL_COMMITTED)
+		return 0;
+
+	count = le32_to_cpu(j->j_count);
+	if (count <= NVMM_JOURNAL_RECS &&
+			nvmm_journal_sum(sb, j, count) == le32_to_cpu(j->j_sum)) {
+		nvmm_info("replaying %lu journal records\n", count);
+		nvmm_journal_apply(sb, j, count);
+	} else {
+		nvmm_error(sb, __FUNCTION__, "bad journal commit record, dropped");
+	}
+	nvmm_journal_set_state(j, NVMM_JOURNAL_IDLE);
+	return 0;
+}
+
+/*
+ * open a transaction, the journal is held until commit or abort
+ */
+void nvmm_journal_begin(struct super_block *sb)
+{
+	mutex_lock(&NVMM_SB(sb)->s_journal_mutex);
+	NVMM_SB(sb)->s_journal_count = 0;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @entry : kernel virtual address of the 8-byte table entry in NVM
+ * @val : the new value of the entry
+ * returns :
+ * 0 if success else -ENOSPC when the transaction is full
+ */
+int nvmm_journal_add(struct super_block *sb, void *entry, u64 val)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_journal_rec *rec;
+
+	if (nsi->s_journal_count >= NVMM_JOURNAL_RECS)
+		return -ENOSPC;
+
+	rec = nvmm_journal_rec(sb, nsi->s_journal, nsi->s_journal_count++);
+	rec->r_addr = cpu_to_le64(nvmm_get_block_off(sb, entry));
+	rec->r_val = cpu_to_le64(val);
+	return 0;
+}
+
+/*
+ * persist the records and the commit record, store the entries, then
+ * retire the transaction and release the journal
+ */
+void nvmm_journal_commit(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_journal *j = nsi->s_journal;
+	unsigned long count = nsi->s_journal_count;
+	unsigned long i, n;
+
+	if (count) {
+		for (i = 0; i < count; i += n) {
+			n = min(count - i, NVMM_JOURNAL_RECS_PER_PAGE);
+			nvmm_flush_buffer(nvmm_journal_rec(sb, j, i),
+					n * sizeof(struct nvmm_journal_rec), false);
+		}
+		j->j_count = cpu_to_le32(count);
+		j->j_sum = cpu_to_le32(nvmm_journal_sum(sb, j, count));
+		nvmm_flush_buffer(j, sizeof(*j), true);
+
+		nvmm_journal_set_state(j, NVMM_JOURNAL_COMMITTED);
+		nvmm_journal_apply(sb, j, count);
+		nvmm_journal_set_state(j, NVMM_JOURNAL_IDLE);
+	}
+
+	mutex_unlock(&nsi->s_journal_mutex);
+}
+
+/*
+ * drop the records of the open transaction, nothing was stored yet
+ */
+void nvmm_journal_abort(struct super_block *sb)
+{
+	NVMM_SB(sb)->s_journal_count = 0;
+	mutex_unlock(&NVMM_SB(sb)->s_journal_mutex);
+}
+
+/*
+ * input :
+ * @inode : vfs inode of the file written
+ * @dst : kernel virtual address of the bytes to overwrite, inside one block
+ * @src : the new bytes, in kernel memory
+ * @len : the size, at most PAGE_SIZE
+ * overwrite @dst in place atomically against a crash: the old bytes are
+ * saved in the undo slot of the cpu before, a crash in the middle
+ * restores them at mount. The copy in place runs under i_undo_lock of
+ * the inode, so the readers that check it never see half of it.
+ */
+void nvmm_journal_undo(struct inode *inode, void *dst, const void *src,
+		unsigned long len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	unsigned int i = raw_smp_processor_id() % nsi->s_undo_nr;
+	struct nvmm_undo_slot *slot = nsi->s_undo_slots + i;
+	void *undo = nvmm_get_block(sb, le64_to_cpu(slot->u_page));
+
+	mutex_lock(&nsi->s_undo_mutex[i]);
+
+	nvmm_memcpy_persist(undo, dst, len);
+	slot->u_addr = cpu_to_le64(nvmm_get_block_off(sb, dst));
+	slot->u_len = cpu_to_le32(len);
+	slot->u_sum = cpu_to_le32(crc32(~0, undo, len));
+	nvmm_flush_buffer(&slot->u_addr, 2 * sizeof(__le64), true);
+	nvmm_undo_set_state(slot, NVMM_JOURNAL_UNDO);
+
+	write_seqlock(&NVMM_I(inode)->i_undo_lock);
+	nvmm_memcpy_persist(dst, src, len);
+	write_sequnlock(&NVMM_I(inode)->i_undo_lock);
+	nvmm_persist_barrier();
+	nvmm_undo_set_state(slot, NVMM_JOURNAL_IDLE);
+
+	mutex_unlock(&nsi->s_undo_mutex[i]);
+}
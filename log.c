@@ -0,0 +1,417 @@
+/*
+ * linux/fs/nvmm/log.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Small write log. A file with NVMM_LOG_FL takes a write of at most
+ * NVMM_LOG_MAX_WRITE bytes inside its size as one record appended to a
+ * log page, the record carries the file position, the bytes and their
+ * checksum, so the write costs the bytes and one fence instead of a
+ * whole page copy and a pointer swap. Readers lay the records over the
+ * blocks, a worker folds them into the blocks once the log fills up or
+ * sits idle.
+ *
+ * A fold copies the records in place and then bumps the generation of
+ * the log, the records drop all at once. A crash in between keeps the
+ * records, copying them again gives the same bytes. Anything that reads
+ * or changes the blocks behind the readers back, a write the log can
+ * not take, truncate, clone, mmap, folds the log first.
+ *
+ * i_log_sem is taken after the range lock and before i_alloc_mutex.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "nvmm.h"
+
+#define NVMM_LOG_HEAD		sizeof(struct nvmm_log_head)
+/* an idle log is folded after this long */
+#define NVMM_LOG_DELAY		(HZ / 10)
+
+#define nvmm_log_for_each(rec, log, tail) \
+	for (rec = (log) + NVMM_LOG_HEAD; (void *)rec < (log) + (tail); \
+	     rec = (void *)rec + nvmm_log_rec_size(le32_to_cpu(rec->r_len)))
+
+static struct workqueue_struct *nvmm_log_wq;
+
+static inline unsigned int nvmm_log_rec_size(u32 len)
+{
+	return sizeof(struct nvmm_log_rec) + ALIGN(len, 8);
+}
+
+static u32 nvmm_log_sum(struct nvmm_log_rec *rec, const void *data, u32 len)
+{
+	u32 crc;
+
+	crc = crc32(~0, (u8 *)rec + sizeof(rec->r_sum),
+			sizeof(*rec) - sizeof(rec->r_sum));
+	return crc32(crc, data, len);
+}
+
+/*
+ * input :
+ * @head : log page
+ * @pos : offset of a record in the page
+ * returns :
+ * the record if it is a valid one else NULL
+ */
+static struct nvmm_log_rec *nvmm_log_valid(struct nvmm_log_head *head, unsigned int pos)
+{
+	struct nvmm_log_rec *rec = (void *)head + pos;
+	u32 len;
+
+	if (pos + sizeof(*rec) > PAGE_SIZE)
+		return NULL;
+	len = le32_to_cpu(rec->r_len);
+	if (!len || len > NVMM_LOG_MAX_WRITE || pos + nvmm_log_rec_size(len) > PAGE_SIZE)
+		return NULL;
+	if (rec->r_gen != head->l_gen ||
+	    le32_to_cpu(rec->r_sum) != nvmm_log_sum(rec, rec + 1, len))
+		return NULL;
+	return rec;
+}
+
+static void nvmm_log_kick(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+
+	/*
+	 * half full, fold now rather than stall the next writer, else once
+	 * the log has been idle NVMM_LOG_DELAY, each record pushes it back
+	 */
+	if (ni_info->i_log_tail > PAGE_SIZE / 2)
+		mod_delayed_work(nvmm_log_wq, &ni_info->i_log_work, 0);
+	else
+		mod_delayed_work(nvmm_log_wq, &ni_info->i_log_work, NVMM_LOG_DELAY);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @ni : nvmm_inode of @inode
+ * find the end of the log left by the last mount, at iget
+ */
+void nvmm_log_load(struct inode *inode, struct nvmm_inode *ni)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_log_head *head;
+	struct nvmm_log_rec *rec;
+	unsigned int pos = NVMM_LOG_HEAD;
+
+	if (!ni->i_log_addr)
+		return;
+
+	head = __va(le64_to_cpu(ni->i_log_addr));
+	while ((rec = nvmm_log_valid(head, pos)))
+		pos += nvmm_log_rec_size(le32_to_cpu(rec->r_len));
+
+	ni_info->i_log = head;
+	ni_info->i_log_tail = pos;
+	if (pos > NVMM_LOG_HEAD)
+		nvmm_log_kick(inode);
+}
+
+/*
+ * fold the records into the blocks of the file, i_log_sem is held for
+ * writing
+ */
+static int __nvmm_log_fold(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_log_head *head = ni_info->i_log;
+	struct nvmm_log_rec *rec;
+	unsigned long first, last;
+	u32 len, bytes;
+	loff_t off;
+	void *src;
+	int err;
+
+	if (!head || ni_info->i_log_tail == NVMM_LOG_HEAD)
+		return 0;
+
+	nvmm_log_for_each(rec, ni_info->i_log, ni_info->i_log_tail) {
+		off = le64_to_cpu(rec->r_offset);
+		len = le32_to_cpu(rec->r_len);
+		first = off >> PAGE_SHIFT;
+		last = (off + len - 1) >> PAGE_SHIFT;
+		err = nvmm_alloc_range(inode, first, last - first + 1);
+		if (err)
+			return err;
+
+		for (src = rec + 1; len; off += bytes, src += bytes, len -= bytes) {
+			bytes = min_t(u32, len, PAGE_SIZE - (off & ~PAGE_MASK));
+			nvmm_memcpy_persist(__va(nvmm_find_data_block(inode, off >> PAGE_SHIFT)) +
+					(off & ~PAGE_MASK), src, bytes);
+		}
+	}
+
+	/* every record is in the blocks before the records go */
+	nvmm_persist_barrier();
+	nvmm_persist_entry(&head->l_gen, cpu_to_le64(le64_to_cpu(head->l_gen) + 1));
+	ni_info->i_log_tail = NVMM_LOG_HEAD;
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * returns :
+ * 0 if success else -ENOSPC
+ * the log page is taken at the first record
+ */
+static int nvmm_log_create(struct inode *inode)
+{
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+	void *log;
+
+	log = nvmm_shadow_get(inode->i_sb);
+	if (!log)
+		return -ENOSPC;
+
+	nvmm_memunlock_inode(inode->i_sb, ni);
+	nvmm_persist_entry(&ni->i_log_addr, cpu_to_le64(__pa(log)));
+	nvmm_memlock_inode(inode->i_sb, ni);
+	NVMM_I(inode)->i_log = log;
+	NVMM_I(inode)->i_log_tail = NVMM_LOG_HEAD;
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pos : file position of the write, @pos + @len is inside the file
+ * @buf : the bytes, in kernel memory
+ * @len : the size of the write, at most NVMM_LOG_MAX_WRITE
+ * returns :
+ * 0 if the record is persistent, -EAGAIN if the file can not take it
+ * any more, else error code
+ * the caller holds the range lock of the blocks of the write
+ */
+int nvmm_log_append(struct inode *inode, loff_t pos, const void *buf, size_t len)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	unsigned int size = nvmm_log_rec_size(len);
+	struct nvmm_log_head *head;
+	struct nvmm_log_rec *rec;
+	int err = 0;
+
+	down_write(&ni_info->i_log_sem);
+	/* mapped or cloned meanwhile, the bytes go to the blocks */
+	if (!nvmm_use_log(inode, len)) {
+		err = -EAGAIN;
+		goto out;
+	}
+	if (!ni_info->i_log) {
+		err = nvmm_log_create(inode);
+		if (err)
+			goto out;
+	}
+	if (ni_info->i_log_tail + size > PAGE_SIZE) {
+		err = __nvmm_log_fold(inode);
+		if (err)
+			goto out;
+	}
+
+	head = ni_info->i_log;
+	rec = ni_info->i_log + ni_info->i_log_tail;
+	rec->r_len = cpu_to_le32(len);
+	rec->r_gen = head->l_gen;
+	rec->r_offset = cpu_to_le64(pos);
+	memcpy(rec + 1, buf, len);
+	rec->r_sum = cpu_to_le32(nvmm_log_sum(rec, buf, len));
+	/* a torn record fails its checksum, it ends the log */
+	nvmm_flush_buffer(rec, size, true);
+	ni_info->i_log_tail += size;
+
+	nvmm_log_kick(inode);
+out:
+	up_write(&ni_info->i_log_sem);
+	return err;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pos : file position
+ * @len : the size
+ * returns :
+ * 1 if a record holds bytes of [pos, pos + len) else 0
+ * i_log_sem is held
+ */
+int nvmm_log_overlaps(struct inode *inode, loff_t pos, size_t len)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_log_rec *rec;
+	loff_t off;
+
+	if (!ni_info->i_log)
+		return 0;
+
+	nvmm_log_for_each(rec, ni_info->i_log, ni_info->i_log_tail) {
+		off = le64_to_cpu(rec->r_offset);
+		if (off < pos + len && pos < off + le32_to_cpu(rec->r_len))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @buf : bytes [pos, pos + len) of the blocks, in kernel memory
+ * @pos : file position
+ * @len : the size
+ * copy the bytes of the records over @buf, the oldest first, i_log_sem
+ * is held
+ */
+void nvmm_log_apply(struct inode *inode, void *buf, loff_t pos, size_t len)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_log_rec *rec;
+	loff_t off, lo, hi;
+
+	if (!ni_info->i_log)
+		return;
+
+	nvmm_log_for_each(rec, ni_info->i_log, ni_info->i_log_tail) {
+		off = le64_to_cpu(rec->r_offset);
+		lo = max_t(loff_t, pos, off);
+		hi = min_t(loff_t, pos + len, off + le32_to_cpu(rec->r_len));
+		if (lo < hi)
+			memcpy(buf + (lo - pos), (void *)(rec + 1) + (lo - off), hi - lo);
+	}
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * returns :
+ * 0 if success else error code
+ * fold the records into the blocks. A caller holding the range lock of
+ * some blocks knows no record of them shows up until it is done.
+ */
+int nvmm_log_fold(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	int err;
+
+	if (!ACCESS_ONCE(ni_info->i_log) ||
+	    ACCESS_ONCE(ni_info->i_log_tail) == NVMM_LOG_HEAD)
+		return 0;
+
+	down_write(&ni_info->i_log_sem);
+	err = __nvmm_log_fold(inode);
+	up_write(&ni_info->i_log_sem);
+	return err;
+}
+
+static void nvmm_log_work(struct work_struct *work)
+{
+	struct nvmm_inode_info *ni_info =
+		container_of(to_delayed_work(work), struct nvmm_inode_info, i_log_work);
+	int err;
+
+	err = nvmm_log_fold(&ni_info->vfs_inode);
+	if (err)
+		nvmm_error(ni_info->vfs_inode.i_sb, __FUNCTION__,
+				"inode %lu: log not folded, error %d\n",
+				ni_info->vfs_inode.i_ino, err);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * returns :
+ * 0 if success else error code
+ * the file is mapped, stores through the mapping reach the blocks and
+ * never the log, so the log is folded and takes no more writes
+ */
+int nvmm_log_disable(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	int err;
+
+	down_write(&ni_info->i_log_sem);
+	ni_info->i_log_off = true;
+	err = __nvmm_log_fold(inode);
+	up_write(&ni_info->i_log_sem);
+	return err;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * returns :
+ * 0 if success else error code
+ * NVMM_LOG_FL was cleared, fold the log and give its page back
+ */
+int nvmm_log_release(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+	void *log;
+	int err;
+
+	down_write(&ni_info->i_log_sem);
+	err = __nvmm_log_fold(inode);
+	log = ni_info->i_log;
+	if (!err && log) {
+		nvmm_memunlock_inode(inode->i_sb, ni);
+		nvmm_persist_entry(&ni->i_log_addr, 0);
+		nvmm_memlock_inode(inode->i_sb, ni);
+		ni_info->i_log = NULL;
+		ni_info->i_log_tail = 0;
+		nvmm_shadow_put(inode->i_sb, log);
+	}
+	up_write(&ni_info->i_log_sem);
+	return err;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @want_delete : the inode is freed
+ * the worker is done with @inode. A live file keeps its records in NVM,
+ * the next iget finds them.
+ */
+void nvmm_log_evict(struct inode *inode, int want_delete)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_inode *ni;
+
+	cancel_delayed_work_sync(&ni_info->i_log_work);
+	if (!ni_info->i_log)
+		return;
+
+	if (want_delete) {
+		ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+		nvmm_memunlock_inode(inode->i_sb, ni);
+		nvmm_persist_entry(&ni->i_log_addr, 0);
+		nvmm_memlock_inode(inode->i_sb, ni);
+		nvmm_free_block(inode->i_sb, __pa(ni_info->i_log) >> PAGE_SHIFT);
+	}
+	ni_info->i_log = NULL;
+	ni_info->i_log_tail = 0;
+}
+
+/* the log state that lives as long as the slab object */
+void nvmm_log_init_once(struct nvmm_inode_info *ni_info)
+{
+	init_rwsem(&ni_info->i_log_sem);
+	INIT_DELAYED_WORK(&ni_info->i_log_work, nvmm_log_work);
+}
+
+int nvmm_log_init(void)
+{
+	nvmm_log_wq = alloc_workqueue("nvmm_log", WQ_UNBOUND, 0);
+	return nvmm_log_wq ? 0 : -ENOMEM;
+}
+
+void nvmm_log_exit(void)
+{
+	destroy_workqueue(nvmm_log_wq);
+}
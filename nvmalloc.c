@@ -36,7 +36,7 @@
 #define DIR_AREA_SIZE       (1UL << 35) // 32G
 #define MAX_DIR_SIZE        (1UL << 21) // 2M
 
-#define MAX_FILE_SIZE       (1UL << 35) // 32G
+#define MAX_FILE_SIZE       (1UL << 35) // 32G, VA window of a regular file
 #define PMD_BYTE_SIZE       (1UL << 30) // 1G
 #define NVMALLOC_DEBUG
 
@@ -343,6 +343,33 @@ int nvmap_pmd(const unsigned long addr, pmd_t *ppmd, struct mm_struct *mm)
 }
 
 
+/*
+ * Clear the kernel pud entry that maps @addr, the counterpart of
+ * nvmap_pmd(). The pmd page itself belongs to the file and is not freed.
+ */
+int unnvmap_pmd(const unsigned long addr, pmd_t *ppmd, struct mm_struct *mm)
+{
+    pgd_t *pgd;
+    pud_t *pud;
+
+    if(!addr) {
+        printk(KERN_WARNING "unnvmap_pmd: null pointer error.\n");
+        return -1;
+    }
+
+    pgd = pgd_offset(mm, addr);
+    if(pgd_none(*pgd))
+        return 0;
+
+    pud = pud_offset(pgd, addr);
+    pud_clear(pud);
+
+    flush_tlb_kernel_range(addr & PUD_MASK, (addr & PUD_MASK) + PUD_SIZE);
+
+    return 0;
+}
+
+
 
 int nvmap_dir(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
 {
@@ -376,7 +403,8 @@ int nvmap_dir(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
 
 int nvmap_file(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
 {
-    unsigned long end = addr + MAX_FILE_SIZE - 1;
+    unsigned long start = addr, end = addr + MAX_FILE_SIZE - 1;
+    int i;
     pgd_t *pgd;
     pud_t *pud;
     pmd_t *pmd;
@@ -386,26 +414,31 @@ int nvmap_file(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
         return -EINVAL;
     }
 
+    /*
+     * a sparse file may have holes at the pud level too, so walk
+     * every pud entry of the file's virtual area and skip the empty ones
+     */
     pgd = pgd_offset(mm, addr);
-    do {
-        pud = pud_alloc(mm, pgd, addr);
-        if(pud == NULL){
-            printk(KERN_WARNING "nvmap: empty pud from addr: 0x%lx\n", addr);
-            return -ENOMEM;
-        }
-        
-        smp_wmb();
-        spin_lock(&mm->page_table_lock);
+    for (i = 0; i < MAX_FILE_SIZE >> PUD_SHIFT; i++, ppud++) {
+        if (!pud_none(*ppud)) {
+            pud = pud_alloc(mm, pgd, addr);
+            if(pud == NULL){
+                printk(KERN_WARNING "nvmap: empty pud from addr: 0x%lx\n", addr);
+                return -ENOMEM;
+            }
+
+            smp_wmb();
+            spin_lock(&mm->page_table_lock);
 
-        pmd = get_pmd(ppud);
-        pud_populate(mm, pud, pmd);
+            pmd = get_pmd(ppud);
+            pud_populate(mm, pud, pmd);
 
-        spin_unlock(&mm->page_table_lock);
+            spin_unlock(&mm->page_table_lock);
+        }
         addr = pud_addr_end(addr, end);
-        ppud++;
-    }while(!pud_none(*ppud));
+    }
 
-    sync_global_pgds(addr, end);
+    sync_global_pgds(start, end);
 
     return 0;
 }
@@ -443,6 +476,7 @@ int unnvmap_file(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
 {
 
     unsigned long end = addr + MAX_FILE_SIZE - 1;
+    int i;
     pgd_t *pgd;
     pud_t *pud;
 
@@ -462,18 +496,17 @@ int unnvmap_file(unsigned long addr, pud_t *ppud, struct mm_struct *mm)
     }
 
     /* here we find out all the pud and clear it. */
-    do {
+    for (i = 0; i < MAX_FILE_SIZE >> PUD_SHIFT; i++, ppud++) {
         pud = pud_offset(pgd, addr);
         if(pud == NULL) {
             printk(KERN_WARNING "unnvmap: empty pud from addr: 0x%lx\n", addr);
             return -1;
         }
-        
+
         pud_clear(pud);
-        
+
         addr = pud_addr_end(addr, end);
-        ppud++;
-    }while(!pud_none(*ppud));
+    }
 
 
     /* 
@@ -16,10 +16,21 @@
 #include <linux/mutex.h>
 #include "wprotect.h"
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/completion.h>
+#include <linux/falloc.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <asm/processor.h>
+#include <asm/special_insns.h>
 
 #define MAX_DIR_SIZE        (1UL << 21) // 2M
 
-#define MAX_FILE_SIZE       (1UL << 35) // 32G
+#define MAX_FILE_SIZE       (1UL << 35) // 32G, VA window of a regular file
+
+/* max page frames handed to nvmm_insert_pages() at once */
+#define NVMM_INSERT_BATCH   (PAGE_SIZE / sizeof(unsigned long))
 
 /*
  * Debug Code
@@ -43,6 +54,52 @@ extern void nvmm_error_mng(struct super_block * sb, const char * fmt, ...);
 extern ssize_t nvmm_direct_IO(int rw, struct kiocb *iocb,
 			  const struct iovec *iov,
 			  loff_t offset, unsigned long nr_segs);
+extern long nvmm_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+
+/*
+ * range lock of a file, see rangelock.c
+ */
+struct nvmm_range {
+	struct rb_node rb;
+	unsigned long start;		/* first block */
+	unsigned long last;		/* last block */
+	unsigned long subtree_last;
+};
+
+struct nvmm_range_lock {
+	spinlock_t lock;
+	struct rb_root tree;		/* held ranges */
+	wait_queue_head_t wait;		/* writers waiting for a range */
+};
+
+/*
+ * bytes of a file written and not written back since the last fsync,
+ * see sync.c
+ */
+struct nvmm_sync_range {
+	loff_t	start;
+	loff_t	end;			/* byte after the last one */
+};
+
+#define NVMM_SYNC_RANGES	8
+
+#define NVMM_SYNC_INODE		0x1	/* the nvmm_inode changed */
+#define NVMM_SYNC_DATASYNC	0x2	/* its size or block count too */
+
+/* one fsync waiting in the group commit of the file system */
+struct nvmm_sync_req {
+	struct list_head list;
+	struct inode	*inode;
+	int		datasync;
+	bool		done;		/* written back and fenced */
+};
+
+struct nvmm_sync_group {
+	spinlock_t	lock;
+	struct list_head queue;		/* requests for the next pass */
+	bool		running;	/* a leader runs a pass */
+	wait_queue_head_t wait;		/* followers */
+};
 
 //change mutex to spinlock
 struct nvmm_inode_info{
@@ -61,6 +118,30 @@ struct nvmm_inode_info{
 	spinlock_t i_meta_spinlock;
 	spinlock_t truncate_spinlock;
 //
+	/* translation cache of nvmm_find_data_block() */
+	seqlock_t i_tc_lock;
+	unsigned long i_tc_pmd_key;	/* file block >> 18 of i_tc_pmd */
+	unsigned long i_tc_pte_key;	/* file block >> 9 of i_tc_pte */
+	u64	*i_tc_pmd;		/* last resolved pmd page */
+	u64	*i_tc_pte;		/* last resolved pte page */
+	unsigned long i_tc_gen;		/* bumped by nvmm_tc_invalidate() */
+	/* serializes filling holes, write path vs mmap faults */
+	struct mutex	i_alloc_mutex;
+	/* in-place undo writes vs readers of the data blocks */
+	seqlock_t i_undo_lock;
+	/* block ranges held by writers and truncate */
+	struct nvmm_range_lock i_range_lock;
+	/* small write log, readers of the records vs appends and folds */
+	struct rw_semaphore i_log_sem;
+	void	*i_log;			/* log page, NULL if none */
+	unsigned int i_log_tail;	/* where the next record goes */
+	bool	i_log_off;		/* mapped once, writes skip the log */
+	struct delayed_work i_log_work;	/* folds the log in the background */
+	/* what fsync has to write back */
+	spinlock_t i_sync_lock;
+	unsigned int i_sync_state;	/* NVMM_SYNC_* */
+	unsigned int i_sync_nr;
+	struct nvmm_sync_range i_sync[NVMM_SYNC_RANGES];
 	struct inode	vfs_inode;
 };
 
@@ -78,6 +159,21 @@ static inline struct nvmm_inode_info *NVMM_I(struct inode *inode)
 {
 	return container_of(inode, struct nvmm_inode_info, vfs_inode);
 }
+
+/*
+ * Drop the translation cache, must be called whenever a pmd or pte
+ * page of the file may be replaced or freed.
+ */
+static inline void nvmm_tc_invalidate(struct inode *inode)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+
+	write_seqlock(&ni_info->i_tc_lock);
+	ni_info->i_tc_pmd_key = ni_info->i_tc_pte_key = ULONG_MAX;
+	ni_info->i_tc_pmd = ni_info->i_tc_pte = NULL;
+	ni_info->i_tc_gen++;
+	write_sequnlock(&ni_info->i_tc_lock);
+}
  
 
 /*
@@ -94,6 +190,20 @@ struct nvmm_mount_options {
 /*!
   This is the initial version, more fields can be added later when necessary
  */
+/*
+ * ways a write can be done, chosen per write by the planner of file.c
+ */
+enum nvmm_write_plan {
+	NVMM_PLAN_INPLACE,	/* copied in place, not atomic */
+	NVMM_PLAN_UNDO,		/* old bytes saved in the undo page, then in place */
+	NVMM_PLAN_PTE_SWAP,	/* one fresh page, one pte store */
+	NVMM_PLAN_JOURNAL,	/* fresh pages, ptes committed by the journal */
+	NVMM_PLAN_PUD_SWAP,	/* shadow pmd page, one pud store */
+	NVMM_PLAN_APPEND,	/* past the end of file, in place, then i_size */
+	NVMM_PLAN_LOG,		/* one record in the small write log */
+	NVMM_PLAN_MAX,
+};
+
 struct nvmm_sb_info {
 	void          *virt_addr;   //!< the filesystem's mount addr
 	phy_addr_t    phy_addr;     //!< the filesystem's phy addr             
@@ -110,6 +220,68 @@ struct nvmm_sb_info {
 //	struct mutex s_lock;
 	spinlock_t s_lock;
 	spinlock_t inode_spinlock;
+	struct nvmm_shadow_pool __percpu *s_shadow;	//!< zeroed pages for atomic writes
+	struct nvmm_shadow_table *s_shadow_table;	//!< the pool pages in NVM, NULL until loaded
+	spinlock_t s_reclaim_lock;	//!< pending batches of replaced pages
+	struct list_head s_reclaim_list;	//!< same order as the chain in NVM
+	struct list_head s_reclaim_wait;	//!< batches with a page still in a pipe
+	struct delayed_work s_reclaim_work;	//!< retries the batches of s_reclaim_wait
+	struct srcu_struct s_srcu;	//!< readers of the file page tables
+	struct nvmm_journal *s_journal;	//!< redo journal header
+	struct mutex s_journal_mutex;	//!< one transaction in the journal at a time
+	struct nvmm_undo_slot *s_undo_slots;	//!< undo slots of in-place writes in NVM
+	unsigned int s_undo_nr;		//!< slots in use, one per cpu at most
+	struct mutex s_undo_mutex[NVMM_UNDO_SLOTS];	//!< one in-place write per slot at a time
+	struct mutex s_tx_mutex;	//!< one multi-file transaction locks its files at a time
+	unsigned long s_journal_count;	//!< records of the open transaction
+	atomic64_t s_plan_count[NVMM_PLAN_MAX];	//!< writes done with each plan
+	__le64 *s_ref_root;		//!< root page of the refcount table, NULL if none yet
+	spinlock_t s_ref_lock;		//!< counts of shared pages
+	struct nvmm_sync_group s_sync;	//!< group commit of the syncs
+	atomic64_t s_sync_reqs;		//!< syncs asked for
+	atomic64_t s_sync_passes;	//!< write back passes that served them
+};
+
+/* zeroed pages kept by each cpu for the shadow pages of atomic writes */
+struct nvmm_shadow_pool {
+	unsigned long nr;
+	__le64 *slots;			/* the same pages in NVM, NULL until loaded */
+	phys_addr_t pages[NVMM_SHADOW_POOL_SIZE];
+};
+
+/* pages replaced by one write, back to the pool after the readers */
+struct nvmm_reclaim {
+	struct rcu_head rcu;
+	struct super_block *sb;
+	struct list_head list;		/* in s_reclaim_list once recorded */
+	struct list_head wait;		/* in s_reclaim_wait while a pipe holds a page */
+	struct nvmm_reclaim_rec *rec;	/* the batch in NVM, NULL if not recorded */
+	unsigned long nr;
+	void *pages[0];
+};
+
+/* pages per batch of a removal, see nvmm_reclaim_queue() */
+#define NVMM_RECLAIM_BATCH	256
+
+/* retry interval of a batch whose pages are still in a pipe */
+#define NVMM_RECLAIM_DELAY	(HZ / 10)
+
+/* transfers from this size on go to the copy engine, in chunks */
+#define NVMM_COPY_MIN		(8UL << 20)
+#define NVMM_COPY_CHUNK		(2UL << 20)
+
+/* a transfer split in @nr items for the copy engine, see copy.c */
+struct nvmm_copy_job {
+	int (*fn)(struct nvmm_copy_job *job, unsigned long i);	/* runs item @i */
+	void *data;
+	unsigned long nr;
+	int err;			/* error of the first failed item */
+	atomic_long_t next;		/* next item to take */
+	atomic_t active;		/* the caller and the threads on the job */
+	struct completion done;
+	struct list_head list;
+	struct mm_struct *mm;		/* mm of the caller */
+	int node;			/* node the job is queued on */
 };
 
 
@@ -159,6 +331,81 @@ static inline __le32 nvmm_mask_flags(umode_t mode, __le32 flags)
 #define	NVMM_IOC_GETVERSION		FS_IOC_GETVERSION
 #define	NVMM_IOC_SETVERSION		FS_IOC_SETVERSION
 
+struct nvmm_write_stats {
+	__u64	ws_plan[NVMM_PLAN_MAX];	/* writes done with each plan */
+	__u64	ws_sync_reqs;		/* fsync calls */
+	__u64	ws_sync_passes;		/* fences that served them */
+};
+
+#define NVMM_IOC_GETSTATS		_IOR('N', 1, struct nvmm_write_stats)
+
+/* same layout and numbers as FICLONERANGE and FICLONE of later kernels */
+struct nvmm_clone_range {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	src_length;		/* 0 up to the end of the source */
+	__u64	dest_offset;
+};
+
+#define NVMM_IOC_CLONE			_IOW(0x94, 9, int)
+#define NVMM_IOC_CLONE_RANGE		_IOW(0x94, 13, struct nvmm_clone_range)
+
+/* copy_file_range() of later kernels */
+struct nvmm_copy_file_range {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	dest_offset;
+	__u64	length;
+	__u64	copied;			/* out: the bytes copied */
+};
+
+#define NVMM_IOC_COPY_RANGE		_IOWR('N', 2, struct nvmm_copy_file_range)
+
+/* fallocate() modes of later kernels, the vfs here does not pass them */
+#ifndef FALLOC_FL_COLLAPSE_RANGE
+#define FALLOC_FL_COLLAPSE_RANGE	0x08
+#endif
+#ifndef FALLOC_FL_INSERT_RANGE
+#define FALLOC_FL_INSERT_RANGE		0x20
+#endif
+
+/* fallocate() with any mode nvmm_fallocate() knows */
+struct nvmm_falloc_range {
+	__u32	mode;
+	__u32	pad;
+	__u64	offset;
+	__u64	length;
+};
+
+#define NVMM_IOC_FALLOCATE		_IOW('N', 3, struct nvmm_falloc_range)
+
+/* one write of an atomic transaction, see tx.c */
+struct nvmm_tx_vec {
+	__s64	fd;
+	__u64	offset;
+	__u64	buf;			/* user address of the bytes */
+	__u64	len;
+};
+
+struct nvmm_tx_writev {
+	__u64	vecs;			/* user address of the nvmm_tx_vec array */
+	__u64	nr;
+};
+
+#define NVMM_IOC_TX_WRITEV		_IOW('N', 4, struct nvmm_tx_writev)
+
+/* same layout as struct xfs_exchange_range of later kernels */
+struct nvmm_exchange_range {
+	__s32	file1_fd;		/* the staging file */
+	__u32	pad;
+	__u64	file1_offset;
+	__u64	file2_offset;		/* in the file of the ioctl */
+	__u64	length;			/* 0 up to the end of the staging file */
+	__u64	flags;			/* none yet, must be 0 */
+};
+
+#define NVMM_IOC_EXCHANGE_RANGE		_IOW('N', 5, struct nvmm_exchange_range)
+
 /*
  * ioctl commands in 32 bit emulation
  */
@@ -170,8 +417,8 @@ static inline __le32 nvmm_mask_flags(umode_t mode, __le32 flags)
 /*
  * Inode flags (GETFLAGS/SETFLAGS)
  */
-#define NVMM_FL_USER_VISIBLE		FS_FL_USER_VISIBLE	/* User visible flags */
-#define NVMM_FL_USER_MODIFIABLE		FS_FL_USER_MODIFIABLE	/* User modifiable flags */
+#define NVMM_FL_USER_VISIBLE		(FS_FL_USER_VISIBLE | NVMM_WRITE_FLMASK | NVMM_LOG_FL)	/* User visible flags */
+#define NVMM_FL_USER_MODIFIABLE		(FS_FL_USER_MODIFIABLE | NVMM_WRITE_FLMASK | NVMM_LOG_FL)	/* User modifiable flags */
 static inline int nvmm_calc_checksum(u8 *data, int n)
 {
 	u32 crc = 0;
@@ -252,6 +499,13 @@ nvmm_get_block(struct super_block *sb, u64 block)
 	return block ? ((void *)ps + block) : NULL;
 }
 
+static inline u64
+nvmm_get_block_off(struct super_block *sb, void *addr)
+{
+	struct nvmm_super_block *ps = nvmm_get_super(sb);
+	return (u64)(addr - (void *)ps);
+}
+
 static inline void check_eof_blocks(struct inode *inode, loff_t size)
 {
 	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
@@ -264,6 +518,89 @@ static inline void check_eof_blocks(struct inode *inode, loff_t size)
 		ni->i_flags &= cpu_to_le32(~NVMM_EOFBLOCKS_FL);
 }
 
+/* write back instructions, see nvmm_persist_init() */
+#define NVMM_FLUSH_CLFLUSH	0
+#define NVMM_FLUSH_CLFLUSHOPT	1
+#define NVMM_FLUSH_CLWB		2
+
+extern int nvmm_flush_insn;
+
+static inline void nvmm_flush_line(void *p)
+{
+	switch (nvmm_flush_insn) {
+	case NVMM_FLUSH_CLWB:
+		/* clwb, encoded as 66 0f ae /6 */
+		asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)p));
+		break;
+	case NVMM_FLUSH_CLFLUSHOPT:
+		asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)p));
+		break;
+	default:
+		clflush(p);
+	}
+}
+
+/*
+ * order the write backs and non-temporal stores issued so far before
+ * the stores that follow
+ */
+static inline void nvmm_persist_barrier(void)
+{
+	wmb();
+}
+
+/*
+ * write back the cache lines of [buf, buf + len) to NVM, @fence orders
+ * the write back before the following stores
+ */
+static inline void nvmm_flush_buffer(void *buf, unsigned long len, bool fence)
+{
+	unsigned long i, line = boot_cpu_data.x86_clflush_size;
+
+	len += (unsigned long)buf & (line - 1);
+	buf = (void *)((unsigned long)buf & ~(line - 1));
+	for (i = 0; i < len; i += line)
+		nvmm_flush_line(buf + i);
+	if (fence)
+		nvmm_persist_barrier();
+}
+
+/*
+ * writes of @inode go in place rather than through the atomic pointer
+ * swap: the per-file flags win, otherwise the mount default applies
+ */
+static inline int nvmm_use_inplace(struct inode *inode)
+{
+	unsigned int flags = NVMM_I(inode)->i_flags;
+
+	if (flags & NVMM_ATOMIC_FL)
+		return 0;
+	if (flags & NVMM_INPLACE_FL)
+		return 1;
+	return test_opt(inode->i_sb, INPLACE) ? 1 : 0;
+}
+
+/*
+ * some pte pages or data pages of @inode may be shared with a clone, a
+ * page must be made private before it is changed
+ */
+static inline int nvmm_reflinked(struct inode *inode)
+{
+	return ACCESS_ONCE(NVMM_I(inode)->i_flags) & NVMM_REFLINK_FL;
+}
+
+/*
+ * a write of @len bytes inside @inode may go to its small write log: the
+ * file asks for it, no clone shares its blocks and it was never mapped
+ */
+static inline int nvmm_use_log(struct inode *inode, size_t len)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+
+	return (ni_info->i_flags & NVMM_LOG_FL) && len <= NVMM_LOG_MAX_WRITE &&
+		!nvmm_reflinked(inode) && !ACCESS_ONCE(ni_info->i_log_off);
+}
+
 /*
 static void nvmm_set_blocksize(struct super_block *sb,unsigned long size)
 {
@@ -299,6 +636,8 @@ extern unsigned long nvmm_get_zeroed_page(struct super_block *sb);
 /* inode.c */
 extern u64 nvmm_find_data_block(struct inode *inode, unsigned long file_blocknr);
 extern int nvmm_alloc_blocks(struct inode *inode, int num);
+extern int __nvmm_alloc_range(struct inode *inode, unsigned long start, unsigned long num);
+extern int nvmm_alloc_range(struct inode *inode, unsigned long start, unsigned long num);
 extern int nvmm_update_inode(struct inode *inode);
 extern struct inode *nvmm_iget(struct super_block *sb, unsigned long ino);
 extern void nvmm_evict_inode(struct inode * inode);
@@ -312,17 +651,32 @@ extern void nvmm_free_inode(struct inode *inode);
 /* pagtable.c */
 extern int nvmm_establish_mapping(struct inode *inode);
 extern int nvmm_insert_page(struct super_block *sb, struct inode *inode, struct page *pg);
+extern int nvmm_insert_pages(struct super_block *sb, struct inode *inode,
+                             unsigned long offset, unsigned long *pfns, unsigned long nr);
 extern int nvmm_destroy_mapping(struct inode *inode);
 extern void nvmm_rm_pg_table(struct super_block *sb, u64 ino);
+extern pmd_t *nvmm_file_pmd_alloc(struct super_block *sb, struct inode *inode, unsigned long offset);
+extern pte_t *nvmm_file_pte_alloc(struct super_block *sb, struct inode *inode, unsigned long offset);
+extern unsigned long nvmm_next_data_block(struct inode *inode, unsigned long blocknr, unsigned long end);
 extern pud_t* nvmm_get_pud(struct super_block *sb, u64 ino);
+extern pud_t *nvmm_get_pud_page(struct super_block *sb, u64 ino, unsigned long offset);
+extern pud_t *nvmm_pud_alloc(struct super_block *sb, unsigned long ino, unsigned long offset);
+extern pmd_t* nvmm_get_pmd(pud_t *pud);
+extern pte_t* nvmm_get_pte(pmd_t *pmd);
 extern int nvmm_init_pg_table(struct super_block *sb, u64 ino);
 extern int nvmm_mapping_file(struct inode *inode);
 extern int nvmm_unmapping_file(struct inode *inode);
 extern void nvmm_setup_pud(pud_t *pud, pmd_t *pmd);
 extern void nvmm_setup_pmd(pmd_t *pmd, pte_t *pte);
 extern void nvmm_setup_pte(pte_t *pte, struct page *pg);
-extern void nvmm_rm_pte_range(struct super_block *sb, pmd_t *pmd);
-extern void nvmm_rm_pmd_range(struct super_block *sb, pud_t *pud);
+extern unsigned long nvmm_rm_pte_range(struct super_block *sb, pmd_t *pmd,
+                                       struct nvmm_reclaim **rc);
+extern unsigned long nvmm_rm_pmd_range(struct super_block *sb, pud_t *pud,
+                                       struct nvmm_reclaim **rc);
+extern unsigned long nvmm_rm_pg_range(struct super_block *sb, struct inode *inode,
+                                      unsigned long start, unsigned long end);
+extern int nvmm_shift_blocks(struct super_block *sb, struct inode *inode,
+                             unsigned long from, unsigned long to, unsigned long nr);
 /*
  * Inode and files operations
  */
@@ -341,6 +695,95 @@ extern struct nvmm_dir_entry *nvmm_dotdot(struct inode *dir);
 extern void nvmm_set_link(struct inode *dir, struct nvmm_dir_entry *de, struct inode *inode,
                           int update_times);
 
+/* shadow.c */
+extern int nvmm_shadow_init(struct super_block *sb);
+extern int nvmm_shadow_load(struct super_block *sb);
+extern void nvmm_shadow_drain(struct super_block *sb);
+extern void *nvmm_shadow_get(struct super_block *sb);
+extern void nvmm_shadow_put(struct super_block *sb, void *addr);
+extern void nvmm_shadow_release_pte(struct super_block *sb, pte_t *pte,
+		unsigned long first, unsigned long end);
+extern struct nvmm_reclaim *nvmm_reclaim_alloc(struct super_block *sb, unsigned long max);
+extern void nvmm_reclaim_add(struct nvmm_reclaim *rc, void *addr);
+extern void nvmm_reclaim_pte(struct nvmm_reclaim *rc, pte_t *pte,
+		unsigned long first, unsigned long end);
+extern void nvmm_reclaim_queue(struct super_block *sb, struct nvmm_reclaim **rcp,
+		void *addr);
+extern void nvmm_reclaim_one(struct super_block *sb, void *addr);
+extern void nvmm_reclaim_defer(struct nvmm_reclaim *rc);
+
+/* reflink.c */
+extern void nvmm_ref_init(struct super_block *sb);
+extern int nvmm_ref_get(struct super_block *sb, void *addr);
+extern int nvmm_ref_put(struct super_block *sb, void *addr);
+extern unsigned long nvmm_ref_count(struct super_block *sb, void *addr);
+extern int nvmm_unshare_pte(struct inode *inode, pmd_t *pmd, unsigned long blocknr);
+extern int nvmm_unshare_range(struct inode *inode, unsigned long start,
+		unsigned long end, int data);
+extern long nvmm_ioctl_clone(struct file *dst, int src_fd, u64 src_off,
+		u64 len, u64 dst_off);
+extern long nvmm_ioctl_copy_range(struct file *dst, struct nvmm_copy_file_range __user *arg);
+extern long nvmm_ioctl_exchange_range(struct file *dst,
+		struct nvmm_exchange_range __user *arg);
+
+/* tx.c */
+extern long nvmm_ioctl_tx_writev(struct file *filp, struct nvmm_tx_writev __user *arg);
+
+/* log.c */
+extern int nvmm_log_init(void);
+extern void nvmm_log_exit(void);
+extern void nvmm_log_init_once(struct nvmm_inode_info *ni_info);
+extern void nvmm_log_load(struct inode *inode, struct nvmm_inode *ni);
+extern int nvmm_log_append(struct inode *inode, loff_t pos, const void *buf, size_t len);
+extern int nvmm_log_overlaps(struct inode *inode, loff_t pos, size_t len);
+extern void nvmm_log_apply(struct inode *inode, void *buf, loff_t pos, size_t len);
+extern int nvmm_log_fold(struct inode *inode);
+extern int nvmm_log_disable(struct inode *inode);
+extern int nvmm_log_release(struct inode *inode);
+extern void nvmm_log_evict(struct inode *inode, int want_delete);
+
+/* sync.c */
+extern void nvmm_sync_init(struct super_block *sb);
+extern void nvmm_sync_init_once(struct nvmm_inode_info *ni_info);
+extern void nvmm_sync_track(struct inode *inode, loff_t pos, size_t len);
+extern void nvmm_sync_mark_inode(struct inode *inode, unsigned int bits);
+extern int nvmm_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+/* copy.c */
+extern int nvmm_copy_init(void);
+extern void nvmm_copy_exit(void);
+extern int nvmm_copy_run(struct nvmm_copy_job *job);
+
+/* aio.c */
+typedef ssize_t (*nvmm_aio_fn)(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos);
+extern int nvmm_aio_init(void);
+extern void nvmm_aio_exit(void);
+extern ssize_t nvmm_aio_queue(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, nvmm_aio_fn fn);
+
+/* rangelock.c */
+extern void nvmm_range_lock_init(struct nvmm_range_lock *rl);
+extern void nvmm_range_lock(struct nvmm_range_lock *rl, struct nvmm_range *r,
+		unsigned long start, unsigned long last);
+extern void nvmm_range_unlock(struct nvmm_range_lock *rl, struct nvmm_range *r);
+
+/* persist.c */
+extern void nvmm_persist_init(void);
+extern void nvmm_memcpy_persist(void *dst, const void *src, size_t len);
+extern void nvmm_memzero_persist(void *dst, size_t len);
+extern size_t nvmm_copy_from_user_persist(void *dst, const void __user *src, size_t len);
+extern void nvmm_persist_entry(void *entry, u64 val);
+
+/* journal.c */
+extern int nvmm_journal_init(struct super_block *sb);
+extern void nvmm_journal_begin(struct super_block *sb);
+extern int nvmm_journal_add(struct super_block *sb, void *entry, u64 val);
+extern void nvmm_journal_commit(struct super_block *sb);
+extern void nvmm_journal_abort(struct super_block *sb);
+extern void nvmm_journal_undo(struct inode *inode, void *dst, const void *src,
+		unsigned long len);
+
 /* nvmalloc.c */
 extern int nvmalloc_init(void);
 extern void *nvmalloc(const int mode);
@@ -354,7 +797,6 @@ extern void print_used_list(int mode);
 
 
 /* file.c */
-extern int nvmm_fsync(struct file *file, struct dentry *dentry, int datasync);
 extern const struct inode_operations nvmm_file_inode_operations;
 extern const struct file_operations  nvmm_file_operations;
 extern const struct file_operations  nvmm_xip_file_operations;
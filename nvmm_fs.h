@@ -29,11 +29,12 @@
 #define NVMM_MOUNT_ERRORS_CONT		0x000010  /* Continue on errors */
 #define NVMM_MOUNT_ERRORS_RO		0x000020  /* Remount fs ro on errors */
 #define NVMM_MOUNT_ERRORS_PANIC		0x000040  /* Panic on errors */
+#define NVMM_MOUNT_INPLACE		0x000080  /* Write in place by default */
 
 typedef __le64 phy_addr_t;
 
-/* max file size in bytes */
-#define NVMM_MAX_FILE_SIZE	(1UL << 35)
+/* max file size in bytes, a pgd page of 512 pud pages */
+#define NVMM_MAX_FILE_SIZE	(1UL << 48)
 /* max dir size in bytes*/
 #define NVMM_MAX_DIR_SIZE	(1UL << 21)
 
@@ -71,14 +72,24 @@ typedef __le64 phy_addr_t;
  * nvmm inode flags
  *
  * NVMM_EOFBLOCKS_FL	There are blocks allocated beyond eof
+ * NVMM_INPLACE_FL	Writes go in place, whatever the mount default
+ * NVMM_ATOMIC_FL	Writes are atomic, whatever the mount default
+ * NVMM_REFLINK_FL	Table or data pages may be shared with another file
+ * NVMM_LOG_FL		Small writes go to the log of the file first
  */
 #define NVMM_EOFBLOCKS_FL	0x20000000
+#define NVMM_INPLACE_FL		0x10000000
+#define NVMM_ATOMIC_FL		0x08000000
+#define NVMM_REFLINK_FL		0x04000000
+#define NVMM_LOG_FL		0x02000000
+#define NVMM_WRITE_FLMASK	(NVMM_INPLACE_FL | NVMM_ATOMIC_FL)
 
 /* Flags that should be inherited by new inodes from their parent. */
 #define NVMM_FL_INHERITED (FS_SECRM_FL | FS_UNRM_FL | FS_COMPR_FL |\
 			   FS_SYNC_FL | FS_NODUMP_FL | FS_NOATIME_FL | \
 			   FS_COMPRBLK_FL | FS_NOCOMP_FL | FS_JOURNAL_DATA_FL |\
-			   FS_NOTAIL_FL | FS_DIRSYNC_FL)
+			   FS_NOTAIL_FL | FS_DIRSYNC_FL | NVMM_WRITE_FLMASK |\
+			   NVMM_LOG_FL)
 
 /* Flags that are appropriate for regular files (all but dir-specific ones). */
 #define NVMM_REG_FLMASK (~(FS_DIRSYNC_FL | FS_TOPDIR_FL))
@@ -128,9 +139,33 @@ struct nvmm_inode {
     __le32  i_generation;   /* File version (for NFS) */
     __le64  i_pg_addr;      /* File page table */
     __le64  i_next_inode_offset; /* offset of the next inode */
-    char    i_pad[48];      /* padding bytes */
+    __le64  i_pgd_addr;     /* Top level of the page table, files past 512GB */
+    __le64  i_log_addr;     /* Small write log page, 0 if none */
+    char    i_pad[32];      /* padding bytes */
 };
 
+/*
+ * The small write log of a file is one page at i_log_addr, a head then
+ * records packed one after the other. A record is valid while it has
+ * the generation of the head and its checksum holds, the first one that
+ * does not ends the log. A fold copies the records into the blocks of
+ * the file and bumps the generation of the head, that drops them all.
+ */
+struct nvmm_log_head {
+    __le64  l_gen;          /* Generation of the valid records */
+    __le64  l_pad;
+};
+
+struct nvmm_log_rec {
+    __le32  r_sum;          /* crc32 of the rest of the record and its bytes */
+    __le32  r_len;          /* Bytes of data that follow, 0 ends the log */
+    __le64  r_gen;          /* Generation the record was written in */
+    __le64  r_offset;       /* File position of the bytes */
+};
+
+/* largest write that goes to the log, the bytes are padded to 8 */
+#define NVMM_LOG_MAX_WRITE  512
+
 /*
  * Structure of super block in NVM
  */
@@ -155,8 +190,94 @@ struct nvmm_super_block {
 	char    s_volume_name[16];  /* Volume name */
 	__u8    s_fs_version[16];   /* File system version */
 	__u8    s_uuid[16];         /* File system universally unique identifier */
+	__le64  s_journal_start;    /* Start position of the journal, 0 if none yet */
+	__le64  s_refcount_start;   /* Start position of the refcount table, 0 if none yet */
+	__le64  s_shadow_start;     /* Start position of the shadow page table, 0 if none yet */
+};
+
+/*
+ * Redo journal, commits several 8-byte entries of file page tables at
+ * once. The header page holds the offsets of the record pages.
+ */
+#define NVMM_JOURNAL_PAGES	16
+#define NVMM_JOURNAL_IDLE	0
+#define NVMM_JOURNAL_COMMITTED	1
+#define NVMM_JOURNAL_UNDO	2	/* the undo page holds valid old bytes */
+
+struct nvmm_journal_rec {
+	__le64  r_addr;             /* Offset of the entry to update */
+	__le64  r_val;              /* Value to store there */
+};
+
+#define NVMM_JOURNAL_RECS_PER_PAGE	(PAGE_SIZE / sizeof(struct nvmm_journal_rec))
+#define NVMM_JOURNAL_RECS	(NVMM_JOURNAL_PAGES * NVMM_JOURNAL_RECS_PER_PAGE)
+
+struct nvmm_journal {
+	__le64  j_state;            /* NVMM_JOURNAL_IDLE or NVMM_JOURNAL_COMMITTED */
+	__le32  j_count;            /* Number of records */
+	__le32  j_sum;              /* Checksum of the records */
+	__le64  j_pages[NVMM_JOURNAL_PAGES]; /* Offsets of the record pages */
+	__le64  j_undo_page;        /* Offset of the undo page */
+	__le64  j_undo_addr;        /* Offset of the bytes saved in the undo page */
+	__le32  j_undo_len;         /* Number of bytes saved */
+	__le32  j_undo_sum;         /* Checksum of the saved bytes */
+	__le64  j_undo_slots;       /* Offset of the undo slot page, 0 if none yet */
+};
+
+/*
+ * Undo slots of in-place writes, the cpus share them so that small
+ * writes on different cpus do not wait for each other. A slot in state
+ * NVMM_JOURNAL_UNDO holds the old bytes of a write in its own page.
+ */
+struct nvmm_undo_slot {
+	__le64  u_state;            /* NVMM_JOURNAL_IDLE or NVMM_JOURNAL_UNDO */
+	__le64  u_page;             /* Offset of the undo page, 0 if none yet */
+	__le64  u_addr;             /* Offset of the bytes saved in the undo page */
+	__le32  u_len;              /* Number of bytes saved */
+	__le32  u_sum;              /* Checksum of the saved bytes */
+	__le64  u_pad[4];           /* one cache line per slot */
+};
+
+#define NVMM_UNDO_SLOTS		(PAGE_SIZE / sizeof(struct nvmm_undo_slot))
+
+/*
+ * Pages held by atomic writes outside the free list and the files: the
+ * zeroed pages of the per-cpu pools, one slot page holds the slots of
+ * several cpus, and the batches of replaced pages that wait for the
+ * readers. They all go back to the free list at mount.
+ */
+#define NVMM_SHADOW_POOL_SIZE	64
+#define NVMM_SHADOW_CPUS_PER_PAGE	(PAGE_SIZE / (NVMM_SHADOW_POOL_SIZE * sizeof(__le64)))
+#define NVMM_SHADOW_TABLE_PAGES	(PAGE_SIZE / sizeof(__le64) - 2)
+#define NVMM_SHADOW_MAX_CPUS	(NVMM_SHADOW_TABLE_PAGES * NVMM_SHADOW_CPUS_PER_PAGE)
+
+struct nvmm_shadow_table {
+	__le64  t_cpus;             /* Number of cpus the slot pages hold */
+	__le64  t_pending;          /* Offset of the first pending batch, 0 if none */
+	__le64  t_pages[NVMM_SHADOW_TABLE_PAGES]; /* Offsets of the slot pages */
+};
+
+#define NVMM_RECLAIM_REC_PAGES	(PAGE_SIZE / sizeof(__le64) - 3)
+
+struct nvmm_reclaim_rec {
+	__le64  r_next;             /* Offset of the next pending batch, first page only */
+	__le64  r_more;             /* Offset of the next page of this batch */
+	__le64  r_nr;               /* Number of pages listed in this page */
+	__le64  r_pages[NVMM_RECLAIM_REC_PAGES]; /* Offsets of the pages */
 };
 
+/*
+ * Reference counts of the pte pages and data pages shared by clones.
+ * The root page holds the offsets of 512 middle pages, a middle page the
+ * offsets of 512 count pages, and a count page the counts of 1024
+ * blocks. A count is the number of owners beyond the first one, so the
+ * blocks never shared need no count page.
+ */
+#define NVMM_REF_PER_PAGE	(PAGE_SIZE / sizeof(__le32))
+#define NVMM_REF_SHIFT		10	/* blocks of a count page */
+#define NVMM_REF_DIR_SHIFT	9	/* entries of a root or middle page */
+#define NVMM_REF_MAX_BLOCKS	(1UL << (NVMM_REF_SHIFT + 2 * NVMM_REF_DIR_SHIFT))
+
 /*
  * Maximal count of links to a file
  */
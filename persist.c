@@ -0,0 +1,178 @@
+/*
+ * linux/fs/nvmm/persist.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Copy and zero routines for NVM. Large transfers use non-temporal
+ * stores, they bypass the cache and do not push the working set out of
+ * the LLC. Small ones are cached stores followed by a write back of the
+ * lines, with clwb or clflushopt when the cpu has them. None of them
+ * fences: the caller orders the data with nvmm_persist_barrier(), or
+ * publishes it with nvmm_persist_entry().
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <asm/uaccess.h>
+#include "nvmm.h"
+
+/* from this size on the copies and zeroing are non-temporal */
+#define NVMM_NT_THRESHOLD	1024
+
+/* the write back instruction of this cpu, set once at module load */
+int nvmm_flush_insn __read_mostly = NVMM_FLUSH_CLFLUSH;
+
+/*
+ * pick the cheapest write back instruction the cpu knows, clwb keeps
+ * the line in the cache, clflushopt is only weakly ordered
+ */
+void nvmm_persist_init(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (boot_cpu_data.cpuid_level < 7)
+		return;
+
+	cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+	if (ebx & (1 << 24))
+		nvmm_flush_insn = NVMM_FLUSH_CLWB;
+	else if (ebx & (1 << 23))
+		nvmm_flush_insn = NVMM_FLUSH_CLFLUSHOPT;
+}
+
+static inline void nvmm_movnti(void *dst, unsigned long val)
+{
+	asm volatile("movnti %1, %0" : "=m" (*(unsigned long *)dst) : "r" (val));
+}
+
+/*
+ * input :
+ * @dst : destination in NVM
+ * @src : source in kernel memory, NULL to zero @dst
+ * @len : the size
+ * the unaligned head and tail go through the cache and are written back,
+ * the aligned body is stored with movnti
+ */
+static void nvmm_movnt(void *dst, const void *src, size_t len)
+{
+	const unsigned long *s = src;
+	unsigned long *d;
+	size_t head, body;
+
+	head = min_t(size_t, len, -(unsigned long)dst & 7);
+	if (head) {
+		if (src)
+			memcpy(dst, src, head);
+		else
+			memset(dst, 0, head);
+		nvmm_flush_buffer(dst, head, false);
+		dst += head;
+		if (src)
+			s = src + head;
+		len -= head;
+	}
+
+	d = dst;
+	for (body = len >> 3; body >= 4; body -= 4, d += 4) {
+		nvmm_movnti(d, s ? s[0] : 0);
+		nvmm_movnti(d + 1, s ? s[1] : 0);
+		nvmm_movnti(d + 2, s ? s[2] : 0);
+		nvmm_movnti(d + 3, s ? s[3] : 0);
+		if (s)
+			s += 4;
+	}
+	for (; body; body--, d++) {
+		nvmm_movnti(d, s ? *s : 0);
+		if (s)
+			s++;
+	}
+
+	len &= 7;
+	if (len) {
+		if (s)
+			memcpy(d, s, len);
+		else
+			memset(d, 0, len);
+		nvmm_flush_buffer(d, len, false);
+	}
+}
+
+/*
+ * input :
+ * @dst : destination in NVM
+ * @src : source in kernel memory
+ * @len : the size
+ */
+void nvmm_memcpy_persist(void *dst, const void *src, size_t len)
+{
+	if (len >= NVMM_NT_THRESHOLD) {
+		nvmm_movnt(dst, src, len);
+	} else {
+		memcpy(dst, src, len);
+		nvmm_flush_buffer(dst, len, false);
+	}
+}
+
+/*
+ * input :
+ * @dst : destination in NVM
+ * @len : the size to be zeroed
+ */
+void nvmm_memzero_persist(void *dst, size_t len)
+{
+	if (len >= NVMM_NT_THRESHOLD) {
+		nvmm_movnt(dst, NULL, len);
+	} else {
+		memset(dst, 0, len);
+		nvmm_flush_buffer(dst, len, false);
+	}
+}
+
+/*
+ * input :
+ * @dst : destination in NVM
+ * @src : user buffer
+ * @len : the size
+ * returns :
+ * the size not copied, as __copy_from_user()
+ * the bytes before a fault are kept, the rest of @dst is left alone
+ */
+size_t nvmm_copy_from_user_persist(void *dst, const void __user *src, size_t len)
+{
+	size_t left;
+
+	if (len < NVMM_NT_THRESHOLD) {
+		left = __copy_from_user(dst, src, len);
+		nvmm_flush_buffer(dst, len - left, false);
+		return left;
+	}
+
+	might_fault();
+	left = __copy_from_user_inatomic_nocache(dst, src, len);
+	if (unlikely(left)) {
+		nvmm_flush_buffer(dst, len - left, false);
+		return left;
+	}
+	/* the unaligned head and tail bytes were cached stores */
+	nvmm_flush_buffer(dst, 1, false);
+	nvmm_flush_buffer(dst + len - 1, 1, false);
+	return 0;
+}
+
+/*
+ * input :
+ * @entry : kernel virtual address of a pte, pmd, pud or pgd entry in NVM
+ * @val : the new value of the entry
+ * publish the data the entry points to: its lines were written back by
+ * the routines above without a fence, one fence here orders all of them
+ * before the 8-byte store, then the entry is written back too. A write
+ * of many pages pays two fences, not two per page.
+ */
+void nvmm_persist_entry(void *entry, u64 val)
+{
+	nvmm_persist_barrier();
+	ACCESS_ONCE(*(u64 *)entry) = val;
+	nvmm_flush_buffer(entry, sizeof(u64), true);
+}
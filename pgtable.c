@@ -33,12 +33,12 @@ inline void nvmm_setup_pte(pte_t *pte, struct page *pg)
 
 inline void nvmm_setup_pmd(pmd_t *pmd, pte_t *pte)
 {
-    set_pmd(pmd, __pmd(__pa(pte) | _PAGE_TABLE));
+    nvmm_persist_entry(pmd, pmd_val(__pmd(__pa(pte) | _PAGE_TABLE)));
 }
 
 inline void nvmm_setup_pud(pud_t *pud, pmd_t *pmd)
 {
-    set_pud(pud, __pud(__pa(pmd) | _PAGE_TABLE));
+    nvmm_persist_entry(pud, pud_val(__pud(__pa(pmd) | _PAGE_TABLE)));
 }
 
 
@@ -70,7 +70,7 @@ inline void nvmm_rm_pmd(pmd_t *pmd)
 
 inline void nvmm_rm_pte(pte_t *pte)
 {
-   memset((void*)pte, 0x00, PAGE_SIZE);
+   nvmm_memzero_persist((void*)pte, PAGE_SIZE);
     //pte_clear(pte);
 }
 
@@ -143,17 +143,58 @@ int __nvmm_pte_alloc(struct super_block *sb, pmd_t *pmd)
 }
 
 
+/*
+ * Get the pud page covering file offset @offset. The first 512GB of a
+ * file hang on i_pg_addr, the pgd page of i_pgd_addr holds the pud
+ * pages of the following 512GB spans, its entry 0 is left unused.
+ * returns :
+ * the pud page, or NULL if it is not allocated
+ */
+pud_t *nvmm_get_pud_page(struct super_block *sb, u64 ino, unsigned long offset)
+{
+    struct nvmm_inode *ni = nvmm_get_inode(sb, ino);
+    unsigned long index = offset >> PGDIR_SHIFT;
+    pgd_t *pgd;
+
+    if (!index)
+        return nvmm_get_pud(sb, ino);
+    if (!ni->i_pgd_addr)
+        return NULL;
+
+    pgd = (pgd_t *)__va(le64_to_cpu(ni->i_pgd_addr)) + index;
+    if (pgd_none(*pgd))
+        return NULL;
+
+    return (pud_t *)__va(pgd_val(*pgd) & PAGE_MASK);
+}
+
+
 pud_t *nvmm_pud_alloc(struct super_block *sb, unsigned long ino, unsigned long offset)
 {
-    int i = 0;
-    int nr = offset >> PUD_SHIFT;
-    pud_t *pud = nvmm_get_pud(sb, ino);
+    struct nvmm_inode *ni = nvmm_get_inode(sb, ino);
+    unsigned long index = offset >> PGDIR_SHIFT;
+    pgd_t *pgd;
+    pud_t *pud;
 
-    //printk(KERN_INFO "nvmm_pud_alloc: nr = %d\n", nr);
+    if (!index)
+        return nvmm_get_pud(sb, ino) + pud_index(offset);
 
-    while(i++ < nr) pud++;
+    if (!ni->i_pgd_addr) {
+        pgd = (pgd_t *)nvmm_get_zeroed_page(sb);
+        if (!pgd)
+            return NULL;
+        nvmm_persist_entry(&ni->i_pgd_addr, cpu_to_le64(__pa(pgd)));
+    }
 
-    return pud;
+    pgd = (pgd_t *)__va(le64_to_cpu(ni->i_pgd_addr)) + index;
+    if (pgd_none(*pgd)) {
+        pud = nvmm_pud_alloc_one(sb);
+        if (!pud)
+            return NULL;
+        nvmm_persist_entry(pgd, pgd_val(__pgd(__pa(pud) | _PAGE_TABLE)));
+    }
+
+    return (pud_t *)__va(pgd_val(*pgd) & PAGE_MASK) + pud_index(offset);
 }
 
 
@@ -209,159 +250,608 @@ int nvmm_init_pg_table(struct super_block * sb, u64 ino)
 }
 
 
-/*int nvmm_insert_pages(struct super_block *sb, struct inode *vfs_inode, 
-            unsigned long num, phys_addr_t phys)
+/*
+ * Get the pmd entry covering file offset @offset, allocating the pmd
+ * page if it is missing. A new pmd page is inserted to the kernel page
+ * table too.
+ */
+pmd_t *nvmm_file_pmd_alloc(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long offset)
 {
-    unsigned long i = 0;
-    struct nvmm_sb_info *nsi;
-	struct nvmm_inode *ni;
-    phys_addr_t base, next, cur;
-    unsigned long *p;
-    struct page *pg;
-    int res = 0;
-
-    nsi = NVMM_SB(sb);
-    base = nsi->phy_addr;
-    cur = phys;
-
-    if (num == 0 || phys == 0)
-        return -1;
+    unsigned long addr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr + offset;
+    pud_t *pud;
+    pmd_t *pmd;
 
-    for (i = 0; i < num; i++)
-    {
-    	printk(KERN_INFO "MY_DEBUG: pfn = %lx\n", cur);
-        p = (unsigned long*)__va(cur );
-        next = base + *p;
-		memset((void *)p,0,PAGE_SIZE);
-        pg = pfn_to_page(cur >> PAGE_SHIFT);
-	vfs_inode->i_blocks++;
-	ni = nvmm_get_inode(vfs_inode->i_sb, vfs_inode->i_ino);
-	ni->i_blocks =  cpu_to_le32(vfs_inode->i_blocks);
-
-        res = nvmm_insert_page(sb, vfs_inode, pg);
-        
-        if (unlikely(res != 0))
-            return res;        
-        cur = next;
-	printk(KERN_INFO"Insert ok\n");
+    pud = nvmm_pud_alloc(sb, vfs_inode->i_ino, offset);
+    if (unlikely(!pud)) {
+        printk(KERN_INFO "nvmm_empty pud!!!\n");
+        return NULL;
     }
-	//printk(KERN_INFO "In insert_pages, num = %lu\n", num);
-	return 0;
-}*/
 
+    if (unlikely(pud_none(*pud))) {  /* insert to kernel page table */
+        pmd = nvmm_pmd_alloc(sb, pud, addr);
+        if (pmd && offset < MAX_FILE_SIZE)
+            nvmap_pmd(addr, nvmm_get_pmd(pud), current->mm);
+    } else
+        pmd = nvmm_pmd_alloc(sb, pud, addr);
 
+    if (unlikely(!pmd))
+        printk(KERN_INFO "empty pmd!!!\n");
+
+    return pmd;
+}
 
 /*
- * Insert one page to file page table and update the kernel page tablle.
- * Now it suport 32GB file.
+ * Get the pte entry of file offset @offset, allocating the missing
+ * pmd and pte pages on the way.
  */
-
-int nvmm_insert_page(struct super_block *sb, struct inode *vfs_inode, struct page *pg)
+pte_t *nvmm_file_pte_alloc(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long offset)
 {
-    unsigned long ino = 0;
-    unsigned long addr = 0;
-    unsigned long offset = 0;
-    unsigned long new_addr = 0;
-    unsigned long blocks = 0;
-
-    pud_t *pud;
+    unsigned long addr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr + offset;
     pmd_t *pmd;
-    pte_t *pte; 
+    pte_t *pte;
 
-    ino = vfs_inode->i_ino;
-    addr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr;
-    blocks = vfs_inode->i_blocks;
-    offset = (blocks - 1) << PAGE_SHIFT;
-    new_addr = addr + offset;
+    pmd = nvmm_file_pmd_alloc(sb, vfs_inode, offset);
+    if (unlikely(!pmd))
+        return NULL;
 
+    pte = nvmm_pte_alloc(sb, pmd, addr);
+    if (unlikely(!pte))
+        printk(KERN_INFO "empty pte!!!\n");
 
-    pud = nvmm_pud_alloc(sb, ino, offset);
-    if (unlikely(!pud)){
-	    printk(KERN_INFO "nvmm_empty pud!!!\n");
-   	    return -1;
-    }
+    return pte;
+}
 
-    if(unlikely(pud_none(*pud))) {  /* insert to kernel page table */
-	    pmd = nvmm_pmd_alloc(sb, pud, new_addr);	
-    	nvmap_pmd(new_addr, nvmm_get_pmd(pud), current->mm);
-    }else
-	    pmd = nvmm_pmd_alloc(sb, pud, new_addr);
 
-    if (unlikely(!pmd)) {
-	    printk(KERN_INFO "empty pmd!!!\n");
-        return -1;
-    }
-    pte = nvmm_pte_alloc(sb, pmd, new_addr);
-    if (unlikely(!pte)) {
-	    printk(KERN_INFO "empty pte!!!\n");
-	return -1;	
+/*
+ * Insert @nr pages to file page table, the first one at file offset
+ * @offset, the others follow it. @pfns holds the page frame numbers.
+ * A missing pmd or pte page is allocated once when the walk reaches it,
+ * then the pte entries of that page are filled in a tight loop.
+ * On failure the entries are filled up to the page that could not be
+ * allocated.
+ */
+int nvmm_insert_pages(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long offset, unsigned long *pfns, unsigned long nr)
+{
+    unsigned long i = 0, n;
+    pte_t *pte, *start;
+
+    while (i < nr) {
+        pte = nvmm_file_pte_alloc(sb, vfs_inode, offset);
+        if (unlikely(!pte))
+            return -ENOMEM;
+
+        /* fill the pte entries up to the end of this pte page */
+        n = min(nr - i, (unsigned long)(PTRS_PER_PTE - pte_index(offset)));
+        offset += n << PAGE_SHIFT;
+        start = pte;
+        while (n--) {
+            set_pte(pte, pfn_pte(pfns[i], PAGE_KERNEL));
+            pte++;
+            i++;
+        }
+        /* fenced by the caller once the whole range is in */
+        nvmm_flush_buffer(start, (pte - start) * sizeof(pte_t), false);
     }
 
+    return 0;
+}
 
-    /* setup the pte entry for the new page */
-    nvmm_setup_pte(pte, pg);
 
-    return 0;
+/*
+ * Insert one page to file page table and update the kernel page tablle.
+ * The page goes to the last block of the file, vfs_inode->i_blocks must
+ * have been increased before calling.
+ */
+
+int nvmm_insert_page(struct super_block *sb, struct inode *vfs_inode, struct page *pg)
+{
+    unsigned long offset = (vfs_inode->i_blocks - 1) << PAGE_SHIFT;
+    unsigned long pfn = page_to_pfn(pg);
+
+    return nvmm_insert_pages(sb, vfs_inode, offset, &pfn, 1);
 }
 
 
-void nvmm_rm_pte_range(struct super_block *sb, pmd_t *pmd)
+/*
+ * Free the data pages hold by the pte page of @pmd and the pte page
+ * itself. Every entry is visited, holes of a sparse file are skipped.
+ * A pte page shared with a clone only loses a reference, its data pages
+ * stay with the other owners. The pages go to @rc, they are given back
+ * after the readers of the moment.
+ * returns :
+ * the number of data blocks the file loses
+ */
+unsigned long nvmm_rm_pte_range(struct super_block *sb, pmd_t *pmd,
+            struct nvmm_reclaim **rc)
 {
     pte_t *pte, *p;
-    int cnt = 0;
-    unsigned long pagefn;
+    int cnt, shared;
+    unsigned long freed = 0;
 
     p = pte = nvmm_get_pte(pmd);
-	
-	if (!pte_none(*pte)){
-		do {
-			pagefn = (pte_val(*pte) & 0x0fffffffffffffff) >> PAGE_SHIFT;
-			nvmm_free_block(sb, pagefn);
-			pte++;
-			cnt++;
-		}while(!pte_none(*pte) && cnt < PTRS_PER_PTE);
-	}
-    nvmm_pte_free(sb, p);
+    shared = nvmm_ref_put(sb, p);
+
+    for (cnt = 0; cnt < PTRS_PER_PTE; cnt++, pte++) {
+        if (pte_none(*pte))
+            continue;
+        if (!shared)
+            nvmm_reclaim_queue(sb, rc,
+                    __va((pte_val(*pte) & 0x0fffffffffffffff) & PAGE_MASK));
+        freed++;
+    }
+    if (!shared)
+        nvmm_reclaim_queue(sb, rc, p);
+
+    return freed;
 }
 
 
-void nvmm_rm_pmd_range(struct super_block *sb, pud_t *pud)
+unsigned long nvmm_rm_pmd_range(struct super_block *sb, pud_t *pud,
+            struct nvmm_reclaim **rc)
 {
     pmd_t *pmd, *p;
-    int cnt = 0;
+    int cnt;
+    unsigned long freed = 0;
 
     p = pmd = nvmm_get_pmd(pud);
 
-    if (!pmd_none(*pmd)){
-		do {
-			nvmm_rm_pte_range(sb, pmd);
-			pmd++;
-			cnt++;
-		}while(!pmd_none(*pmd) && cnt < PTRS_PER_PMD);
-	}
-    nvmm_pmd_free(sb, p);
+    for (cnt = 0; cnt < PTRS_PER_PMD; cnt++, pmd++) {
+        if (pmd_none(*pmd))
+            continue;
+        freed += nvmm_rm_pte_range(sb, pmd, rc);
+    }
+    nvmm_reclaim_queue(sb, rc, p);
+
+    return freed;
 }
 
 
 
+/*
+ * Free every subtree hanging on the pud page @p and the page itself.
+ */
+static unsigned long nvmm_rm_pud_page(struct super_block *sb, pud_t *p,
+            struct nvmm_reclaim **rc)
+{
+    pud_t *pud = p;
+    int cnt;
+    unsigned long freed = 0;
+
+    for (cnt = 0; cnt < PTRS_PER_PUD; cnt++, pud++) {
+        if (pud_none(*pud))
+            continue;
+        freed += nvmm_rm_pmd_range(sb, pud, rc);
+    }
+    nvmm_reclaim_queue(sb, rc, p);
+
+    return freed;
+}
+
+
+/*
+ * Free the whole page table of the file. The inode lets go of the tree
+ * in NVM before the first block of it is freed, a crash never leaves
+ * the file pointing at blocks of the free list. The blocks go back
+ * after the readers of the moment.
+ */
 void nvmm_rm_pg_table(struct super_block *sb, u64 ino)
 {
-    pud_t *pud, *p;
+    struct nvmm_reclaim *rc = NULL;
+    pgd_t *pgd = NULL;
+    pud_t *pud;
     struct nvmm_inode *ni;
-    int cnt = 0;
+    int cnt;
 
     ni = nvmm_get_inode(sb, ino);
-    p = pud = nvmm_get_pud(sb, ino);
-    if (!pud_none(*pud)){
-	    do {
-		    nvmm_rm_pmd_range(sb, pud);
-			pud++;
-			cnt++;
-		}while(!pud_none(*pud) && cnt < PTRS_PER_PUD);
-	}
-    nvmm_pud_free(sb, p);
+    pud = nvmm_get_pud(sb, ino);
+    if (ni->i_pgd_addr)
+        pgd = (pgd_t *)__va(le64_to_cpu(ni->i_pgd_addr));
+
+    nvmm_persist_entry(&ni->i_pgd_addr, 0);
+    nvmm_persist_entry(&ni->i_pg_addr, 0);
+
+    if (pgd) {
+        for (cnt = 1; cnt < PTRS_PER_PGD; cnt++) {
+            if (pgd_none(pgd[cnt]))
+                continue;
+            nvmm_rm_pud_page(sb, (pud_t *)__va(pgd_val(pgd[cnt]) & PAGE_MASK), &rc);
+        }
+        nvmm_reclaim_queue(sb, &rc, pgd);
+    }
+
+    nvmm_rm_pud_page(sb, pud, &rc);
+    if (rc)
+        nvmm_reclaim_defer(rc);
+}
+
+
+/* pte entries cleared and written back before their blocks are queued */
+#define NVMM_RM_BATCH   32
+
+/*
+ * Free the data blocks of the file in [@start, @end) and the pmd/pte
+ * pages that become unused. A table page whose whole span lies in the
+ * range is dropped with its subtree, the entries of a table page that
+ * is only partly covered are cleared one by one, so the rest of the
+ * mapping is kept and the cost is proportional to the removed range.
+ * With @start 0 the empty tree is kept, nvmm_rm_pg_table() drops it.
+ * Every entry is cleared and written back, and a fence passes, before
+ * the blocks it pointed to are queued. They go back to the free list
+ * after the readers of the moment, see nvmm_reclaim_queue(), so the
+ * caller clears the range under i_alloc_mutex and does not wait.
+ * returns :
+ * the number of data blocks freed
+ */
+unsigned long nvmm_rm_pg_range(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long start, unsigned long end)
+{
+    struct nvmm_inode *ni = nvmm_get_inode(sb, vfs_inode->i_ino);
+    unsigned long vaddr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr;
+    unsigned long blocknr = start, next, freed = 0;
+    unsigned long pud_blocks = PTRS_PER_PMD * PTRS_PER_PTE;
+    unsigned long pgd_blocks = PTRS_PER_PUD * pud_blocks;
+    void *pages[NVMM_RM_BATCH];
+    struct nvmm_reclaim *rc = NULL;
+    unsigned int nr, i;
+    pgd_t *pgd;
+    pud_t *pud, old_pud;
+    pmd_t *pmd, old_pmd;
+    pte_t *pte, *first;
+
+    while (blocknr < end) {
+        pud = nvmm_get_pud_page(sb, vfs_inode->i_ino, blocknr << PAGE_SHIFT);
+        next = (blocknr | (pgd_blocks - 1)) + 1;
+        if (!pud) {
+            blocknr = next;
+            continue;
+        }
+        if (blocknr >= pgd_blocks && !(blocknr & (pgd_blocks - 1)) && next <= end) {
+            /* a whole 512GB span past the first one */
+            pgd = (pgd_t *)__va(le64_to_cpu(ni->i_pgd_addr)) +
+                (blocknr >> (PGDIR_SHIFT - PAGE_SHIFT));
+            nvmm_persist_entry(pgd, 0);
+            freed += nvmm_rm_pud_page(sb, pud, &rc);
+            blocknr = next;
+            continue;
+        }
+
+        pud += (blocknr >> (PUD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PUD - 1);
+        next = (blocknr | (pud_blocks - 1)) + 1;
+        if (pud_none(*pud)) {
+            blocknr = next;
+            continue;
+        }
+        if (!(blocknr & (pud_blocks - 1)) && next <= end) {
+            old_pud = *pud;
+            nvmm_persist_entry(pud, 0);
+            freed += nvmm_rm_pmd_range(sb, &old_pud, &rc);
+            if (vaddr && S_ISREG(vfs_inode->i_mode) &&
+                    (blocknr << PAGE_SHIFT) < MAX_FILE_SIZE)
+                unnvmap_pmd(vaddr + (blocknr << PAGE_SHIFT), NULL, current->mm);
+            blocknr = next;
+            continue;
+        }
+
+        pmd = nvmm_get_pmd(pud) + ((blocknr >> (PMD_SHIFT - PAGE_SHIFT)) &
+            (PTRS_PER_PMD - 1));
+        next = (blocknr | (PTRS_PER_PTE - 1)) + 1;
+        if (pmd_none(*pmd)) {
+            blocknr = next;
+            continue;
+        }
+        if (!(blocknr & (PTRS_PER_PTE - 1)) && next <= end) {
+            old_pmd = *pmd;
+            nvmm_persist_entry(pmd, 0);
+            freed += nvmm_rm_pte_range(sb, &old_pmd, &rc);
+            blocknr = next;
+            continue;
+        }
+
+        /* the entries of a pte page shared with a clone are not ours */
+        if (nvmm_unshare_pte(vfs_inode, pmd, blocknr)) {
+            nvmm_error(sb, __FUNCTION__, "no space to unshare, blocks kept\n");
+            blocknr = next;
+            continue;
+        }
+        pte = nvmm_get_pte(pmd) + (blocknr & (PTRS_PER_PTE - 1));
+        while (blocknr < next && blocknr < end) {
+            /* clear a batch of entries, write them back, then queue */
+            first = pte;
+            for (nr = 0; nr < NVMM_RM_BATCH && blocknr < next &&
+                    blocknr < end; blocknr++, pte++) {
+                if (pte_none(*pte))
+                    continue;
+                pages[nr++] = __va((pte_val(*pte) & 0x0fffffffffffffff) & PAGE_MASK);
+                pte_clear(&init_mm, 0, pte);
+            }
+            if (!nr)
+                continue;
+            nvmm_flush_buffer(first, (pte - first) * sizeof(pte_t), true);
+            for (i = 0; i < nr; i++)
+                nvmm_reclaim_queue(sb, &rc, pages[i]);
+            freed += nr;
+        }
+    }
+
+    /* only the VA window is in the kernel page table */
+    end = min(end, MAX_FILE_SIZE >> PAGE_SHIFT);
+    if (vaddr && start < end)
+        flush_tlb_kernel_range(vaddr + (start << PAGE_SHIFT),
+                vaddr + (end << PAGE_SHIFT));
+    if (rc)
+        nvmm_reclaim_defer(rc);
+
+    return freed;
+}
+
+
+
+static pud_t *nvmm_shift_pud(struct super_block *sb, u64 ino, unsigned long blocknr)
+{
+    pud_t *pud = nvmm_get_pud_page(sb, ino, blocknr << PAGE_SHIFT);
+
+    return pud ? pud + ((blocknr >> (PUD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PUD - 1)) : NULL;
+}
+
+static pmd_t *nvmm_shift_pmd(struct super_block *sb, u64 ino, unsigned long blocknr)
+{
+    pud_t *pud = nvmm_shift_pud(sb, ino, blocknr);
+
+    if (!pud || pud_none(*pud))
+        return NULL;
+    return nvmm_get_pmd(pud) + ((blocknr >> (PMD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PMD - 1));
+}
+
+/*
+ * Swap the pud entry of the 1GB chunk at block @s with the one of the
+ * chunk at block @d, and the VA window with them. The chunk at @d holds
+ * no block, the pmd page it may have goes to @s empty, nothing is freed
+ * under the readers and undoing the step needs no page.
+ */
+static int nvmm_shift_pud_entry(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long s, unsigned long d)
+{
+    unsigned long vaddr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr;
+    pud_t *spud, *dpud, old;
+    pmd_t *pmd;
+
+    spud = nvmm_shift_pud(sb, vfs_inode->i_ino, s);
+    if (!spud || pud_none(*spud))
+        return 0;
+    dpud = nvmm_pud_alloc(sb, vfs_inode->i_ino, d << PAGE_SHIFT);
+    if (!dpud)
+        return -ENOMEM;
+
+    old = *dpud;
+    pmd = nvmm_get_pmd(spud);
+    nvmm_journal_begin(sb);
+    nvmm_journal_add(sb, dpud, pud_val(*spud));
+    nvmm_journal_add(sb, spud, pud_val(old));
+    nvmm_journal_commit(sb);
+
+    if (vaddr && (s << PAGE_SHIFT) < MAX_FILE_SIZE) {
+        if (pud_none(old))
+            unnvmap_pmd(vaddr + (s << PAGE_SHIFT), NULL, current->mm);
+        else
+            nvmap_pmd(vaddr + (s << PAGE_SHIFT), nvmm_get_pmd(&old), current->mm);
+    }
+    if (vaddr && (d << PAGE_SHIFT) < MAX_FILE_SIZE)
+        nvmap_pmd(vaddr + (d << PAGE_SHIFT), pmd, current->mm);
+    return 0;
+}
+
+/*
+ * Swap the pmd entry of the 2MB chunk at block @s with the one of the
+ * chunk at block @d, a shared pte page moves with its reference. The
+ * chunk at @d holds no block, the pte page it may have goes to @s empty.
+ */
+static int nvmm_shift_pmd_entry(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long s, unsigned long d)
+{
+    pmd_t *spmd, *dpmd, old;
+
+    spmd = nvmm_shift_pmd(sb, vfs_inode->i_ino, s);
+    if (!spmd || pmd_none(*spmd))
+        return 0;
+    dpmd = nvmm_file_pmd_alloc(sb, vfs_inode, d << PAGE_SHIFT);
+    if (!dpmd)
+        return -ENOMEM;
+
+    old = *dpmd;
+    nvmm_journal_begin(sb);
+    nvmm_journal_add(sb, dpmd, pmd_val(*spmd));
+    nvmm_journal_add(sb, spmd, pmd_val(old));
+    nvmm_journal_commit(sb);
+    return 0;
+}
+
+/*
+ * Move the @n pte entries at block @s to block @d, both runs lie inside
+ * one pte page each, the pages may be the same one. The entries are
+ * taken in the order of the shift, so a run that overlaps itself is
+ * moved right, and one transaction of 2 * @n records covers them all.
+ * Nothing is moved when an error is returned.
+ */
+static int nvmm_shift_pte_entries(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long s, unsigned long d, unsigned long n, int back)
+{
+    pmd_t *spmd, *dpmd;
+    pte_t *spte, *dpte;
+    unsigned long i, k;
+    int err;
+
+    spmd = nvmm_shift_pmd(sb, vfs_inode->i_ino, s);
+    if (!spmd || pmd_none(*spmd))
+        return 0;
+    spte = nvmm_get_pte(spmd) + (s & (PTRS_PER_PTE - 1));
+    for (i = 0; i < n && pte_none(spte[i]); i++)
+        ;
+    if (i == n)
+        return 0;
+
+    /* the entries of pte pages shared with a clone are not ours */
+    err = nvmm_unshare_pte(vfs_inode, spmd, s);
+    if (err)
+        return err;
+    if (!nvmm_file_pte_alloc(sb, vfs_inode, d << PAGE_SHIFT))
+        return -ENOMEM;
+    dpmd = nvmm_shift_pmd(sb, vfs_inode->i_ino, d);
+    err = nvmm_unshare_pte(vfs_inode, dpmd, d);
+    if (err)
+        return err;
+
+    spte = nvmm_get_pte(spmd) + (s & (PTRS_PER_PTE - 1));
+    dpte = nvmm_get_pte(dpmd) + (d & (PTRS_PER_PTE - 1));
+    nvmm_journal_begin(sb);
+    for (k = 0; k < n; k++) {
+        i = back ? n - 1 - k : k;
+        if (pte_none(spte[i]))
+            continue;
+        nvmm_journal_add(sb, &dpte[i], pte_val(spte[i]));
+        nvmm_journal_add(sb, &spte[i], 0);
+    }
+    nvmm_journal_commit(sb);
+    return 0;
+}
+
+/*
+ * The steps of nvmm_shift_blocks(), @done is set to the blocks moved by
+ * the steps that completed.
+ */
+static int __nvmm_shift_blocks(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long from, unsigned long to, unsigned long nr, unsigned long *done)
+{
+    unsigned long pud_blocks = PTRS_PER_PMD * PTRS_PER_PTE;
+    unsigned long left, s, d, n;
+    int back = to > from, err;
+
+    for (*done = 0; *done < nr; *done += n) {
+        left = nr - *done;
+        /* @s and @d are the ends of the step when it goes down */
+        s = back ? from + left : from + *done;
+        d = back ? to + left : to + *done;
+
+        if (left >= pud_blocks && !((s | d) & (pud_blocks - 1))) {
+            n = pud_blocks;
+            s = back ? s - n : s;
+            d = back ? d - n : d;
+            err = nvmm_shift_pud_entry(sb, vfs_inode, s, d);
+        } else if (left >= PTRS_PER_PTE && !((s | d) & (PTRS_PER_PTE - 1))) {
+            n = PTRS_PER_PTE;
+            s = back ? s - n : s;
+            d = back ? d - n : d;
+            err = nvmm_shift_pmd_entry(sb, vfs_inode, s, d);
+        } else {
+            if (back) {
+                n = min(left, min(((s - 1) & (PTRS_PER_PTE - 1)) + 1,
+                            ((d - 1) & (PTRS_PER_PTE - 1)) + 1));
+                s -= n;
+                d -= n;
+            } else
+                n = min(left, min(PTRS_PER_PTE - (s & (PTRS_PER_PTE - 1)),
+                            PTRS_PER_PTE - (d & (PTRS_PER_PTE - 1))));
+            err = nvmm_shift_pte_entries(sb, vfs_inode, s, d, n, back);
+        }
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+/*
+ * Move the blocks [@from, @from + @nr) of the file to [@to, @to + @nr),
+ * only table entries move, the data stays where it is. A step moves a
+ * pud entry when both chunks are 1GB aligned, a pmd entry when they are
+ * 2MB aligned, else the pte entries of one pte page, so the cost is that
+ * of the entries and not of the data. Each step is a journal transaction
+ * and a block is never mapped twice. The steps go from the end of the
+ * range when it moves up, so the destination is free when it is reached.
+ * A step that fails (no page for a table or an unshared copy) leaves
+ * nothing half done, the steps before it are undone by shifting their
+ * blocks back: that shift takes the same chunks in reverse order, the
+ * pud and pmd steps swap entries and pte steps leave their pages, so
+ * every table page it needs is there and it does not fail for space.
+ * A crash leaves the file shifted up to some step.
+ * The caller holds i_alloc_mutex and the whole file, the destination
+ * blocks outside the range are holes.
+ * returns :
+ * 0 if success else error code, the blocks did not move then
+ */
+int nvmm_shift_blocks(struct super_block *sb, struct inode *vfs_inode,
+            unsigned long from, unsigned long to, unsigned long nr)
+{
+    unsigned long vaddr = (unsigned long)(NVMM_I(vfs_inode))->i_virt_addr;
+    unsigned long done, undone, lo, hi;
+    int back = to > from, err;
+
+    if (!nr || from == to)
+        return 0;
+
+    nvmm_tc_invalidate(vfs_inode);
+    err = __nvmm_shift_blocks(sb, vfs_inode, from, to, nr, &done);
+    if (err && done) {
+        /* the steps done are the last @done blocks when it moves up */
+        lo = back ? nr - done : 0;
+        if (__nvmm_shift_blocks(sb, vfs_inode, to + lo, from + lo, done, &undone))
+            nvmm_error(sb, __FUNCTION__, "could not undo a failed shift, "
+                    "%lu of %lu blocks moved\n", done - undone, nr);
+    }
+    nvmm_tc_invalidate(vfs_inode);
+
+    /* only the VA window is in the kernel page table */
+    lo = min(from, to);
+    hi = min(max(from, to) + nr, MAX_FILE_SIZE >> PAGE_SHIFT);
+    if (vaddr && lo < hi)
+        flush_tlb_kernel_range(vaddr + (lo << PAGE_SHIFT), vaddr + (hi << PAGE_SHIFT));
+
+    return err;
+}
+
+/*
+ * Find the first allocated block of the file in [@blocknr, @end).
+ * Empty pgd, pud and pmd entries are skipped as a whole, so the cost is
+ * proportional to the populated part of the range.
+ * returns :
+ * the block number, or @end if there is no data block in the range
+ */
+unsigned long nvmm_next_data_block(struct inode *inode, unsigned long blocknr,
+            unsigned long end)
+{
+    struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+    pud_t *pud;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    if (!ni->i_pg_addr)
+        return end;
+
+    while (blocknr < end) {
+        pud = nvmm_get_pud_page(inode->i_sb, inode->i_ino, blocknr << PAGE_SHIFT);
+        if (!pud) {
+            blocknr = (blocknr | (PTRS_PER_PUD * PTRS_PER_PMD * PTRS_PER_PTE - 1)) + 1;
+            continue;
+        }
+        pud += (blocknr >> (PUD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PUD - 1);
+        if (pud_none(*pud)) {
+            blocknr = (blocknr | (PTRS_PER_PMD * PTRS_PER_PTE - 1)) + 1;
+            continue;
+        }
+        pmd = nvmm_get_pmd(pud) + ((blocknr >> (PMD_SHIFT - PAGE_SHIFT)) &
+            (PTRS_PER_PMD - 1));
+        if (pmd_none(*pmd)) {
+            blocknr = (blocknr | (PTRS_PER_PTE - 1)) + 1;
+            continue;
+        }
+        pte = nvmm_get_pte(pmd) + (blocknr & (PTRS_PER_PTE - 1));
+        if (!pte_none(*pte))
+            return blocknr;
+        blocknr++;
+    }
 
-    ni->i_pg_addr = 0;
+    return end;
 }
 
 
@@ -0,0 +1,69 @@
+/*
+ * linux/fs/nvmm/rangelock.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Range locks of a file. A holder owns the blocks [start, last] of the
+ * file, writers of disjoint ranges go on in parallel, a writer whose
+ * range overlaps a held one sleeps until it is released. The held
+ * ranges are kept in an interval tree.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/interval_tree_generic.h>
+#include "nvmm.h"
+
+#define NVMM_RANGE_START(r)	((r)->start)
+#define NVMM_RANGE_LAST(r)	((r)->last)
+
+INTERVAL_TREE_DEFINE(struct nvmm_range, rb, unsigned long, subtree_last,
+		NVMM_RANGE_START, NVMM_RANGE_LAST, static, nvmm_range_tree)
+
+void nvmm_range_lock_init(struct nvmm_range_lock *rl)
+{
+	spin_lock_init(&rl->lock);
+	rl->tree = RB_ROOT;
+	init_waitqueue_head(&rl->wait);
+}
+
+/*
+ * take @r if no held range overlaps it
+ */
+static bool nvmm_range_trylock(struct nvmm_range_lock *rl, struct nvmm_range *r)
+{
+	bool locked;
+
+	spin_lock(&rl->lock);
+	locked = !nvmm_range_tree_iter_first(&rl->tree, r->start, r->last);
+	if (locked)
+		nvmm_range_tree_insert(r, &rl->tree);
+	spin_unlock(&rl->lock);
+	return locked;
+}
+
+/*
+ * input :
+ * @rl : range lock of the file
+ * @r : range of the caller, it lives until nvmm_range_unlock()
+ * @start : first block of the range
+ * @last : last block of the range
+ */
+void nvmm_range_lock(struct nvmm_range_lock *rl, struct nvmm_range *r,
+		unsigned long start, unsigned long last)
+{
+	r->start = start;
+	r->last = last;
+	wait_event(rl->wait, nvmm_range_trylock(rl, r));
+}
+
+void nvmm_range_unlock(struct nvmm_range_lock *rl, struct nvmm_range *r)
+{
+	spin_lock(&rl->lock);
+	nvmm_range_tree_remove(r, &rl->tree);
+	spin_unlock(&rl->lock);
+	wake_up_all(&rl->wait);
+}
@@ -0,0 +1,1095 @@
+/*
+ * linux/fs/nvmm/reflink.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Clones of file ranges. A clone points the page table of the target to
+ * the pte pages of the source, one pmd entry per 2MB chunk, or to its
+ * data pages where the chunks of both files do not line up, no data is
+ * copied. The shared pages carry a reference count in NVM. A file makes
+ * a shared pte page or data page private, by a copy, right before it
+ * changes it: a write, a store through mmap or a truncate in the middle
+ * of a chunk.
+ *
+ * An exchange trades the blocks of two ranges the same way, by their
+ * table entries, in one journal transaction, to publish a staging file.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <asm/tlbflush.h>
+#include <asm/uaccess.h>
+#include "nvmm.h"
+
+static inline void *nvmm_pte_page(pte_t pte)
+{
+	return __va((pte_val(pte) & 0x0fffffffffffffff) & PAGE_MASK);
+}
+
+/*
+ * read the refcount table root at mount, it is created by the first clone
+ */
+void nvmm_ref_init(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_super_block *ns = nvmm_get_super(sb);
+
+	spin_lock_init(&nsi->s_ref_lock);
+	nsi->s_ref_root = nvmm_get_block(sb, le64_to_cpu(ns->s_refcount_start));
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @addr : kernel virtual address of a block
+ * @page : a zeroed page for a missing page of the table, used and set to
+ * NULL. NULL to only look the count up.
+ * returns :
+ * the count of @addr, NULL if it has none or a page of the table is
+ * missing and *@page is NULL
+ * called with s_ref_lock held, the page is taken before
+ */
+static __le32 *nvmm_ref_slot(struct super_block *sb, void *addr, void **page)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_super_block *ns;
+	unsigned long blocknr = (__pa(addr) - nsi->phy_addr) >> PAGE_SHIFT;
+	__le64 *dir, *entry;
+	int shift;
+
+	if (blocknr >= NVMM_REF_MAX_BLOCKS)
+		return NULL;
+
+	if (!nsi->s_ref_root) {
+		if (!page || !*page)
+			return NULL;
+		ns = nvmm_get_super(sb);
+		nvmm_memunlock_super(sb, ns);
+		nvmm_persist_entry(&ns->s_refcount_start, cpu_to_le64(nvmm_get_block_off(sb, *page)));
+		nvmm_memlock_super(sb, ns);
+		nsi->s_ref_root = *page;
+		*page = NULL;
+	}
+
+	dir = nsi->s_ref_root;
+	for (shift = NVMM_REF_SHIFT + NVMM_REF_DIR_SHIFT; shift >= NVMM_REF_SHIFT;
+			shift -= NVMM_REF_DIR_SHIFT) {
+		entry = dir + ((blocknr >> shift) & ((1UL << NVMM_REF_DIR_SHIFT) - 1));
+		if (!*entry) {
+			if (!page || !*page)
+				return NULL;
+			nvmm_persist_entry(entry, cpu_to_le64(nvmm_get_block_off(sb, *page)));
+			*page = NULL;
+		}
+		dir = nvmm_get_block(sb, le64_to_cpu(*entry));
+	}
+	return (__le32 *)dir + (blocknr & (NVMM_REF_PER_PAGE - 1));
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @addr : kernel virtual address of a pte page or data page
+ * returns :
+ * 0 if success else -ENOSPC
+ * one more table entry points to @addr, the caller fences before it
+ * publishes that entry
+ */
+int nvmm_ref_get(struct super_block *sb, void *addr)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	void *page = NULL;
+	__le32 *count;
+
+	for (;;) {
+		spin_lock(&nsi->s_ref_lock);
+		count = nvmm_ref_slot(sb, addr, &page);
+		if (count) {
+			le32_add_cpu(count, 1);
+			nvmm_flush_buffer(count, sizeof(*count), false);
+		}
+		spin_unlock(&nsi->s_ref_lock);
+		if (count || page)
+			break;
+		/* a page of the table is missing, take one without the lock */
+		page = nvmm_shadow_get(sb);
+		if (!page)
+			break;
+	}
+	/* another caller added that page first */
+	if (page)
+		nvmm_shadow_put(sb, page);
+
+	return count ? 0 : -ENOSPC;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @addr : kernel virtual address of a page leaving a table
+ * returns :
+ * 1 if another table still points to @addr, its count dropped, else 0
+ * and the caller frees the page
+ */
+int nvmm_ref_put(struct super_block *sb, void *addr)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	__le32 *count;
+	int shared = 0;
+
+	/* nothing was ever cloned */
+	if (!ACCESS_ONCE(nsi->s_ref_root))
+		return 0;
+
+	spin_lock(&nsi->s_ref_lock);
+	count = nvmm_ref_slot(sb, addr, NULL);
+	if (count && *count) {
+		le32_add_cpu(count, -1);
+		nvmm_flush_buffer(count, sizeof(*count), false);
+		shared = 1;
+	}
+	spin_unlock(&nsi->s_ref_lock);
+
+	return shared;
+}
+
+/*
+ * returns :
+ * the number of owners of @addr beyond the first one
+ */
+unsigned long nvmm_ref_count(struct super_block *sb, void *addr)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	unsigned long n = 0;
+	__le32 *count;
+
+	if (!ACCESS_ONCE(nsi->s_ref_root))
+		return 0;
+
+	spin_lock(&nsi->s_ref_lock);
+	count = nvmm_ref_slot(sb, addr, NULL);
+	if (count)
+		n = le32_to_cpu(*count);
+	spin_unlock(&nsi->s_ref_lock);
+
+	return n;
+}
+
+/*
+ * drop the blocks [start, start + nr) of @inode from the TLB, only the
+ * VA window is in the kernel page table
+ */
+static void nvmm_reflink_flush(struct inode *inode, unsigned long start, unsigned long nr)
+{
+	unsigned long vaddr = (unsigned long)NVMM_I(inode)->i_virt_addr;
+	unsigned long end = min(start + nr, MAX_FILE_SIZE >> PAGE_SHIFT);
+
+	if (vaddr && start < end)
+		flush_tlb_kernel_range(vaddr + (start << PAGE_SHIFT), vaddr + (end << PAGE_SHIFT));
+}
+
+/*
+ * returns :
+ * the pmd entry of file block @blocknr, NULL if it points to no pte page
+ */
+static pmd_t *nvmm_reflink_pmd(struct super_block *sb, u64 ino, unsigned long blocknr)
+{
+	pud_t *pud;
+	pmd_t *pmd;
+
+	if (!nvmm_get_inode(sb, ino)->i_pg_addr)
+		return NULL;
+	pud = nvmm_get_pud_page(sb, ino, blocknr << PAGE_SHIFT);
+	if (!pud)
+		return NULL;
+	pud += (blocknr >> (PUD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PUD - 1);
+	if (pud_none(*pud))
+		return NULL;
+	pmd = nvmm_get_pmd(pud) + ((blocknr >> (PMD_SHIFT - PAGE_SHIFT)) & (PTRS_PER_PMD - 1));
+
+	return pmd_none(*pmd) ? NULL : pmd;
+}
+
+/*
+ * returns :
+ * the pte entry of file block @blocknr, NULL if its pte page is missing
+ */
+static pte_t *nvmm_reflink_pte(struct super_block *sb, u64 ino, unsigned long blocknr)
+{
+	pmd_t *pmd = nvmm_reflink_pmd(sb, ino, blocknr);
+
+	return pmd ? nvmm_get_pte(pmd) + (blocknr & (PTRS_PER_PTE - 1)) : NULL;
+}
+
+static unsigned long nvmm_reflink_count(pte_t *pte)
+{
+	unsigned long i, nr = 0;
+
+	for (i = 0; i < PTRS_PER_PTE; i++)
+		if (!pte_none(pte[i]))
+			nr++;
+	return nr;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pmd : pmd entry of the file, it points to a pte page
+ * @blocknr : a block of the 2MB chunk of @pmd
+ * returns :
+ * 0 if success else -ENOSPC
+ * give the file a private copy of the pte page of @pmd if it is shared,
+ * the data pages gain a reference for the copy. The caller holds
+ * i_alloc_mutex and owns the whole chunk, or the whole file.
+ */
+int nvmm_unshare_pte(struct inode *inode, pmd_t *pmd, unsigned long blocknr)
+{
+	struct super_block *sb = inode->i_sb;
+	pte_t *old = nvmm_get_pte(pmd), *new;
+	int i;
+
+	if (!nvmm_ref_count(sb, old))
+		return 0;
+
+	new = nvmm_shadow_get(sb);
+	if (!new)
+		return -ENOSPC;
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (pte_none(old[i]))
+			continue;
+		if (nvmm_ref_get(sb, nvmm_pte_page(old[i])))
+			goto fail;
+	}
+	nvmm_memcpy_persist(new, old, PAGE_SIZE);
+
+	nvmm_tc_invalidate(inode);
+	nvmm_persist_entry(pmd, pmd_val(__pmd(__pa(new) | _PAGE_TABLE)));
+	nvmm_reflink_flush(inode, blocknr & ~(PTRS_PER_PTE - 1), PTRS_PER_PTE);
+
+	/* the other owners left meanwhile, the old page is ours to drop */
+	if (!nvmm_ref_put(sb, old)) {
+		for (i = 0; i < PTRS_PER_PTE; i++)
+			if (!pte_none(old[i]))
+				nvmm_ref_put(sb, nvmm_pte_page(old[i]));
+		nvmm_reclaim_one(sb, old);
+	}
+	return 0;
+
+fail:
+	while (i--)
+		if (!pte_none(old[i]))
+			nvmm_ref_put(sb, nvmm_pte_page(old[i]));
+	nvmm_shadow_put(sb, new);
+	return -ENOSPC;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pte : pte entry of the file in a private pte page, not none
+ * @blocknr : the block of @pte
+ * returns :
+ * 0 if success else -ENOSPC
+ * give the file a private copy of the data page of @pte if it is shared
+ */
+static int nvmm_unshare_data(struct inode *inode, pte_t *pte, unsigned long blocknr)
+{
+	struct super_block *sb = inode->i_sb;
+	void *old = nvmm_pte_page(*pte), *new;
+
+	if (!nvmm_ref_count(sb, old))
+		return 0;
+
+	new = nvmm_shadow_get(sb);
+	if (!new)
+		return -ENOSPC;
+	nvmm_memcpy_persist(new, old, PAGE_SIZE);
+	nvmm_persist_entry(pte, pte_val(pfn_pte(__pa(new) >> PAGE_SHIFT, PAGE_KERNEL)));
+	nvmm_reflink_flush(inode, blocknr, 1);
+	unmap_mapping_range(inode->i_mapping, (loff_t)blocknr << PAGE_SHIFT, PAGE_SIZE, 1);
+
+	if (!nvmm_ref_put(sb, old))
+		nvmm_reclaim_one(sb, old);
+	return 0;
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @start : first block of the range
+ * @end : block after the last one
+ * @data : the data pages are made private too, not only the pte pages
+ * returns :
+ * 0 if success else -ENOSPC
+ * nothing of the range is shared once it returns, so the file may fill
+ * holes in its pte pages, or store to its data pages in place. Called
+ * with i_alloc_mutex held, the caller owns the 2MB chunks of the range.
+ */
+int nvmm_unshare_range(struct inode *inode, unsigned long start,
+		unsigned long end, int data)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long blocknr = start, next;
+	pmd_t *pmd;
+	pte_t *pte;
+	int err;
+
+	if (!nvmm_reflinked(inode))
+		return 0;
+
+	while (blocknr < end) {
+		next = (blocknr | (PTRS_PER_PTE - 1)) + 1;
+		pmd = nvmm_reflink_pmd(sb, inode->i_ino, blocknr);
+		if (!pmd) {
+			blocknr = next;
+			continue;
+		}
+		err = nvmm_unshare_pte(inode, pmd, blocknr);
+		if (err)
+			return err;
+
+		pte = nvmm_get_pte(pmd) + (blocknr & (PTRS_PER_PTE - 1));
+		for (; data && blocknr < next && blocknr < end; blocknr++, pte++) {
+			if (pte_none(*pte))
+				continue;
+			err = nvmm_unshare_data(inode, pte, blocknr);
+			if (err)
+				return err;
+		}
+		blocknr = next;
+	}
+	return 0;
+}
+
+/*
+ * point the whole 2MB chunk of @dst at block @d to the pte page of @src
+ * at block @s, the old pte page of @dst goes to @rc
+ * returns :
+ * 0 if success else error code
+ */
+static int nvmm_reflink_chunk(struct inode *dst, struct inode *src,
+		unsigned long d, unsigned long s, struct nvmm_reclaim *rc, int *flush)
+{
+	struct super_block *sb = dst->i_sb;
+	pmd_t *spmd, *dpmd, old;
+	u64 val = 0;
+
+	spmd = nvmm_reflink_pmd(sb, src->i_ino, s);
+	if (spmd) {
+		if (nvmm_ref_get(sb, nvmm_get_pte(spmd)))
+			return -ENOSPC;
+		dpmd = nvmm_file_pmd_alloc(sb, dst, d << PAGE_SHIFT);
+		if (!dpmd) {
+			nvmm_ref_put(sb, nvmm_get_pte(spmd));
+			return -ENOMEM;
+		}
+		val = pmd_val(*spmd);
+		dst->i_blocks += nvmm_reflink_count(nvmm_get_pte(spmd));
+	} else {
+		/* a hole in the source */
+		dpmd = nvmm_reflink_pmd(sb, dst->i_ino, d);
+		if (!dpmd)
+			return 0;
+	}
+
+	old = *dpmd;
+	nvmm_persist_entry(dpmd, val);
+	if (!pmd_none(old)) {
+		dst->i_blocks -= nvmm_reflink_count(nvmm_get_pte(&old));
+		nvmm_reclaim_pte(rc, nvmm_get_pte(&old), 0, PTRS_PER_PTE);
+		*flush = 1;
+	}
+	return 0;
+}
+
+/*
+ * point the blocks [@d, @d + @nr) of @dst, inside one 2MB chunk, to the
+ * data pages of @src at block @s one by one, the old data pages of @dst
+ * go to @rc
+ * returns :
+ * 0 if success else error code
+ */
+static int nvmm_reflink_pages(struct inode *dst, struct inode *src, unsigned long d,
+		unsigned long s, unsigned long nr, struct nvmm_reclaim *rc, int *flush)
+{
+	struct super_block *sb = dst->i_sb;
+	unsigned long i;
+	pmd_t *dpmd;
+	pte_t *spte, *dpte, old;
+	u64 val;
+	int err;
+
+	/* the entries of a shared pte page are not ours to change */
+	dpmd = nvmm_reflink_pmd(sb, dst->i_ino, d);
+	if (dpmd) {
+		err = nvmm_unshare_pte(dst, dpmd, d);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < nr; i++) {
+		spte = nvmm_reflink_pte(sb, src->i_ino, s + i);
+		if (spte && !pte_none(*spte)) {
+			if (nvmm_ref_get(sb, nvmm_pte_page(*spte)))
+				return -ENOSPC;
+			dpte = nvmm_file_pte_alloc(sb, dst, (d + i) << PAGE_SHIFT);
+			if (!dpte) {
+				nvmm_ref_put(sb, nvmm_pte_page(*spte));
+				return -ENOMEM;
+			}
+			val = pte_val(*spte);
+			dst->i_blocks++;
+		} else {
+			/* a hole in the source */
+			dpte = nvmm_reflink_pte(sb, dst->i_ino, d + i);
+			if (!dpte || pte_none(*dpte))
+				continue;
+			val = 0;
+		}
+
+		old = *dpte;
+		nvmm_persist_entry(dpte, val);
+		if (!pte_none(old)) {
+			dst->i_blocks--;
+			nvmm_reclaim_add(rc, nvmm_pte_page(old));
+			*flush = 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * input :
+ * @dst, @src : the files, the caller holds their whole range and
+ * i_alloc_mutex
+ * @dst_start, @src_start : first block of the ranges
+ * @nr : number of blocks
+ * returns :
+ * 0 if success else error code
+ * point the blocks [dst_start, dst_start + nr) of @dst to the pages of
+ * @src. The 2MB chunks at the same place in both files share their pte
+ * page, so a clone of aligned ranges costs one entry per chunk. What
+ * @dst held there before goes once the readers of the moment are gone.
+ */
+static int nvmm_reflink_blocks(struct inode *dst, struct inode *src,
+		unsigned long dst_start, unsigned long src_start, unsigned long nr)
+{
+	struct super_block *sb = dst->i_sb;
+	struct nvmm_reclaim *rc = NULL;
+	unsigned long i, n, d, s;
+	int err = 0, flush;
+
+	nvmm_tc_invalidate(dst);
+	for (i = 0; i < nr; i += n) {
+		d = dst_start + i;
+		s = src_start + i;
+		n = min(nr - i, PTRS_PER_PTE - (d & (PTRS_PER_PTE - 1)));
+
+		/* a pte page and its data pages at most */
+		if (!rc) {
+			rc = nvmm_reclaim_alloc(sb, PTRS_PER_PTE + 1);
+			if (!rc) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		flush = 0;
+		if (PTRS_PER_PTE == n && !(s & (PTRS_PER_PTE - 1)))
+			err = nvmm_reflink_chunk(dst, src, d, s, rc, &flush);
+		else
+			err = nvmm_reflink_pages(dst, src, d, s, n, rc, &flush);
+
+		/* the old pages may be in the TLB until here */
+		if (flush)
+			nvmm_reflink_flush(dst, d, n);
+		if (rc->nr) {
+			nvmm_reclaim_defer(rc);
+			rc = NULL;
+		}
+		if (err)
+			break;
+	}
+
+	kfree(rc);
+	return err;
+}
+
+/*
+ * persist the clone flag of @inode before any of its pages is shared
+ */
+static void nvmm_reflink_mark(struct inode *inode)
+{
+	struct nvmm_inode *ni = nvmm_get_inode(inode->i_sb, inode->i_ino);
+
+	if (nvmm_reflinked(inode))
+		return;
+
+	NVMM_I(inode)->i_flags |= NVMM_REFLINK_FL;
+	nvmm_memunlock_inode(inode->i_sb, ni);
+	ni->i_flags |= cpu_to_le32(NVMM_REFLINK_FL);
+	nvmm_memlock_inode(inode->i_sb, ni);
+	nvmm_flush_buffer(&ni->i_flags, sizeof(ni->i_flags), true);
+}
+
+static void nvmm_lock_two(struct mutex *a, struct mutex *b)
+{
+	if (a == b) {
+		mutex_lock(a);
+		return;
+	}
+	if (a > b)
+		swap(a, b);
+	mutex_lock(a);
+	mutex_lock_nested(b, SINGLE_DEPTH_NESTING);
+}
+
+static void nvmm_unlock_two(struct mutex *a, struct mutex *b)
+{
+	mutex_unlock(a);
+	if (a != b)
+		mutex_unlock(b);
+}
+
+/*
+ * input :
+ * @dst : target file
+ * @src : source file, on the same file system
+ * @off : start of the source range, block aligned
+ * @len : the size, 0 up to the end of the source
+ * @destoff : start of the target range, block aligned
+ * returns :
+ * 0 if success else error code
+ * the range must end on a block, or at the end of the source when the
+ * target range reaches the end of the target too
+ */
+static long nvmm_reflink(struct inode *dst, struct inode *src, u64 off,
+		u64 len, u64 destoff)
+{
+	struct nvmm_inode *ni = nvmm_get_inode(dst->i_sb, dst->i_ino);
+	struct nvmm_range dst_range, src_range;
+	u64 size, end;
+	long ret;
+
+	if ((off | destoff) & ~PAGE_MASK)
+		return -EINVAL;
+	if (IS_APPEND(dst) || IS_IMMUTABLE(dst))
+		return -EPERM;
+
+	nvmm_lock_two(&dst->i_mutex, &src->i_mutex);
+
+	ret = -EINVAL;
+	size = i_size_read(src);
+	if (off > size)
+		goto out;
+	if (!len)
+		len = size - off;
+	end = off + len;
+	if (end > size || end < off)
+		goto out;
+	if ((len & ~PAGE_MASK) && (end != size || destoff + len < i_size_read(dst)))
+		goto out;
+	if (src == dst && destoff < end && off < destoff + len)
+		goto out;
+	ret = -EFBIG;
+	if (destoff + len > dst->i_sb->s_maxbytes)
+		goto out;
+	ret = 0;
+	if (!len)
+		goto out;
+
+	/* no writer, truncate or fault changes either table meanwhile */
+	nvmm_range_lock(&NVMM_I(dst)->i_range_lock, &dst_range, 0, ULONG_MAX);
+	if (src != dst)
+		nvmm_range_lock(&NVMM_I(src)->i_range_lock, &src_range, 0, ULONG_MAX);
+	/* shared blocks take no record, the logged bytes go in first */
+	ret = nvmm_log_fold(dst);
+	if (!ret && src != dst)
+		ret = nvmm_log_fold(src);
+	if (ret)
+		goto out_range;
+	nvmm_lock_two(&NVMM_I(dst)->i_alloc_mutex, &NVMM_I(src)->i_alloc_mutex);
+
+	ret = nvmm_alloc_blocks(dst, 0);
+	if (ret) {
+		nvmm_unlock_two(&NVMM_I(dst)->i_alloc_mutex, &NVMM_I(src)->i_alloc_mutex);
+		goto out_range;
+	}
+	nvmm_reflink_mark(dst);
+	nvmm_reflink_mark(src);
+	ret = nvmm_reflink_blocks(dst, src, destoff >> PAGE_SHIFT, off >> PAGE_SHIFT,
+			PAGE_ALIGN(len) >> PAGE_SHIFT);
+
+	nvmm_unlock_two(&NVMM_I(dst)->i_alloc_mutex, &NVMM_I(src)->i_alloc_mutex);
+
+	/* the user mappings of both files fault again, onto private copies */
+	unmap_mapping_range(dst->i_mapping, destoff, PAGE_ALIGN(len), 1);
+	unmap_mapping_range(src->i_mapping, off, PAGE_ALIGN(len), 1);
+
+	/* the entries changed are persistent, even those of a failed clone */
+	nvmm_memunlock_inode(dst->i_sb, ni);
+	ni->i_blocks = cpu_to_le64(dst->i_blocks);
+	if (!ret && destoff + len > i_size_read(dst))
+		ni->i_size = cpu_to_le64(destoff + len);
+	nvmm_memlock_inode(dst->i_sb, ni);
+	nvmm_flush_buffer(&ni->i_blocks, sizeof(ni->i_blocks), false);
+	nvmm_flush_buffer(&ni->i_size, sizeof(ni->i_size), true);
+	if (!ret && destoff + len > i_size_read(dst))
+		i_size_write(dst, destoff + len);
+	dst->i_mtime = dst->i_ctime = CURRENT_TIME_SEC;
+	nvmm_update_inode(dst);
+
+out_range:
+	if (src != dst)
+		nvmm_range_unlock(&NVMM_I(src)->i_range_lock, &src_range);
+	nvmm_range_unlock(&NVMM_I(dst)->i_range_lock, &dst_range);
+out:
+	nvmm_unlock_two(&dst->i_mutex, &src->i_mutex);
+	return ret;
+}
+
+/*
+ * input :
+ * @dst : target file, open for writing
+ * @src_fd : source file, open for reading
+ * @off, @len, @destoff : as nvmm_reflink()
+ * returns :
+ * 0 if success else error code
+ */
+long nvmm_ioctl_clone(struct file *dst, int src_fd, u64 off, u64 len, u64 destoff)
+{
+	struct fd src = fdget(src_fd);
+	long ret;
+
+	if (!src.file)
+		return -EBADF;
+
+	ret = -EXDEV;
+	if (file_inode(src.file)->i_sb != file_inode(dst)->i_sb)
+		goto out;
+	ret = -EINVAL;
+	if (!S_ISREG(file_inode(src.file)->i_mode) || !S_ISREG(file_inode(dst)->i_mode))
+		goto out;
+	ret = -EBADF;
+	if (!(src.file->f_mode & FMODE_READ) || !(dst->f_mode & FMODE_WRITE) ||
+			(dst->f_flags & O_APPEND))
+		goto out;
+
+	ret = mnt_want_write_file(dst);
+	if (ret)
+		goto out;
+	ret = nvmm_reflink(file_inode(dst), file_inode(src.file), off, len, destoff);
+	mnt_drop_write_file(dst);
+out:
+	fdput(src);
+	return ret;
+}
+
+/*
+ * copy @len bytes from @spos of @src to @dpos of @dst through the
+ * ordinary read and write paths
+ * returns :
+ * the bytes copied, or error code if none
+ */
+static ssize_t nvmm_copy_bytes(struct file *src, loff_t spos, struct file *dst,
+		loff_t dpos, size_t len)
+{
+	mm_segment_t oldfs;
+	size_t done = 0;
+	ssize_t n = 0, w;
+	char *buf;
+
+	if (!len)
+		return 0;
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	while (done < len) {
+		n = vfs_read(src, (char __user *)buf, min_t(size_t, len - done, PAGE_SIZE), &spos);
+		if (n <= 0)
+			break;
+		w = vfs_write(dst, (const char __user *)buf, n, &dpos);
+		if (w > 0)
+			done += w;
+		if (w != n) {
+			n = w;
+			break;
+		}
+	}
+	set_fs(oldfs);
+	free_page((unsigned long)buf);
+
+	return done ? done : n;
+}
+
+/*
+ * input :
+ * @dst : target file, open for writing
+ * @arg : user copy of struct nvmm_copy_file_range
+ * returns :
+ * 0 if some bytes were copied, their number is in arg->copied, else
+ * error code
+ * the whole blocks the ranges have at the same place in a page are
+ * cloned, the bytes before and after them are copied
+ */
+long nvmm_ioctl_copy_range(struct file *dst, struct nvmm_copy_file_range __user *arg)
+{
+	struct nvmm_copy_file_range args;
+	struct inode *src_inode;
+	struct fd src;
+	loff_t spos, dpos, size;
+	u64 len, head, body, copied = 0;
+	long ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	src = fdget(args.src_fd);
+	if (!src.file)
+		return -EBADF;
+	src_inode = file_inode(src.file);
+
+	ret = -EXDEV;
+	if (src_inode->i_sb != file_inode(dst)->i_sb)
+		goto out;
+	ret = -EINVAL;
+	if (!S_ISREG(src_inode->i_mode) || !S_ISREG(file_inode(dst)->i_mode) ||
+			(loff_t)args.src_offset < 0 || (loff_t)args.dest_offset < 0)
+		goto out;
+	ret = -EBADF;
+	if (!(src.file->f_mode & FMODE_READ) || !(dst->f_mode & FMODE_WRITE) ||
+			(dst->f_flags & O_APPEND))
+		goto out;
+
+	spos = args.src_offset;
+	dpos = args.dest_offset;
+	size = i_size_read(src_inode);
+	len = spos < size ? min_t(u64, args.length, size - spos) : 0;
+
+	head = len;
+	body = 0;
+	if (!((spos ^ dpos) & ~PAGE_MASK)) {
+		head = min_t(u64, len, (PAGE_SIZE - (spos & ~PAGE_MASK)) & ~PAGE_MASK);
+		body = (len - head) & PAGE_MASK;
+	}
+
+	ret = nvmm_copy_bytes(src.file, spos, dst, dpos, head);
+	if (ret < 0)
+		goto out;
+	copied = ret;
+	if (copied < head)
+		goto done;
+
+	if (body) {
+		ret = mnt_want_write_file(dst);
+		if (!ret) {
+			ret = nvmm_reflink(file_inode(dst), src_inode, spos + head, body, dpos + head);
+			mnt_drop_write_file(dst);
+		}
+		if (ret)
+			goto done;
+		copied += body;
+	}
+
+	ret = nvmm_copy_bytes(src.file, spos + copied, dst, dpos + copied, len - copied);
+	if (ret > 0)
+		copied += ret;
+
+done:
+	ret = copied || !len ? 0 : ret;
+	if (!ret && put_user(copied, &arg->copied))
+		ret = -EFAULT;
+out:
+	fdput(src);
+	return ret;
+}
+
+/* blocks under one pud entry */
+#define NVMM_PUD_BLOCKS		(PTRS_PER_PMD * PTRS_PER_PTE)
+
+enum {
+	NVMM_XCHG_PTE,
+	NVMM_XCHG_PMD,
+	NVMM_XCHG_PUD,
+};
+
+/*
+ * returns :
+ * the level of the entry that covers blocks @s and @d in both files,
+ * the largest one both line up on, its number of blocks in @n
+ */
+static int nvmm_xchg_level(unsigned long s, unsigned long d, unsigned long left,
+		unsigned long *n)
+{
+	if (left >= NVMM_PUD_BLOCKS && !((s | d) & (NVMM_PUD_BLOCKS - 1))) {
+		*n = NVMM_PUD_BLOCKS;
+		return NVMM_XCHG_PUD;
+	}
+	if (left >= PTRS_PER_PTE && !((s | d) & (PTRS_PER_PTE - 1))) {
+		*n = PTRS_PER_PTE;
+		return NVMM_XCHG_PMD;
+	}
+	*n = 1;
+	return NVMM_XCHG_PTE;
+}
+
+/*
+ * returns :
+ * the entry of @level covering block @blocknr, the table pages above it
+ * are allocated if missing, NULL if no space
+ */
+static u64 *nvmm_xchg_entry(struct inode *inode, unsigned long blocknr, int level)
+{
+	struct super_block *sb = inode->i_sb;
+
+	switch (level) {
+	case NVMM_XCHG_PUD:
+		return (u64 *)nvmm_pud_alloc(sb, inode->i_ino, blocknr << PAGE_SHIFT);
+	case NVMM_XCHG_PMD:
+		return (u64 *)nvmm_file_pmd_alloc(sb, inode, blocknr << PAGE_SHIFT);
+	default:
+		return (u64 *)nvmm_file_pte_alloc(sb, inode, blocknr << PAGE_SHIFT);
+	}
+}
+
+/*
+ * returns :
+ * the number of data blocks under the entry value @val of @level
+ */
+static unsigned long nvmm_xchg_count(u64 val, int level)
+{
+	u64 *page = __va((val & 0x0fffffffffffffff) & PAGE_MASK);
+	unsigned long i, nr = 0;
+
+	if (!val || level == NVMM_XCHG_PTE)
+		return val ? 1 : 0;
+	if (level == NVMM_XCHG_PMD)
+		return nvmm_reflink_count((pte_t *)page);
+	for (i = 0; i < PTRS_PER_PMD; i++)
+		nr += nvmm_xchg_count(page[i], NVMM_XCHG_PMD);
+	return nr;
+}
+
+/*
+ * input :
+ * @a, @b : the files, the caller holds their whole range and
+ * i_alloc_mutex
+ * @a_first, @b_first : first block of the ranges
+ * @nr : number of blocks
+ * @a_size, @b_size : the sizes of the files after the exchange
+ * returns :
+ * 0 if success else error code, nothing is exchanged then
+ * swap the entries of the ranges, the largest entries both files line
+ * up on, with one transaction of the journal. The data stays where it
+ * is, a shared pte page or data page moves with its reference.
+ */
+static int nvmm_xchg_blocks(struct inode *a, struct inode *b, unsigned long a_first,
+		unsigned long b_first, unsigned long nr, loff_t a_size, loff_t b_size)
+{
+	struct super_block *sb = a->i_sb;
+	struct nvmm_inode *nia = nvmm_get_inode(sb, a->i_ino);
+	struct nvmm_inode *nib = nvmm_get_inode(sb, b->i_ino);
+	unsigned long i, n, steps = 0, a_blocks = a->i_blocks, b_blocks = b->i_blocks;
+	unsigned long va = (unsigned long)NVMM_I(a)->i_virt_addr;
+	unsigned long vb = (unsigned long)NVMM_I(b)->i_virt_addr;
+	u64 *ea, *eb, va_old, vb_old;
+	pmd_t *pmd;
+	int level, err;
+
+	/* two records an entry, a size and a block count a file */
+	for (i = 0; i < nr; i += n, steps++)
+		nvmm_xchg_level(a_first + i, b_first + i, nr - i, &n);
+	if (2 * steps + 4 > NVMM_JOURNAL_RECS)
+		return -E2BIG;
+
+	/* pages shared with a clone may change hands */
+	if (nvmm_reflinked(a) || nvmm_reflinked(b)) {
+		nvmm_reflink_mark(a);
+		nvmm_reflink_mark(b);
+	}
+
+	/*
+	 * the table pages first, a pte page shared with a clone is copied
+	 * before its entries move, then no table page is replaced until
+	 * the commit
+	 */
+	err = nvmm_alloc_blocks(a, 0);
+	if (!err)
+		err = nvmm_alloc_blocks(b, 0);
+	for (i = 0; i < nr && !err; i += n) {
+		level = nvmm_xchg_level(a_first + i, b_first + i, nr - i, &n);
+		if (!nvmm_xchg_entry(a, a_first + i, level) || !nvmm_xchg_entry(b, b_first + i, level)) {
+			err = -ENOMEM;
+			break;
+		}
+		if (level != NVMM_XCHG_PTE)
+			continue;
+		pmd = nvmm_reflink_pmd(sb, a->i_ino, a_first + i);
+		err = nvmm_unshare_pte(a, pmd, a_first + i);
+		if (!err) {
+			pmd = nvmm_reflink_pmd(sb, b->i_ino, b_first + i);
+			err = nvmm_unshare_pte(b, pmd, b_first + i);
+		}
+	}
+	if (err)
+		return err;
+
+	nvmm_tc_invalidate(a);
+	nvmm_tc_invalidate(b);
+	nvmm_journal_begin(sb);
+	for (i = 0; i < nr; i += n) {
+		level = nvmm_xchg_level(a_first + i, b_first + i, nr - i, &n);
+		ea = nvmm_xchg_entry(a, a_first + i, level);
+		eb = nvmm_xchg_entry(b, b_first + i, level);
+		va_old = *ea;
+		vb_old = *eb;
+		if (va_old == vb_old)
+			continue;
+		nvmm_journal_add(sb, ea, vb_old);
+		nvmm_journal_add(sb, eb, va_old);
+		a_blocks += nvmm_xchg_count(vb_old, level) - nvmm_xchg_count(va_old, level);
+		b_blocks += nvmm_xchg_count(va_old, level) - nvmm_xchg_count(vb_old, level);
+	}
+	nvmm_memunlock_inode(sb, nia);
+	nvmm_memunlock_inode(sb, nib);
+	nvmm_journal_add(sb, &nia->i_size, a_size);
+	nvmm_journal_add(sb, &nia->i_blocks, a_blocks);
+	nvmm_journal_add(sb, &nib->i_size, b_size);
+	nvmm_journal_add(sb, &nib->i_blocks, b_blocks);
+	nvmm_journal_commit(sb);
+	nvmm_memlock_inode(sb, nib);
+	nvmm_memlock_inode(sb, nia);
+
+	a->i_blocks = a_blocks;
+	b->i_blocks = b_blocks;
+	i_size_write(a, a_size);
+	i_size_write(b, b_size);
+
+	/* the pmd pages of whole 1GB chunks changed hands, the VA window too */
+	for (i = 0; i < nr; i += n) {
+		level = nvmm_xchg_level(a_first + i, b_first + i, nr - i, &n);
+		if (level != NVMM_XCHG_PUD)
+			continue;
+		ea = nvmm_xchg_entry(a, a_first + i, level);
+		eb = nvmm_xchg_entry(b, b_first + i, level);
+		if (va && ((a_first + i) << PAGE_SHIFT) < MAX_FILE_SIZE) {
+			if (*ea)
+				nvmap_pmd(va + ((a_first + i) << PAGE_SHIFT), nvmm_get_pmd((pud_t *)ea), current->mm);
+			else
+				unnvmap_pmd(va + ((a_first + i) << PAGE_SHIFT), NULL, current->mm);
+		}
+		if (vb && ((b_first + i) << PAGE_SHIFT) < MAX_FILE_SIZE) {
+			if (*eb)
+				nvmap_pmd(vb + ((b_first + i) << PAGE_SHIFT), nvmm_get_pmd((pud_t *)eb), current->mm);
+			else
+				unnvmap_pmd(vb + ((b_first + i) << PAGE_SHIFT), NULL, current->mm);
+		}
+	}
+	nvmm_reflink_flush(a, a_first, nr);
+	nvmm_reflink_flush(b, b_first, nr);
+	return 0;
+}
+
+/*
+ * input :
+ * @dst : target file, open for writing
+ * @arg : user copy of struct nvmm_exchange_range, file1 is the staging
+ * file, open for reading and writing
+ * returns :
+ * 0 if success else error code
+ * publish data built in a staging file, an O_TMPFILE for example: the
+ * range of the staging file and the same size at file2_offset in @dst
+ * trade their blocks at once, the old blocks of @dst land in the staging
+ * file. The offsets are block aligned, so is the length unless the range
+ * ends at the end of the staging file. @dst grows to cover the range.
+ */
+long nvmm_ioctl_exchange_range(struct file *dst, struct nvmm_exchange_range __user *arg)
+{
+	struct nvmm_exchange_range args;
+	struct nvmm_range dst_range, src_range;
+	struct inode *a, *b = file_inode(dst);
+	struct fd src;
+	loff_t a_size, b_size;
+	u64 len;
+	long ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (args.flags || ((args.file1_offset | args.file2_offset) & ~PAGE_MASK))
+		return -EINVAL;
+
+	src = fdget(args.file1_fd);
+	if (!src.file)
+		return -EBADF;
+	a = file_inode(src.file);
+
+	ret = -EXDEV;
+	if (a->i_sb != b->i_sb)
+		goto out;
+	ret = -EINVAL;
+	if (!S_ISREG(a->i_mode) || !S_ISREG(b->i_mode) || a == b)
+		goto out;
+	ret = -EBADF;
+	if ((src.file->f_mode & (FMODE_READ | FMODE_WRITE)) != (FMODE_READ | FMODE_WRITE) ||
+			!(dst->f_mode & FMODE_WRITE) ||
+			((src.file->f_flags | dst->f_flags) & O_APPEND))
+		goto out;
+	ret = -EPERM;
+	if (IS_APPEND(a) || IS_IMMUTABLE(a) || IS_APPEND(b) || IS_IMMUTABLE(b))
+		goto out;
+	ret = mnt_want_write_file(dst);
+	if (ret)
+		goto out;
+
+	nvmm_lock_two(&a->i_mutex, &b->i_mutex);
+	a_size = i_size_read(a);
+	b_size = i_size_read(b);
+	len = args.length ? args.length : a_size - min_t(u64, a_size, args.file1_offset);
+	ret = -EINVAL;
+	if (!len || args.file1_offset + len > a_size || args.file1_offset + len < len)
+		goto out_unlock;
+	if ((len & ~PAGE_MASK) && (args.file1_offset + len != a_size ||
+			args.file2_offset + len < b_size))
+		goto out_unlock;
+	ret = -EFBIG;
+	if (args.file2_offset + len > b->i_sb->s_maxbytes)
+		goto out_unlock;
+	b_size = max_t(loff_t, b_size, args.file2_offset + len);
+
+	/* no writer, truncate or clone changes either table meanwhile */
+	nvmm_range_lock(&NVMM_I(b)->i_range_lock, &dst_range, 0, ULONG_MAX);
+	nvmm_range_lock(&NVMM_I(a)->i_range_lock, &src_range, 0, ULONG_MAX);
+	/* the blocks change files, the logged bytes go in first */
+	ret = nvmm_log_fold(a) ? : nvmm_log_fold(b);
+	if (ret)
+		goto out_range;
+	nvmm_lock_two(&NVMM_I(a)->i_alloc_mutex, &NVMM_I(b)->i_alloc_mutex);
+	ret = nvmm_xchg_blocks(a, b, args.file1_offset >> PAGE_SHIFT,
+			args.file2_offset >> PAGE_SHIFT, PAGE_ALIGN(len) >> PAGE_SHIFT,
+			a_size, b_size);
+	nvmm_unlock_two(&NVMM_I(a)->i_alloc_mutex, &NVMM_I(b)->i_alloc_mutex);
+
+	if (!ret) {
+		unmap_mapping_range(a->i_mapping, args.file1_offset, PAGE_ALIGN(len), 1);
+		unmap_mapping_range(b->i_mapping, args.file2_offset, PAGE_ALIGN(len), 1);
+		a->i_mtime = a->i_ctime = b->i_mtime = b->i_ctime = CURRENT_TIME_SEC;
+		nvmm_update_inode(a);
+		nvmm_update_inode(b);
+	}
+out_range:
+	nvmm_range_unlock(&NVMM_I(a)->i_range_lock, &src_range);
+	nvmm_range_unlock(&NVMM_I(b)->i_range_lock, &dst_range);
+out_unlock:
+	nvmm_unlock_two(&a->i_mutex, &b->i_mutex);
+	mnt_drop_write_file(dst);
+out:
+	fdput(src);
+	return ret;
+}
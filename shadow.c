@@ -0,0 +1,625 @@
+/*
+ * linux/fs/nvmm/shadow.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Per-CPU pools of zeroed NVM pages used by atomic writes. A write
+ * builds its shadow pte/pmd pages and data pages from the pool and
+ * swaps them into the file page table, the pages it replaces go back
+ * to the pool once the readers that may still walk them are gone.
+ *
+ * Readers hold the SRCU read lock of the super block across the walk
+ * and the copy to user space, they may sleep on a fault and never wait
+ * for a writer. A writer hands the replaced pages to call_srcu(), it
+ * does not wait for the readers either.
+ *
+ * The pages of the pools have a slot each in NVM, and a batch of
+ * replaced pages is listed in record pages chained from the shadow
+ * table until it is given back. Both are returned to the free list at
+ * mount, so a crash does not leak them.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include "nvmm.h"
+
+/* pages taken from the free list at once when a pool runs dry */
+#define NVMM_SHADOW_REFILL	(NVMM_SHADOW_POOL_SIZE / 2)
+
+/* push a zeroed page, preemption is disabled and @pool is not full */
+static void nvmm_pool_push(struct super_block *sb, struct nvmm_shadow_pool *pool,
+		phys_addr_t phys)
+{
+	if (pool->slots) {
+		pool->slots[pool->nr] = cpu_to_le64(nvmm_get_block_off(sb, __va(phys)));
+		nvmm_flush_buffer(&pool->slots[pool->nr], sizeof(__le64), false);
+	}
+	pool->pages[pool->nr++] = phys;
+}
+
+/* pop a page, preemption is disabled and @pool is not empty */
+static phys_addr_t nvmm_pool_pop(struct nvmm_shadow_pool *pool)
+{
+	pool->nr--;
+	if (pool->slots) {
+		pool->slots[pool->nr] = 0;
+		nvmm_flush_buffer(&pool->slots[pool->nr], sizeof(__le64), false);
+	}
+	return pool->pages[pool->nr];
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * returns :
+ * a zeroed page for the caller, NULL if no space left
+ * the pages are zeroed before the pool of the cpu is taken, the ones
+ * that do not fit in it any more go back to the free list
+ */
+static void *nvmm_shadow_refill(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_shadow_pool *pool;
+	phys_addr_t pages[NVMM_SHADOW_REFILL];
+	phys_addr_t phys, base = nsi->phy_addr;
+	unsigned long *p;
+	int i;
+
+	if (nvmm_new_block(sb, &phys, 1, NVMM_SHADOW_REFILL))
+		return NULL;
+
+	for (i = 0; i < NVMM_SHADOW_REFILL; i++) {
+		p = __va(phys);
+		pages[i] = phys;
+		phys = base + *p;
+		nvmm_memzero_persist(p, PAGE_SIZE);
+	}
+
+	pool = get_cpu_ptr(nsi->s_shadow);
+	for (i = 1; i < NVMM_SHADOW_REFILL && pool->nr < NVMM_SHADOW_POOL_SIZE; i++)
+		nvmm_pool_push(sb, pool, pages[i]);
+	put_cpu_ptr(nsi->s_shadow);
+
+	for (; i < NVMM_SHADOW_REFILL; i++)
+		nvmm_free_block(sb, pages[i] >> PAGE_SHIFT);
+	return __va(pages[0]);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * returns :
+ * kernel virtual address of a zeroed NVM page, NULL if no space left
+ */
+void *nvmm_shadow_get(struct super_block *sb)
+{
+	struct nvmm_shadow_pool *pool;
+	phys_addr_t phys = 0;
+
+	pool = get_cpu_ptr(NVMM_SB(sb)->s_shadow);
+	if (pool->nr)
+		phys = nvmm_pool_pop(pool);
+	put_cpu_ptr(NVMM_SB(sb)->s_shadow);
+
+	return phys ? __va(phys) : nvmm_shadow_refill(sb);
+}
+
+/* same as nvmm_shadow_put(), @addr is zeroed already */
+static void nvmm_shadow_put_zeroed(struct super_block *sb, void *addr)
+{
+	struct nvmm_shadow_pool *pool;
+
+	pool = get_cpu_ptr(NVMM_SB(sb)->s_shadow);
+	if (pool->nr < NVMM_SHADOW_POOL_SIZE) {
+		nvmm_pool_push(sb, pool, __pa(addr));
+		addr = NULL;
+	}
+	put_cpu_ptr(NVMM_SB(sb)->s_shadow);
+
+	if (addr)
+		nvmm_free_block(sb, __pa(addr) >> PAGE_SHIFT);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @addr : kernel virtual address of a page no longer used
+ * the page is zeroed and kept for the next write, or goes back to the
+ * free list when the pool is full
+ */
+void nvmm_shadow_put(struct super_block *sb, void *addr)
+{
+	nvmm_memzero_persist(addr, PAGE_SIZE);
+	nvmm_shadow_put_zeroed(sb, addr);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @pte : a pte page of a file or one being built
+ * @first : first entry to release
+ * @end : entry after the last one to release
+ * give the data pages of entries [first, end) and the pte page itself
+ * back to the pool, the other entries are shared with another pte page
+ */
+void nvmm_shadow_release_pte(struct super_block *sb, pte_t *pte,
+		unsigned long first, unsigned long end)
+{
+	unsigned long i;
+
+	for (i = first; i < end; i++) {
+		if (pte_none(pte[i]))
+			continue;
+		nvmm_shadow_put(sb, __va((pte_val(pte[i]) & 0x0fffffffffffffff) & PAGE_MASK));
+	}
+	nvmm_shadow_put(sb, pte);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @max : the most pages the write will replace
+ * returns :
+ * an empty reclaim batch, NULL if no memory
+ * taken before the swap, so a write never fails after it
+ */
+struct nvmm_reclaim *nvmm_reclaim_alloc(struct super_block *sb, unsigned long max)
+{
+	struct nvmm_reclaim *rc;
+
+	rc = kmalloc(sizeof(*rc) + max * sizeof(void *), GFP_NOFS);
+	if (rc) {
+		rc->sb = sb;
+		rc->rec = NULL;
+		rc->nr = 0;
+	}
+	return rc;
+}
+
+/*
+ * input :
+ * @rc : reclaim batch
+ * @addr : kernel virtual address of a page no longer in the table
+ * a page shared with a clone only loses a reference, it stays in use
+ */
+void nvmm_reclaim_add(struct nvmm_reclaim *rc, void *addr)
+{
+	if (!nvmm_ref_put(rc->sb, addr))
+		rc->pages[rc->nr++] = addr;
+}
+
+/*
+ * same as nvmm_shadow_release_pte(), the pages go to @rc. A pte page
+ * shared with a clone keeps its entries, only its reference goes.
+ */
+void nvmm_reclaim_pte(struct nvmm_reclaim *rc, pte_t *pte,
+		unsigned long first, unsigned long end)
+{
+	unsigned long i;
+
+	if (nvmm_ref_put(rc->sb, pte))
+		return;
+
+	for (i = first; i < end; i++) {
+		if (pte_none(pte[i]))
+			continue;
+		nvmm_reclaim_add(rc, __va((pte_val(pte[i]) & 0x0fffffffffffffff) & PAGE_MASK));
+	}
+	rc->pages[rc->nr++] = pte;
+}
+
+/* give the record pages of a batch back to the pool */
+static void nvmm_reclaim_rec_put(struct super_block *sb, struct nvmm_reclaim_rec *rec)
+{
+	struct nvmm_reclaim_rec *more;
+
+	while (rec) {
+		more = nvmm_get_block(sb, le64_to_cpu(rec->r_more));
+		/* only the head and the offsets written need clearing */
+		nvmm_memzero_persist(rec, offsetof(struct nvmm_reclaim_rec,
+				r_pages[le64_to_cpu(rec->r_nr)]));
+		nvmm_shadow_put_zeroed(sb, rec);
+		rec = more;
+	}
+}
+
+/*
+ * input :
+ * @rc : reclaim batch of a write, not empty
+ * list the pages of @rc in record pages and chain them from the shadow
+ * table, a crash before they are given back does not leak them. If no
+ * page is left for the records, the batch is only kept in memory.
+ */
+static void nvmm_reclaim_record(struct nvmm_reclaim *rc)
+{
+	struct super_block *sb = rc->sb;
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_shadow_table *t = nsi->s_shadow_table;
+	struct nvmm_reclaim_rec *rec, *prev = NULL;
+	unsigned long i = 0, j, n;
+
+	rc->rec = NULL;
+	if (!t)
+		return;
+
+	while (i < rc->nr) {
+		rec = nvmm_shadow_get(sb);
+		if (!rec) {
+			nvmm_reclaim_rec_put(sb, rc->rec);
+			rc->rec = NULL;
+			nvmm_error(sb, __FUNCTION__, "no space to record replaced pages\n");
+			return;
+		}
+		n = min(rc->nr - i, (unsigned long)NVMM_RECLAIM_REC_PAGES);
+		for (j = 0; j < n; j++)
+			rec->r_pages[j] = cpu_to_le64(nvmm_get_block_off(sb, rc->pages[i + j]));
+		rec->r_nr = cpu_to_le64(n);
+		nvmm_flush_buffer(rec, offsetof(struct nvmm_reclaim_rec, r_pages[n]), false);
+		if (prev) {
+			prev->r_more = cpu_to_le64(nvmm_get_block_off(sb, rec));
+			nvmm_flush_buffer(&prev->r_more, sizeof(__le64), false);
+		} else
+			rc->rec = rec;
+		prev = rec;
+		i += n;
+	}
+
+	/* the newest batch is the first of the chain and of the list */
+	spin_lock(&nsi->s_reclaim_lock);
+	rc->rec->r_next = t->t_pending;
+	nvmm_flush_buffer(&rc->rec->r_next, sizeof(__le64), false);
+	nvmm_persist_entry(&t->t_pending, cpu_to_le64(nvmm_get_block_off(sb, rc->rec)));
+	list_add(&rc->list, &nsi->s_reclaim_list);
+	spin_unlock(&nsi->s_reclaim_lock);
+}
+
+/*
+ * take the batch out of the chain in NVM before its pages go back, a
+ * crash in between leaks them, it never frees them twice
+ */
+static void nvmm_reclaim_unlink(struct nvmm_reclaim *rc)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(rc->sb);
+	struct nvmm_reclaim *prev;
+
+	spin_lock(&nsi->s_reclaim_lock);
+	if (rc->list.prev == &nsi->s_reclaim_list)
+		nvmm_persist_entry(&nsi->s_shadow_table->t_pending, rc->rec->r_next);
+	else {
+		prev = list_entry(rc->list.prev, struct nvmm_reclaim, list);
+		nvmm_persist_entry(&prev->rec->r_next, rc->rec->r_next);
+	}
+	list_del(&rc->list);
+	spin_unlock(&nsi->s_reclaim_lock);
+}
+
+/*
+ * a page of @rc is still in a pipe, see nvmm_file_splice_read(). The
+ * pipe holds a reference on top of the one every NVM page has.
+ */
+static int nvmm_reclaim_pinned(struct nvmm_reclaim *rc)
+{
+	unsigned long i;
+
+	for (i = 0; i < rc->nr; i++)
+		if (page_count(virt_to_page(rc->pages[i])) > 1)
+			return 1;
+	return 0;
+}
+
+/* give the pages of @rc back, @rc is freed */
+static void nvmm_reclaim_free(struct nvmm_reclaim *rc)
+{
+	if (rc->rec)
+		nvmm_reclaim_unlink(rc);
+	while (rc->nr)
+		nvmm_shadow_put(rc->sb, rc->pages[--rc->nr]);
+	nvmm_reclaim_rec_put(rc->sb, rc->rec);
+	kfree(rc);
+}
+
+/*
+ * the readers are gone, a pipe may still hold a page. The whole batch
+ * waits then, its record in NVM lists pages that are not free yet.
+ */
+static void nvmm_reclaim_rcu(struct rcu_head *head)
+{
+	struct nvmm_reclaim *rc = container_of(head, struct nvmm_reclaim, rcu);
+	struct nvmm_sb_info *nsi = NVMM_SB(rc->sb);
+
+	if (!nvmm_reclaim_pinned(rc)) {
+		nvmm_reclaim_free(rc);
+		return;
+	}
+	spin_lock(&nsi->s_reclaim_lock);
+	list_add_tail(&rc->wait, &nsi->s_reclaim_wait);
+	spin_unlock(&nsi->s_reclaim_lock);
+	schedule_delayed_work(&nsi->s_reclaim_work, NVMM_RECLAIM_DELAY);
+}
+
+/* free the waiting batches whose pipes let go of their pages */
+static void nvmm_reclaim_retry(struct work_struct *work)
+{
+	struct nvmm_sb_info *nsi =
+		container_of(to_delayed_work(work), struct nvmm_sb_info, s_reclaim_work);
+	struct nvmm_reclaim *rc, *next;
+	LIST_HEAD(list);
+
+	spin_lock(&nsi->s_reclaim_lock);
+	list_splice_init(&nsi->s_reclaim_wait, &list);
+	spin_unlock(&nsi->s_reclaim_lock);
+
+	list_for_each_entry_safe(rc, next, &list, wait) {
+		if (nvmm_reclaim_pinned(rc))
+			continue;
+		list_del(&rc->wait);
+		nvmm_reclaim_free(rc);
+	}
+	if (list_empty(&list))
+		return;
+
+	spin_lock(&nsi->s_reclaim_lock);
+	list_splice(&list, &nsi->s_reclaim_wait);
+	spin_unlock(&nsi->s_reclaim_lock);
+	schedule_delayed_work(&nsi->s_reclaim_work, NVMM_RECLAIM_DELAY);
+}
+
+/*
+ * input :
+ * @rc : reclaim batch of a write, it is freed
+ * the pages go back to the pool after the readers of the moment are gone
+ */
+void nvmm_reclaim_defer(struct nvmm_reclaim *rc)
+{
+	if (!rc->nr) {
+		kfree(rc);
+		return;
+	}
+	nvmm_reclaim_record(rc);
+	call_srcu(&NVMM_SB(rc->sb)->s_srcu, &rc->rcu, nvmm_reclaim_rcu);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @rcp : the batch being filled, NULL before the first page
+ * @addr : kernel virtual address of a page no longer in the table
+ * same as nvmm_reclaim_add() for a removal of unknown size, a full batch
+ * is deferred and the next one started. The page is leaked if no memory.
+ * The caller defers the last batch.
+ */
+void nvmm_reclaim_queue(struct super_block *sb, struct nvmm_reclaim **rcp, void *addr)
+{
+	if (nvmm_ref_put(sb, addr))
+		return;
+
+	if (*rcp && (*rcp)->nr == NVMM_RECLAIM_BATCH) {
+		nvmm_reclaim_defer(*rcp);
+		*rcp = NULL;
+	}
+	if (!*rcp) {
+		*rcp = nvmm_reclaim_alloc(sb, NVMM_RECLAIM_BATCH);
+		if (!*rcp) {
+			nvmm_error(sb, __FUNCTION__, "no memory, one block leaked\n");
+			return;
+		}
+	}
+	(*rcp)->pages[(*rcp)->nr++] = addr;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @addr : kernel virtual address of a page no longer in the table and
+ * no longer shared
+ * the page goes back after the readers, it is leaked if no memory
+ */
+void nvmm_reclaim_one(struct super_block *sb, void *addr)
+{
+	struct nvmm_reclaim *rc = nvmm_reclaim_alloc(sb, 1);
+
+	if (!rc) {
+		nvmm_error(sb, __FUNCTION__, "no memory, one block leaked\n");
+		return;
+	}
+	rc->pages[rc->nr++] = addr;
+	nvmm_reclaim_defer(rc);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * returns :
+ * 0 if success else -ENOMEM
+ * set up the pools and the reader epochs
+ */
+int nvmm_shadow_init(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+
+	spin_lock_init(&nsi->s_reclaim_lock);
+	INIT_LIST_HEAD(&nsi->s_reclaim_list);
+	INIT_LIST_HEAD(&nsi->s_reclaim_wait);
+	INIT_DELAYED_WORK(&nsi->s_reclaim_work, nvmm_reclaim_retry);
+	nsi->s_shadow_table = NULL;
+
+	if (init_srcu_struct(&nsi->s_srcu))
+		return -ENOMEM;
+
+	nsi->s_shadow = alloc_percpu(struct nvmm_shadow_pool);
+	if (!nsi->s_shadow) {
+		cleanup_srcu_struct(&nsi->s_srcu);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* the slots of @cpu in the slot pages of @t */
+static __le64 *nvmm_shadow_slots(struct super_block *sb, struct nvmm_shadow_table *t, int cpu)
+{
+	__le64 *page = nvmm_get_block(sb, le64_to_cpu(t->t_pages[cpu / NVMM_SHADOW_CPUS_PER_PAGE]));
+
+	return page + (cpu % NVMM_SHADOW_CPUS_PER_PAGE) * NVMM_SHADOW_POOL_SIZE;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @t : shadow table found at mount
+ * the pages the pools and the pending batches held when the file system
+ * went down go back to the free list. Each one leaves the table before
+ * it is freed, a crash here leaks it rather than free it twice.
+ */
+static void nvmm_shadow_recover(struct super_block *sb, struct nvmm_shadow_table *t)
+{
+	struct nvmm_reclaim_rec *batch, *rec, *next, *more;
+	unsigned long i, count = 0;
+	__le64 *slots, off;
+	int cpu;
+
+	batch = nvmm_get_block(sb, le64_to_cpu(t->t_pending));
+	nvmm_persist_entry(&t->t_pending, 0);
+	for (; batch; batch = next) {
+		next = nvmm_get_block(sb, le64_to_cpu(batch->r_next));
+		for (rec = batch; rec; rec = more) {
+			more = nvmm_get_block(sb, le64_to_cpu(rec->r_more));
+			for (i = 0; i < le64_to_cpu(rec->r_nr); i++, count++)
+				nvmm_free_block(sb, __pa(nvmm_get_block(sb,
+						le64_to_cpu(rec->r_pages[i]))) >> PAGE_SHIFT);
+			nvmm_free_block(sb, __pa(rec) >> PAGE_SHIFT);
+		}
+	}
+
+	for (cpu = 0; cpu < le64_to_cpu(t->t_cpus); cpu++) {
+		slots = nvmm_shadow_slots(sb, t, cpu);
+		for (i = 0; i < NVMM_SHADOW_POOL_SIZE; i++) {
+			off = slots[i];
+			if (!off)
+				continue;
+			slots[i] = 0;
+			nvmm_flush_buffer(&slots[i], sizeof(__le64), true);
+			nvmm_free_block(sb, __pa(nvmm_get_block(sb, le64_to_cpu(off))) >> PAGE_SHIFT);
+			count++;
+		}
+	}
+
+	if (count)
+		nvmm_info("%lu shadow pages back to the free list\n", count);
+}
+
+/* free a shadow table whose slot pages are empty */
+static void nvmm_shadow_table_free(struct super_block *sb, struct nvmm_shadow_table *t)
+{
+	struct nvmm_super_block *ns = nvmm_get_super(sb);
+	unsigned long i;
+
+	nvmm_memunlock_super(sb, ns);
+	nvmm_persist_entry(&ns->s_shadow_start, 0);
+	nvmm_memlock_super(sb, ns);
+	for (i = 0; i < NVMM_SHADOW_TABLE_PAGES && t->t_pages[i]; i++)
+		nvmm_free_block(sb, __pa(nvmm_get_block(sb, le64_to_cpu(t->t_pages[i]))) >> PAGE_SHIFT);
+	nvmm_free_block(sb, __pa(t) >> PAGE_SHIFT);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * returns :
+ * 0 if success else error code
+ * return what a crash left in the pools to the free list and give the
+ * pools their slots in NVM, the table is built the first time or when
+ * it has fewer slots than cpus. Called once the journal is replayed.
+ */
+int nvmm_shadow_load(struct super_block *sb)
+{
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_super_block *ns = nvmm_get_super(sb);
+	struct nvmm_shadow_table *t;
+	unsigned long i, pages;
+	void *page;
+	int cpu;
+
+	if (nr_cpu_ids > NVMM_SHADOW_MAX_CPUS) {
+		nvmm_error(sb, __FUNCTION__, "too many cpus for the shadow table\n");
+		return -EINVAL;
+	}
+
+	t = nvmm_get_block(sb, le64_to_cpu(ns->s_shadow_start));
+	if (t) {
+		nvmm_shadow_recover(sb, t);
+		if (le64_to_cpu(t->t_cpus) < nr_cpu_ids) {
+			nvmm_shadow_table_free(sb, t);
+			t = NULL;
+		}
+	}
+
+	if (!t) {
+		t = (struct nvmm_shadow_table *)nvmm_get_zeroed_page(sb);
+		if (!t)
+			return -ENOSPC;
+		pages = DIV_ROUND_UP(nr_cpu_ids, NVMM_SHADOW_CPUS_PER_PAGE);
+		for (i = 0; i < pages; i++) {
+			page = (void *)nvmm_get_zeroed_page(sb);
+			if (!page) {
+				nvmm_shadow_table_free(sb, t);
+				return -ENOSPC;
+			}
+			t->t_pages[i] = cpu_to_le64(nvmm_get_block_off(sb, page));
+		}
+		t->t_cpus = cpu_to_le64(pages * NVMM_SHADOW_CPUS_PER_PAGE);
+		nvmm_flush_buffer(t, sizeof(*t), false);
+		nvmm_memunlock_super(sb, ns);
+		nvmm_persist_entry(&ns->s_shadow_start, cpu_to_le64(nvmm_get_block_off(sb, t)));
+		nvmm_memlock_super(sb, ns);
+	}
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(nsi->s_shadow, cpu)->slots = nvmm_shadow_slots(sb, t, cpu);
+	nsi->s_shadow_table = t;
+	return 0;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * return the pages of every pool to the free list, at umount
+ */
+void nvmm_shadow_drain(struct super_block *sb)
+{
+	struct nvmm_reclaim *rc, *next;
+	struct nvmm_shadow_pool *pool;
+	int cpu;
+
+	if (!NVMM_SB(sb)->s_shadow)
+		return;
+
+	/* the deferred pages come back to the pools first */
+	srcu_barrier(&NVMM_SB(sb)->s_srcu);
+	cleanup_srcu_struct(&NVMM_SB(sb)->s_srcu);
+	cancel_delayed_work_sync(&NVMM_SB(sb)->s_reclaim_work);
+	list_for_each_entry_safe(rc, next, &NVMM_SB(sb)->s_reclaim_wait, wait) {
+		if (nvmm_reclaim_pinned(rc))
+			continue;
+		list_del(&rc->wait);
+		nvmm_reclaim_free(rc);
+	}
+	/* a pipe outlives the mount, the next mount frees these batches */
+	list_for_each_entry_safe(rc, next, &NVMM_SB(sb)->s_reclaim_wait, wait) {
+		if (!rc->rec)
+			nvmm_error(sb, __FUNCTION__, "pages still in a pipe leaked\n");
+		kfree(rc);
+	}
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(NVMM_SB(sb)->s_shadow, cpu);
+		while (pool->nr)
+			nvmm_free_block(sb, nvmm_pool_pop(pool) >> PAGE_SHIFT);
+	}
+	nvmm_persist_barrier();
+	free_percpu(NVMM_SB(sb)->s_shadow);
+	NVMM_SB(sb)->s_shadow = NULL;
+}
@@ -30,7 +30,7 @@
 static loff_t nvmm_max_size(int bits)
 {
 	loff_t res;
-	res = (1UL << 35) - 1;
+	res = NVMM_MAX_FILE_SIZE - 1;
 
 	if(res > MAX_LFS_FILESIZE)
 		res = MAX_LFS_FILESIZE;
@@ -45,6 +45,7 @@ enum {
 	Opt_gid, Opt_blocksize, Opt_user_xattr,
 	Opt_nouser_xattr, Opt_noprotect,
 	Opt_acl, Opt_noacl, Opt_xip,
+	Opt_atomic, Opt_inplace,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
 	Opt_err
 };
@@ -64,6 +65,8 @@ static const match_table_t tokens = {
 	{Opt_acl,		"acl"},
 	{Opt_acl,		"noacl"},
 	{Opt_xip,		"xip"},
+	{Opt_atomic,		"atomic"},
+	{Opt_inplace,		"inplace"},
 	{Opt_err_cont,		"errors=continue"},
 	{Opt_err_panic,		"errors=panic"},
 	{Opt_err_ro,		"errors=remount-ro"},
@@ -87,6 +90,13 @@ static struct inode *nvmm_alloc_inode(struct super_block *sb)
         return NULL;
     }
     vi->vfs_inode.i_version = 1;
+    vi->i_tc_pmd_key = vi->i_tc_pte_key = ULONG_MAX;
+    vi->i_tc_pmd = vi->i_tc_pte = NULL;
+    vi->i_tc_gen = 0;
+    vi->i_log = NULL;
+    vi->i_log_tail = 0;
+    vi->i_log_off = false;
+    vi->i_sync_state = vi->i_sync_nr = 0;
     return &vi->vfs_inode;
 }
 
@@ -104,6 +114,7 @@ static void nvmm_destroy_inode(struct inode *inode)
 static void nvmm_put_super(struct super_block *sb)
 {
 	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	nvmm_shadow_drain(sb);
 	sb->s_fs_info = NULL;
 	kfree(nsi);
 }
@@ -160,6 +171,12 @@ static void init_once(void *foo)
 
 	spin_lock_init(&vi->i_meta_spinlock);
 	spin_lock_init(&vi->truncate_spinlock);
+	seqlock_init(&vi->i_tc_lock);
+	mutex_init(&vi->i_alloc_mutex);
+	seqlock_init(&vi->i_undo_lock);
+	nvmm_range_lock_init(&vi->i_range_lock);
+	nvmm_log_init_once(vi);
+	nvmm_sync_init_once(vi);
 	inode_init_once(&vi->vfs_inode);
 }
 
@@ -307,6 +324,12 @@ static int nvmm_parse_options(char *options, struct nvmm_sb_info *sbi,
 				!is_power_of_2(sbi->blocksize))
 				goto bad_val;
 			break;
+		case Opt_atomic:
+			clear_opt(sbi->s_mount_opt, INPLACE);
+			break;
+		case Opt_inplace:
+			set_opt(sbi->s_mount_opt, INPLACE);
+			break;
 default: {
 			goto bad_opt;
 		}
@@ -552,6 +575,17 @@ static int nvmm_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_maxbytes = nvmm_max_size(sb->s_blocksize_bits);
     sb->s_max_links =  NVMM_LINK_MAX;
     sb->s_flags |= MS_NOSEC;
+    retval = nvmm_shadow_init(sb);
+    if (retval)
+        goto out;
+    nvmm_ref_init(sb);
+    nvmm_sync_init(sb);
+    retval = nvmm_journal_init(sb);
+    if (retval)
+        goto out;
+    retval = nvmm_shadow_load(sb);
+    if (retval)
+        goto out;
     root_i = nvmm_iget(sb,NVMM_ROOT_INO);
     nvmm_make_empty(root_i,root_i);
     if (IS_ERR(root_i)) {
@@ -571,6 +605,7 @@ static int nvmm_fill_super(struct super_block *sb, void *data, int silent)
     if (sbi->virt_addr) {       
         nvmm_info("The zone virtual address not empty!\n");
     }
+    nvmm_shadow_drain(sb);
     kfree(sbi);                 //!< and also free the sbi
     return retval;
 }
@@ -635,6 +670,8 @@ static int nvmm_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",errors=remount-ro");
 	if (test_opt(root->d_sb, ERRORS_PANIC))
 		seq_puts(seq, ",errors=panic");
+	if (test_opt(root->d_sb, INPLACE))
+		seq_puts(seq, ",inplace");
 
 #ifdef CONFIG_NVMMFS_XATTR
 	/* user xattr not enabled by default */
@@ -679,16 +716,38 @@ int init_nvmm_fs(void)
 
 	int rc = 0;
     nvmm_trace();
+    nvmm_persist_init();
     rc = nvmalloc_init();
 
     rc = init_inodecache();
 	if(rc)
 		goto out;
 
+    rc = nvmm_copy_init();
+    if (rc)
+        goto out_cache;
+
+    rc = nvmm_aio_init();
+    if (rc)
+        goto out_copy;
+
+    rc = nvmm_log_init();
+    if (rc)
+        goto out_aio;
+
     rc = register_filesystem(&nvmm_fs_type);
     if (rc)
-        goto out;
+        goto out_log;
     return 0;
+
+    out_log:
+    nvmm_log_exit();
+    out_aio:
+    nvmm_aio_exit();
+    out_copy:
+    nvmm_copy_exit();
+    out_cache:
+    destory_inodecache();
     
     out:
 
@@ -700,6 +759,9 @@ static void __exit exit_nvmm_fs(void)
 {
     nvmm_trace();
     unregister_filesystem(&nvmm_fs_type);
+    nvmm_log_exit();
+    nvmm_aio_exit();
+    nvmm_copy_exit();
     destory_inodecache();
 }
 
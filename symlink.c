@@ -25,8 +25,9 @@ int nvmm_page_symlink(struct inode *inode, const char *symname, int len)
     nvmm_establish_mapping(inode);
 
     vaddr = (char *)(ni_info->i_virt_addr);
-    memcpy(vaddr, symname, len);
+    nvmm_memcpy_persist(vaddr, symname, len);
     vaddr[len] = '\0';
+    nvmm_flush_buffer(vaddr + len, 1, true);
 
     nvmm_destroy_mapping(inode);
     return 0;
@@ -0,0 +1,247 @@
+/*
+ * linux/fs/nvmm/sync.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * fsync and fdatasync. write() makes its bytes persistent before it
+ * returns, whatever the plan, so what is left for fsync are the stores
+ * nothing wrote back: stores through a shared writable mapping, the
+ * directory entries and the fields nvmm_update_inode() writes. Each
+ * inode keeps the byte ranges of its file written that way since the
+ * last sync and whether its nvmm_inode changed, fsync writes back those
+ * cache lines alone and fences once.
+ *
+ * A page mapped writable is tracked when it is faulted in, fsync unmaps
+ * it again before the write back, so the next store faults and tracks
+ * it again.
+ *
+ * Syncs are committed in groups per file system: one caller leads a
+ * pass over every request queued, the fence is paid once per pass and
+ * not once per caller. A request that comes during a pass is in the
+ * next one, so it never returns before the lines it covers are written
+ * back, even for a file that was in the running pass.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include "nvmm.h"
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @pos : file position of the bytes written
+ * @len : the size
+ * the range joins the one it touches, or the nearest one once the table
+ * is full, a wider range only writes back more lines
+ */
+void nvmm_sync_track(struct inode *inode, loff_t pos, size_t len)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_sync_range *r;
+	loff_t end = pos + len, gap, best_gap = LLONG_MAX;
+	unsigned int i, best = 0;
+
+	if (!len)
+		return;
+
+	spin_lock(&ni_info->i_sync_lock);
+	for (i = 0; i < ni_info->i_sync_nr; i++) {
+		r = &ni_info->i_sync[i];
+		if (pos <= r->end && r->start <= end)
+			goto merge;
+		gap = pos > r->end ? pos - r->end : r->start - end;
+		if (gap < best_gap) {
+			best_gap = gap;
+			best = i;
+		}
+	}
+	if (ni_info->i_sync_nr < NVMM_SYNC_RANGES) {
+		r = &ni_info->i_sync[ni_info->i_sync_nr++];
+		r->start = pos;
+		r->end = end;
+		goto out;
+	}
+	r = &ni_info->i_sync[best];
+merge:
+	r->start = min(r->start, pos);
+	r->end = max(r->end, end);
+out:
+	spin_unlock(&ni_info->i_sync_lock);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @bits : NVMM_SYNC_INODE, with NVMM_SYNC_DATASYNC when the size or the
+ * block count changed too
+ */
+void nvmm_sync_mark_inode(struct inode *inode, unsigned int bits)
+{
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+
+	spin_lock(&ni_info->i_sync_lock);
+	ni_info->i_sync_state |= bits;
+	spin_unlock(&ni_info->i_sync_lock);
+}
+
+/*
+ * input :
+ * @inode : vfs inode
+ * @r : a range of the file
+ * write back the lines of the blocks of @r, holes have none
+ */
+static void nvmm_sync_flush_range(struct inode *inode, struct nvmm_sync_range *r)
+{
+	loff_t pos = r->start;
+	size_t bytes;
+	u64 phys;
+
+	while (pos < r->end) {
+		bytes = min_t(loff_t, r->end - pos, PAGE_SIZE - (pos & ~PAGE_MASK));
+		phys = nvmm_find_data_block(inode, pos >> PAGE_SHIFT);
+		if (phys)
+			nvmm_flush_buffer(__va(phys) + (pos & ~PAGE_MASK), bytes, false);
+		pos += bytes;
+	}
+}
+
+/*
+ * input :
+ * @req : a sync request of the pass
+ * take the tracked ranges of the inode, unmap them and write them back,
+ * the fence is the one of the pass
+ */
+static void nvmm_sync_inode(struct nvmm_sync_req *req)
+{
+	struct inode *inode = req->inode;
+	struct nvmm_inode_info *ni_info = NVMM_I(inode);
+	struct nvmm_sync_range r[NVMM_SYNC_RANGES];
+	unsigned int nr, i, state;
+	int idx;
+
+	spin_lock(&ni_info->i_sync_lock);
+	nr = ni_info->i_sync_nr;
+	memcpy(r, ni_info->i_sync, nr * sizeof(r[0]));
+	ni_info->i_sync_nr = 0;
+	state = ni_info->i_sync_state;
+	if (req->datasync && !(state & NVMM_SYNC_DATASYNC))
+		state = 0;
+	ni_info->i_sync_state &= ~state;
+	spin_unlock(&ni_info->i_sync_lock);
+
+	/* the next store through a mapping faults and is tracked again */
+	if (nr && mapping_mapped(inode->i_mapping))
+		for (i = 0; i < nr; i++)
+			unmap_mapping_range(inode->i_mapping, r[i].start,
+					r[i].end - r[i].start, 1);
+
+	/* the blocks stay while they are walked */
+	idx = srcu_read_lock(&NVMM_SB(inode->i_sb)->s_srcu);
+	for (i = 0; i < nr; i++)
+		nvmm_sync_flush_range(inode, &r[i]);
+	srcu_read_unlock(&NVMM_SB(inode->i_sb)->s_srcu, idx);
+
+	if (state & NVMM_SYNC_INODE)
+		nvmm_flush_buffer(nvmm_get_inode(inode->i_sb, inode->i_ino),
+				NVMM_INODE_SIZE, false);
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * @req : request of the caller, queued
+ * the caller leads passes until its own request is done. A pass takes
+ * every queued request, writes back all their lines and fences once,
+ * the requests queued meanwhile wait for the next pass. A lone caller
+ * never waits for a window, it leads a pass of one at once. The group
+ * lock is held on entry and on return.
+ */
+static void nvmm_sync_lead(struct super_block *sb, struct nvmm_sync_req *req)
+{
+	struct nvmm_sync_group *g = &NVMM_SB(sb)->s_sync;
+	struct nvmm_sync_req *r, *tmp;
+	LIST_HEAD(batch);
+
+	while (!req->done) {
+		list_splice_init(&g->queue, &batch);
+		spin_unlock(&g->lock);
+
+		list_for_each_entry(r, &batch, list)
+			nvmm_sync_inode(r);
+		nvmm_persist_barrier();
+		atomic64_inc(&NVMM_SB(sb)->s_sync_passes);
+
+		spin_lock(&g->lock);
+		list_for_each_entry_safe(r, tmp, &batch, list) {
+			list_del(&r->list);
+			r->done = true;
+		}
+	}
+	g->running = false;
+	/* the followers left in the queue elect the next leader */
+	wake_up_all(&g->wait);
+}
+
+/*
+ * input :
+ * @file : vfs file
+ * @start, @end : the range asked for, every tracked range is written
+ * back anyway
+ * @datasync : fdatasync, the nvmm_inode is written back only if the
+ * size or the block count changed
+ * returns :
+ * 0
+ * concurrent syncs of the file system, of any file, share one fence,
+ * the writes of O_SYNC files come here through generic_write_sync()
+ */
+int nvmm_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct nvmm_sync_group *g = &NVMM_SB(inode->i_sb)->s_sync;
+	struct nvmm_sync_req req = {
+		.inode = inode,
+		.datasync = datasync,
+		.done = false,
+	};
+
+	atomic64_inc(&NVMM_SB(inode->i_sb)->s_sync_reqs);
+	spin_lock(&g->lock);
+	list_add_tail(&req.list, &g->queue);
+	for (;;) {
+		if (req.done)
+			break;
+		if (!g->running) {
+			g->running = true;
+			nvmm_sync_lead(inode->i_sb, &req);
+			break;
+		}
+		spin_unlock(&g->lock);
+		wait_event(g->wait, ACCESS_ONCE(req.done) || !ACCESS_ONCE(g->running));
+		spin_lock(&g->lock);
+	}
+	spin_unlock(&g->lock);
+	return 0;
+}
+
+/*
+ * input :
+ * @sb : vfs super block
+ * set up the group commit of the syncs, at mount
+ */
+void nvmm_sync_init(struct super_block *sb)
+{
+	struct nvmm_sync_group *g = &NVMM_SB(sb)->s_sync;
+
+	spin_lock_init(&g->lock);
+	INIT_LIST_HEAD(&g->queue);
+	init_waitqueue_head(&g->wait);
+	g->running = false;
+}
+
+/* the sync state that lives as long as the slab object */
+void nvmm_sync_init_once(struct nvmm_inode_info *ni_info)
+{
+	spin_lock_init(&ni_info->i_sync_lock);
+}
@@ -0,0 +1,471 @@
+/*
+ * linux/fs/nvmm/tx.c
+ *
+ * Copyright (C) 2013 College of Computer Science,
+ * Chonqing University
+ *
+ * Atomic writes across several ranges of several files. A transaction
+ * stages every touched page in a fresh shadow page, old bytes around
+ * the write included, then swaps all the pte entries, the sizes and the
+ * block counts of the files with one commit record of the journal:
+ * after a crash either every write of the transaction is there or none.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <asm/tlbflush.h>
+#include <asm/uaccess.h>
+#include "nvmm.h"
+
+/* files of one transaction at most */
+#define NVMM_TX_MAX_FILES	64
+
+struct nvmm_tx_file {
+	struct file *file;
+	struct inode *inode;
+	struct nvmm_range range;
+	loff_t size;			/* the size after the commit */
+	unsigned long blocks;		/* the block count after the commit */
+};
+
+struct nvmm_tx_page {
+	struct hlist_node node;
+	struct nvmm_tx_file *f;
+	unsigned long blocknr;
+	void *data;			/* the shadow page */
+	pte_t *pte;			/* the entry it goes to */
+	pte_t old;
+};
+
+struct nvmm_tx {
+	struct super_block *sb;
+	unsigned long nr_files, nr_pages;
+	struct nvmm_tx_file files[NVMM_TX_MAX_FILES];
+	struct nvmm_tx_page *pages;
+	DECLARE_HASHTABLE(hash, 10);
+};
+
+static int nvmm_tx_cmp_file(const void *a, const void *b)
+{
+	const struct nvmm_tx_file *fa = a, *fb = b;
+
+	if (fa->inode == fb->inode)
+		return 0;
+	return fa->inode < fb->inode ? -1 : 1;
+}
+
+/*
+ * input :
+ * @tx : the transaction
+ * @fd : a file of the transaction, open for writing
+ * output :
+ * @inodep : the inode of the file
+ * returns :
+ * 0 if success else error code
+ * a file given twice is taken once
+ */
+static int nvmm_tx_add_file(struct nvmm_tx *tx, int fd, struct inode **inodep)
+{
+	struct nvmm_tx_file *f;
+	struct file *file;
+	struct inode *inode;
+	unsigned long i;
+	int err;
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+	inode = file_inode(file);
+	*inodep = inode;
+
+	for (i = 0; i < tx->nr_files; i++) {
+		if (tx->files[i].inode == inode) {
+			fput(file);
+			return 0;
+		}
+	}
+
+	err = -EXDEV;
+	if (inode->i_sb != tx->sb)
+		goto out;
+	err = -EINVAL;
+	if (!S_ISREG(inode->i_mode))
+		goto out;
+	err = -EBADF;
+	if (!(file->f_mode & FMODE_WRITE) || (file->f_flags & O_APPEND))
+		goto out;
+	err = -EPERM;
+	if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+		goto out;
+	err = -EMFILE;
+	if (tx->nr_files == NVMM_TX_MAX_FILES)
+		goto out;
+	err = mnt_want_write_file(file);
+	if (err)
+		goto out;
+
+	f = &tx->files[tx->nr_files++];
+	f->file = file;
+	f->inode = inode;
+	return 0;
+out:
+	fput(file);
+	return err;
+}
+
+static struct nvmm_tx_file *nvmm_tx_find_file(struct nvmm_tx *tx, struct inode *inode)
+{
+	unsigned long i;
+
+	for (i = 0; i < tx->nr_files; i++)
+		if (tx->files[i].inode == inode)
+			break;
+	return &tx->files[i];
+}
+
+/*
+ * input :
+ * @tx : the transaction, its files are locked
+ * @f : the file
+ * @blocknr : a block of the file
+ * @whole : the write covers the whole block
+ * returns :
+ * the shadow page of the block, NULL if no space left
+ * the first write to a block takes a fresh page with the old data, the
+ * later ones of the transaction go to that page
+ */
+static struct nvmm_tx_page *nvmm_tx_page(struct nvmm_tx *tx, struct nvmm_tx_file *f,
+		unsigned long blocknr, int whole)
+{
+	unsigned long key = hash_long((unsigned long)f ^ blocknr, 32);
+	struct nvmm_tx_page *p;
+	u64 phys;
+
+	hash_for_each_possible(tx->hash, p, node, key)
+		if (p->f == f && p->blocknr == blocknr)
+			return p;
+
+	p = &tx->pages[tx->nr_pages];
+	p->data = nvmm_shadow_get(tx->sb);
+	if (!p->data)
+		return NULL;
+	if (!whole) {
+		phys = nvmm_find_data_block(f->inode, blocknr);
+		if (phys)
+			nvmm_memcpy_persist(p->data, __va(phys), PAGE_SIZE);
+	}
+	p->f = f;
+	p->blocknr = blocknr;
+	hash_add(tx->hash, &p->node, key);
+	tx->nr_pages++;
+	return p;
+}
+
+/*
+ * input :
+ * @tx : the transaction, its files are locked
+ * @vecs : the writes
+ * @inodes : the inode of each write
+ * @nr : number of writes
+ * returns :
+ * 0 if success else error code
+ * the checks of a write(2) for every write, the size limit of the
+ * caller and of the file system included: a write that would be cut
+ * fails the transaction, it can not be done in part. Then the suid
+ * bits are dropped and the times updated for every file.
+ */
+static int nvmm_tx_checks(struct nvmm_tx *tx, struct nvmm_tx_vec *vecs,
+		struct inode **inodes, unsigned long nr)
+{
+	struct nvmm_tx_file *f;
+	unsigned long i;
+	loff_t pos;
+	size_t count;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		if (!vecs[i].len)
+			continue;
+		f = nvmm_tx_find_file(tx, inodes[i]);
+		pos = vecs[i].offset;
+		count = vecs[i].len;
+		err = generic_write_checks(f->file, &pos, &count, 0);
+		if (err)
+			return err;
+		if (pos != vecs[i].offset || count != vecs[i].len)
+			return -EFBIG;
+	}
+	for (i = 0; i < tx->nr_files; i++) {
+		err = file_remove_suid(tx->files[i].file);
+		if (!err)
+			err = file_update_time(tx->files[i].file);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * copy the bytes of @vec to the shadow pages of its blocks
+ * returns :
+ * 0 if success else error code
+ */
+static int nvmm_tx_stage(struct nvmm_tx *tx, struct nvmm_tx_file *f, struct nvmm_tx_vec *vec)
+{
+	loff_t pos = vec->offset, end = vec->offset + vec->len;
+	const char __user *buf = (const char __user *)(unsigned long)vec->buf;
+	unsigned long in_page;
+	struct nvmm_tx_page *p;
+	size_t bytes;
+
+	for (; pos < end; pos += bytes, buf += bytes) {
+		in_page = pos & ~PAGE_MASK;
+		bytes = min_t(size_t, end - pos, PAGE_SIZE - in_page);
+		p = nvmm_tx_page(tx, f, pos >> PAGE_SHIFT, bytes == PAGE_SIZE);
+		if (!p)
+			return -ENOSPC;
+		if (copy_from_user(p->data + in_page, buf, bytes))
+			return -EFAULT;
+		nvmm_flush_buffer(p->data + in_page, bytes, false);
+	}
+
+	if (end > f->size)
+		f->size = end;
+	return 0;
+}
+
+/*
+ * swap the staged pages in, the files are locked and i_alloc_mutex of
+ * each is held
+ * returns :
+ * 0 if success else error code, nothing is changed then
+ */
+static int nvmm_tx_commit(struct nvmm_tx *tx, struct nvmm_reclaim *rc)
+{
+	struct super_block *sb = tx->sb;
+	struct nvmm_tx_file *f;
+	struct nvmm_tx_page *p;
+	struct nvmm_inode *ni;
+	unsigned long i;
+	int err;
+
+	/*
+	 * the table pages first, a pte page shared with a clone is copied,
+	 * then the entries, no table page is replaced between both passes
+	 */
+	for (i = 0; i < tx->nr_files; i++) {
+		err = nvmm_alloc_blocks(tx->files[i].inode, 0);
+		if (err)
+			return err;
+	}
+	for (i = 0; i < tx->nr_pages; i++) {
+		p = &tx->pages[i];
+		err = nvmm_unshare_range(p->f->inode, p->blocknr, p->blocknr + 1, 0);
+		if (err)
+			return err;
+		if (!nvmm_file_pte_alloc(sb, p->f->inode, p->blocknr << PAGE_SHIFT))
+			return -ENOMEM;
+	}
+	for (i = 0; i < tx->nr_pages; i++) {
+		p = &tx->pages[i];
+		p->pte = nvmm_file_pte_alloc(sb, p->f->inode, p->blocknr << PAGE_SHIFT);
+	}
+
+	nvmm_journal_begin(sb);
+	for (i = 0; i < tx->nr_pages; i++) {
+		p = &tx->pages[i];
+		p->old = *p->pte;
+		nvmm_journal_add(sb, p->pte, pte_val(pfn_pte(__pa(p->data) >> PAGE_SHIFT, PAGE_KERNEL)));
+		if (pte_none(p->old))
+			p->f->blocks++;
+	}
+	for (i = 0; i < tx->nr_files; i++) {
+		f = &tx->files[i];
+		ni = nvmm_get_inode(sb, f->inode->i_ino);
+		nvmm_memunlock_inode(sb, ni);
+		if (f->size > i_size_read(f->inode))
+			nvmm_journal_add(sb, &ni->i_size, f->size);
+		nvmm_journal_add(sb, &ni->i_blocks, f->blocks);
+		nvmm_tc_invalidate(f->inode);
+	}
+	nvmm_journal_commit(sb);
+
+	for (i = 0; i < tx->nr_files; i++) {
+		f = &tx->files[i];
+		nvmm_memlock_inode(sb, nvmm_get_inode(sb, f->inode->i_ino));
+		f->inode->i_blocks = f->blocks;
+		if (f->size > i_size_read(f->inode))
+			i_size_write(f->inode, f->size);
+	}
+	for (i = 0; i < tx->nr_pages; i++) {
+		p = &tx->pages[i];
+		p->data = NULL;
+		if (!pte_none(p->old))
+			nvmm_reclaim_add(rc, __va((pte_val(p->old) & 0x0fffffffffffffff) & PAGE_MASK));
+	}
+	return 0;
+}
+
+/*
+ * the old pages may still be in the TLB of the VA window and in the
+ * user mappings of the files
+ */
+static void nvmm_tx_unmap(struct nvmm_tx *tx)
+{
+	struct nvmm_tx_page *p;
+	unsigned long i, vaddr;
+
+	for (i = 0; i < tx->nr_pages; i++) {
+		p = &tx->pages[i];
+		vaddr = (unsigned long)NVMM_I(p->f->inode)->i_virt_addr;
+		if (vaddr && p->blocknr < (MAX_FILE_SIZE >> PAGE_SHIFT))
+			flush_tlb_kernel_range(vaddr + (p->blocknr << PAGE_SHIFT),
+					vaddr + ((p->blocknr + 1) << PAGE_SHIFT));
+		unmap_mapping_range(p->f->inode->i_mapping, (loff_t)p->blocknr << PAGE_SHIFT,
+				PAGE_SIZE, 1);
+	}
+}
+
+/*
+ * input :
+ * @filp : any file of the file system
+ * @arg : user copy of struct nvmm_tx_writev
+ * returns :
+ * 0 if every write is done, else error code and none is
+ * the files are locked in the order of their inodes, with the per super
+ * block s_tx_mutex held around, so two transactions never wait for each
+ * other, then the writes are checked, staged and committed at once. Once
+ * the files are locked s_tx_mutex is released, the copies from the user
+ * buffers and the commit of one transaction do not hold the others.
+ */
+long nvmm_ioctl_tx_writev(struct file *filp, struct nvmm_tx_writev __user *arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	struct nvmm_sb_info *nsi = NVMM_SB(sb);
+	struct nvmm_tx_writev args;
+	struct nvmm_tx_vec *vecs;
+	struct inode **inodes;
+	struct nvmm_reclaim *rc = NULL;
+	struct nvmm_tx_file *f;
+	struct nvmm_tx *tx;
+	unsigned long i, pages = 0;
+	long err;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (!args.nr)
+		return 0;
+	if (args.nr > UIO_MAXIOV)
+		return -EINVAL;
+
+	vecs = kmalloc(args.nr * (sizeof(*vecs) + sizeof(*inodes)), GFP_KERNEL);
+	if (!vecs)
+		return -ENOMEM;
+	inodes = (struct inode **)(vecs + args.nr);
+	err = -EFAULT;
+	if (copy_from_user(vecs, (void __user *)(unsigned long)args.vecs, args.nr * sizeof(*vecs)))
+		goto out_vecs;
+
+	err = -EINVAL;
+	for (i = 0; i < args.nr; i++) {
+		if ((loff_t)vecs[i].offset < 0 || (loff_t)vecs[i].len < 0 ||
+				vecs[i].offset + vecs[i].len < vecs[i].offset)
+			goto out_vecs;
+		if (vecs[i].offset + vecs[i].len > sb->s_maxbytes) {
+			err = -EFBIG;
+			goto out_vecs;
+		}
+		if (vecs[i].len)
+			pages += ((vecs[i].offset + vecs[i].len + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+				(vecs[i].offset >> PAGE_SHIFT);
+	}
+	/* one record a page, two a file, one commit record for them all */
+	err = -E2BIG;
+	if (pages + 2 * min_t(unsigned long, args.nr, NVMM_TX_MAX_FILES) > NVMM_JOURNAL_RECS)
+		goto out_vecs;
+
+	err = -ENOMEM;
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	if (!tx)
+		goto out_vecs;
+	tx->sb = sb;
+	hash_init(tx->hash);
+	tx->pages = kcalloc(pages + 1, sizeof(*tx->pages), GFP_KERNEL);
+	rc = nvmm_reclaim_alloc(sb, pages + 1);
+	if (!tx->pages || !rc)
+		goto out_tx;
+
+	for (i = 0; i < args.nr; i++) {
+		err = nvmm_tx_add_file(tx, vecs[i].fd, &inodes[i]);
+		if (err)
+			goto out_files;
+	}
+	sort(tx->files, tx->nr_files, sizeof(tx->files[0]), nvmm_tx_cmp_file, NULL);
+
+	mutex_lock(&nsi->s_tx_mutex);
+	for (i = 0; i < tx->nr_files; i++) {
+		f = &tx->files[i];
+		mutex_lock_nest_lock(&f->inode->i_mutex, &nsi->s_tx_mutex);
+		/* writers inside the file run without i_mutex, wait for them */
+		nvmm_range_lock(&NVMM_I(f->inode)->i_range_lock, &f->range, 0, ULONG_MAX);
+		/* the staged pages start from blocks holding the logged bytes */
+		if (!err)
+			err = nvmm_log_fold(f->inode);
+		f->size = i_size_read(f->inode);
+		f->blocks = f->inode->i_blocks;
+	}
+	mutex_unlock(&nsi->s_tx_mutex);
+
+	if (!err)
+		err = nvmm_tx_checks(tx, vecs, inodes, args.nr);
+	for (i = 0; i < args.nr && !err; i++)
+		if (vecs[i].len)
+			err = nvmm_tx_stage(tx, nvmm_tx_find_file(tx, inodes[i]), &vecs[i]);
+
+	if (!err) {
+		/* the files are held, so are the i_alloc_mutex of their writers */
+		for (i = 0; i < tx->nr_files; i++)
+			mutex_lock_nest_lock(&NVMM_I(tx->files[i].inode)->i_alloc_mutex,
+					&tx->files[0].inode->i_mutex);
+		err = nvmm_tx_commit(tx, rc);
+		for (i = tx->nr_files; i--; )
+			mutex_unlock(&NVMM_I(tx->files[i].inode)->i_alloc_mutex);
+	}
+	if (!err)
+		nvmm_tx_unmap(tx);
+
+	for (i = tx->nr_files; i--; ) {
+		f = &tx->files[i];
+		if (!err)
+			nvmm_update_inode(f->inode);
+		nvmm_range_unlock(&NVMM_I(f->inode)->i_range_lock, &f->range);
+		mutex_unlock(&f->inode->i_mutex);
+	}
+
+	/* the replaced pages go once the readers of the moment are gone */
+	nvmm_reclaim_defer(rc);
+	rc = NULL;
+
+out_files:
+	for (i = 0; i < tx->nr_pages; i++)
+		if (tx->pages[i].data)
+			nvmm_shadow_put(sb, tx->pages[i].data);
+	for (i = 0; i < tx->nr_files; i++) {
+		mnt_drop_write_file(tx->files[i].file);
+		fput(tx->files[i].file);
+	}
+out_tx:
+	kfree(rc);
+	kfree(tx->pages);
+	kfree(tx);
+out_vecs:
+	kfree(vecs);
+	return err;
+}